@@ -0,0 +1,493 @@
+//
+// Copyright © 2017 Constanze Pfennig. All rights reserved.
+//
+
+#pragma once
+
+#include "vector.h"
+#include "simd.h"
+#include "streaming.h"
+#include "instrumentation.h"
+
+#include <cstdint>
+#include <cstddef>
+
+
+// Colors are stored as rgba8 (8 bits per channel) or as vector4f with channels in [0, 1].
+// Blending functions expect premultiplied alpha. Packed 32-bit pixels hold red in the lowest byte,
+// so their memory layout on little endian machines matches rgba8.
+// The SSE2 array conversions take a store_mode, which by default streams the results of arrays beyond
+// the last level cache past it.
+
+namespace nuts
+{
+  namespace math
+  {
+    using rgba8 = vector<std::uint8_t, 4>;
+
+
+    namespace detail
+    {
+      // Exact rounded division by 255 for values up to 255 * 255.
+      inline std::uint8_t div255(std::uint32_t val)
+      {
+        val += 128;
+        return static_cast<std::uint8_t>((val + (val >> 8)) >> 8);
+      }
+
+      inline float clamp_unit(float val)
+      {
+        // Written so that NaN ends up as 0.
+        return val > 0.f ? (val < 1.f ? val : 1.f) : 0.f;
+      }
+
+      inline std::uint8_t quantize_unit(float val)
+      {
+        return static_cast<std::uint8_t>(std::lrint(clamp_unit(val) * 255.f));
+      }
+
+      inline float srgb_to_linear(float val)
+      {
+        return val <= 0.04045f ? val / 12.92f : std::pow((val + 0.055f) / 1.055f, 2.4f);
+      }
+
+      inline float linear_to_srgb(float val)
+      {
+        return val <= 0.0031308f ? val * 12.92f : 1.055f * std::pow(val, 1.f / 2.4f) - 0.055f;
+      }
+
+      inline const std::array<float, 256>& srgb_to_linear_table()
+      {
+        static const auto table = []
+        {
+          std::array<float, 256> result;
+
+          for(std::size_t index = 0; index < result.size(); ++index)
+          {
+            result[index] = srgb_to_linear(static_cast<float>(index) / 255.f);
+          }
+
+          return result;
+        }();
+
+        return table;
+      }
+
+      // Indexed by the quantized linear value, the result is at most one step off the exact conversion.
+      constexpr std::size_t linear_to_srgb_table_size = 4096;
+
+      inline const std::array<std::uint8_t, linear_to_srgb_table_size>& linear_to_srgb_table()
+      {
+        static const auto table = []
+        {
+          std::array<std::uint8_t, linear_to_srgb_table_size> result;
+
+          for(std::size_t index = 0; index < result.size(); ++index)
+          {
+            result[index] = quantize_unit(linear_to_srgb(static_cast<float>(index) / (linear_to_srgb_table_size - 1)));
+          }
+
+          return result;
+        }();
+
+        return table;
+      }
+
+      inline std::uint8_t linear_to_srgb8(const std::array<std::uint8_t, linear_to_srgb_table_size>& table, float val)
+      {
+        return table[static_cast<std::size_t>(std::lrint(clamp_unit(val) * (linear_to_srgb_table_size - 1)))];
+      }
+
+#if defined(NUTS_MATH_SSE2)
+      inline __m128i div255(__m128i val)
+      {
+        val = _mm_add_epi16(val, _mm_set1_epi16(128));
+        return _mm_srli_epi16(_mm_add_epi16(val, _mm_srli_epi16(val, 8)), 8);
+      }
+
+      inline __m128i broadcast_alpha(__m128i val)
+      {
+        return _mm_shufflehi_epi16(_mm_shufflelo_epi16(val, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+      }
+#endif
+    }
+
+
+    inline std::uint32_t pack_rgba8(const rgba8& color)
+    {
+      return static_cast<std::uint32_t>(color[0]) | static_cast<std::uint32_t>(color[1]) << 8 |
+        static_cast<std::uint32_t>(color[2]) << 16 | static_cast<std::uint32_t>(color[3]) << 24;
+    }
+
+    inline rgba8 unpack_rgba8(std::uint32_t pixel)
+    {
+      return rgba8{pixel & 0xff, pixel >> 8 & 0xff, pixel >> 16 & 0xff, pixel >> 24};
+    }
+
+    inline vector4f normalize_rgba8(const rgba8& color)
+    {
+      return vector4f{color[0] * (1.f / 255.f), color[1] * (1.f / 255.f), color[2] * (1.f / 255.f), color[3] * (1.f / 255.f)};
+    }
+
+    inline rgba8 quantize_rgba8(const vector4f& color)
+    {
+      return rgba8{detail::quantize_unit(color[0]), detail::quantize_unit(color[1]), detail::quantize_unit(color[2]), detail::quantize_unit(color[3])};
+    }
+
+    inline vector4f srgb_to_linear(const rgba8& color)
+    {
+      const auto& table = detail::srgb_to_linear_table();
+      return vector4f{table[color[0]], table[color[1]], table[color[2]], color[3] / 255.f};
+    }
+
+    inline rgba8 linear_to_srgb(const vector4f& color)
+    {
+      const auto& table = detail::linear_to_srgb_table();
+      return rgba8{detail::linear_to_srgb8(table, color[0]), detail::linear_to_srgb8(table, color[1]), detail::linear_to_srgb8(table, color[2]), detail::quantize_unit(color[3])};
+    }
+
+    inline rgba8 premultiply(const rgba8& color)
+    {
+      return rgba8{detail::div255(color[0] * color[3]), detail::div255(color[1] * color[3]), detail::div255(color[2] * color[3]), color[3]};
+    }
+
+    inline rgba8 unpremultiply(const rgba8& color)
+    {
+      if(color[3] == 0)
+        return rgba8{0, 0, 0, 0};
+
+      const auto channel = [alpha = static_cast<unsigned>(color[3])](unsigned val)
+      {
+        return static_cast<std::uint8_t>(std::min((val * 255 + alpha / 2) / alpha, 255u));
+      };
+
+      return rgba8{channel(color[0]), channel(color[1]), channel(color[2]), color[3]};
+    }
+
+    inline vector4f premultiply(const vector4f& color)
+    {
+      return vector4f{color[0] * color[3], color[1] * color[3], color[2] * color[3], color[3]};
+    }
+
+    inline rgba8 blend_over(const rgba8& src, const rgba8& dst)
+    {
+      const auto inverse_alpha = 255u - src[3];
+      rgba8 result;
+
+      for(std::size_t index = 0; index < 4; ++index)
+      {
+        result[index] = static_cast<std::uint8_t>(std::min<std::uint32_t>(src[index] + detail::div255(dst[index] * inverse_alpha), 255u));
+      }
+
+      return result;
+    }
+
+    inline vector4f blend_over(const vector4f& src, const vector4f& dst)
+    {
+      const auto inverse_alpha = 1.f - src[3];
+      return vector4f{src[0] + dst[0] * inverse_alpha, src[1] + dst[1] * inverse_alpha, src[2] + dst[2] * inverse_alpha, src[3] + dst[3] * inverse_alpha};
+    }
+
+
+    inline void pack_rgba8(const rgba8* first, std::uint32_t* result, std::size_t count)
+    {
+      NUTS_INSTRUMENT(pack_rgba8, count, count * (sizeof(rgba8) + sizeof(std::uint32_t)));
+
+      for(std::size_t index = 0; index < count; ++index)
+      {
+        result[index] = pack_rgba8(first[index]);
+      }
+    }
+
+    inline void unpack_rgba8(const std::uint32_t* first, rgba8* result, std::size_t count)
+    {
+      NUTS_INSTRUMENT(unpack_rgba8, count, count * (sizeof(std::uint32_t) + sizeof(rgba8)));
+
+      for(std::size_t index = 0; index < count; ++index)
+      {
+        result[index] = unpack_rgba8(first[index]);
+      }
+    }
+
+    inline void normalize_rgba8(const rgba8* first, vector4f* result, std::size_t count, store_mode mode = store_mode::automatic)
+    {
+      NUTS_INSTRUMENT(normalize_rgba8, count, count * (sizeof(rgba8) + sizeof(vector4f)));
+
+      std::size_t index = 0;
+
+#if defined(NUTS_MATH_SSE2)
+      const auto zero = _mm_setzero_si128();
+      const auto scale = _mm_set1_ps(1.f / 255.f);
+
+      detail::with_store_mode(mode, result, count * (sizeof(rgba8) + sizeof(vector4f)), [&](auto stores)
+      {
+        for(; index + 4 <= count; index += 4)
+        {
+          detail::prefetch(first + index, stores);
+
+          const auto pixels = _mm_loadu_si128(reinterpret_cast<const __m128i*>(first + index));
+          const auto lo = _mm_unpacklo_epi8(pixels, zero);
+          const auto hi = _mm_unpackhi_epi8(pixels, zero);
+          auto out = reinterpret_cast<float*>(result + index);
+
+          detail::store(out, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(lo, zero)), scale), stores);
+          detail::store(out + 4, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(lo, zero)), scale), stores);
+          detail::store(out + 8, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(hi, zero)), scale), stores);
+          detail::store(out + 12, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(hi, zero)), scale), stores);
+        }
+      });
+#else
+      static_cast<void>(mode);
+#endif
+
+      for(; index < count; ++index)
+      {
+        result[index] = normalize_rgba8(first[index]);
+      }
+    }
+
+    inline void quantize_rgba8(const vector4f* first, rgba8* result, std::size_t count, store_mode mode = store_mode::automatic)
+    {
+      NUTS_INSTRUMENT(quantize_rgba8, count, count * (sizeof(vector4f) + sizeof(rgba8)));
+
+      std::size_t index = 0;
+
+#if defined(NUTS_MATH_SSE2)
+      const auto scale = _mm_set1_ps(255.f);
+      const auto zero = _mm_setzero_ps();
+      const auto one = _mm_set1_ps(1.f);
+
+      // maxps returns its second operand for NaN, so NaN channels become 0 like in the scalar path.
+      const auto convert = [&](const float* in)
+      {
+        return _mm_cvtps_epi32(_mm_mul_ps(_mm_min_ps(_mm_max_ps(_mm_loadu_ps(in), zero), one), scale));
+      };
+
+      detail::with_store_mode(mode, result, count * (sizeof(vector4f) + sizeof(rgba8)), [&](auto stores)
+      {
+        for(; index + 4 <= count; index += 4)
+        {
+          const auto in = reinterpret_cast<const float*>(first + index);
+          detail::prefetch(in, stores);
+
+          const auto lo = _mm_packs_epi32(convert(in), convert(in + 4));
+          const auto hi = _mm_packs_epi32(convert(in + 8), convert(in + 12));
+          detail::store(reinterpret_cast<__m128i*>(result + index), _mm_packus_epi16(lo, hi), stores);
+        }
+      });
+#else
+      static_cast<void>(mode);
+#endif
+
+      for(; index < count; ++index)
+      {
+        result[index] = quantize_rgba8(first[index]);
+      }
+    }
+
+    // The sRGB conversions go through lookup tables. SSE2 has no gather, so the table reads stay scalar;
+    // the alpha channel of four pixels and the clamped table indices of a pixel are computed in SSE2.
+    inline void srgb_to_linear(const rgba8* first, vector4f* result, std::size_t count)
+    {
+      NUTS_INSTRUMENT(srgb_to_linear, count, count * (sizeof(rgba8) + sizeof(vector4f)));
+
+      const auto& table = detail::srgb_to_linear_table();
+      std::size_t index = 0;
+
+#if defined(NUTS_MATH_SSE2)
+      const auto scale = _mm_set1_ps(255.f);
+
+      for(; index + 4 <= count; index += 4)
+      {
+        const auto pixels = _mm_loadu_si128(reinterpret_cast<const __m128i*>(first + index));
+        const auto color = first + index;
+
+        // Channel vectors of four pixels, transposed into pixels. Alpha is divided rather than scaled
+        // by 1 / 255, to match the scalar path exactly.
+        auto red = _mm_setr_ps(table[color[0][0]], table[color[1][0]], table[color[2][0]], table[color[3][0]]);
+        auto green = _mm_setr_ps(table[color[0][1]], table[color[1][1]], table[color[2][1]], table[color[3][1]]);
+        auto blue = _mm_setr_ps(table[color[0][2]], table[color[1][2]], table[color[2][2]], table[color[3][2]]);
+        auto alpha = _mm_div_ps(_mm_cvtepi32_ps(_mm_srli_epi32(pixels, 24)), scale);
+        _MM_TRANSPOSE4_PS(red, green, blue, alpha);
+
+        auto out = reinterpret_cast<float*>(result + index);
+        _mm_storeu_ps(out, red);
+        _mm_storeu_ps(out + 4, green);
+        _mm_storeu_ps(out + 8, blue);
+        _mm_storeu_ps(out + 12, alpha);
+      }
+#endif
+
+      for(; index < count; ++index)
+      {
+        const auto& color = first[index];
+        result[index] = vector4f{table[color[0]], table[color[1]], table[color[2]], color[3] / 255.f};
+      }
+    }
+
+    inline void linear_to_srgb(const vector4f* first, rgba8* result, std::size_t count)
+    {
+      NUTS_INSTRUMENT(linear_to_srgb, count, count * (sizeof(vector4f) + sizeof(rgba8)));
+
+      const auto& table = detail::linear_to_srgb_table();
+      std::size_t index = 0;
+
+#if defined(NUTS_MATH_SSE2)
+      // Table indices for the color channels, alpha quantized directly; NaN clamps to 0 as in quantize_rgba8.
+      constexpr auto steps = static_cast<float>(detail::linear_to_srgb_table_size - 1);
+      const auto scale = _mm_setr_ps(steps, steps, steps, 255.f);
+      const auto zero = _mm_setzero_ps();
+      const auto one = _mm_set1_ps(1.f);
+      alignas(16) std::array<std::int32_t, 4> quantized;
+
+      for(; index < count; ++index)
+      {
+        const auto in = _mm_loadu_ps(first[index].data());
+        _mm_store_si128(reinterpret_cast<__m128i*>(quantized.data()), _mm_cvtps_epi32(_mm_mul_ps(_mm_min_ps(_mm_max_ps(in, zero), one), scale)));
+
+        result[index] = rgba8{table[static_cast<std::size_t>(quantized[0])], table[static_cast<std::size_t>(quantized[1])],
+          table[static_cast<std::size_t>(quantized[2])], static_cast<std::uint8_t>(quantized[3])};
+      }
+#endif
+
+      for(; index < count; ++index)
+      {
+        const auto& color = first[index];
+        result[index] = rgba8{detail::linear_to_srgb8(table, color[0]), detail::linear_to_srgb8(table, color[1]), detail::linear_to_srgb8(table, color[2]), detail::quantize_unit(color[3])};
+      }
+    }
+
+    inline void premultiply(const rgba8* first, rgba8* result, std::size_t count, store_mode mode = store_mode::automatic)
+    {
+      NUTS_INSTRUMENT(premultiply, count, count * 2 * sizeof(rgba8));
+
+      std::size_t index = 0;
+
+#if defined(NUTS_MATH_SSE2)
+      const auto zero = _mm_setzero_si128();
+      const auto alpha_mask = _mm_set_epi16(-1, 0, 0, 0, -1, 0, 0, 0);
+
+      const auto apply = [&](__m128i val)
+      {
+        const auto scaled = detail::div255(_mm_mullo_epi16(val, detail::broadcast_alpha(val)));
+        return _mm_or_si128(_mm_andnot_si128(alpha_mask, scaled), _mm_and_si128(alpha_mask, val));
+      };
+
+      detail::with_store_mode(mode, result, count * 2 * sizeof(rgba8), [&](auto stores)
+      {
+        for(; index + 4 <= count; index += 4)
+        {
+          detail::prefetch(first + index, stores);
+
+          const auto pixels = _mm_loadu_si128(reinterpret_cast<const __m128i*>(first + index));
+          const auto lo = apply(_mm_unpacklo_epi8(pixels, zero));
+          const auto hi = apply(_mm_unpackhi_epi8(pixels, zero));
+          detail::store(reinterpret_cast<__m128i*>(result + index), _mm_packus_epi16(lo, hi), stores);
+        }
+      });
+#else
+      static_cast<void>(mode);
+#endif
+
+      for(; index < count; ++index)
+      {
+        result[index] = premultiply(first[index]);
+      }
+    }
+
+    inline void unpremultiply(const rgba8* first, rgba8* result, std::size_t count)
+    {
+      NUTS_INSTRUMENT(unpremultiply, count, count * 2 * sizeof(rgba8));
+
+      for(std::size_t index = 0; index < count; ++index)
+      {
+        result[index] = unpremultiply(first[index]);
+      }
+    }
+
+    inline void premultiply(const vector4f* first, vector4f* result, std::size_t count)
+    {
+      NUTS_INSTRUMENT(premultiply, count, count * 2 * sizeof(vector4f));
+
+      for(std::size_t index = 0; index < count; ++index)
+      {
+        result[index] = premultiply(first[index]);
+      }
+    }
+
+    // result may alias dst.
+    inline void blend_over(const rgba8* src, const rgba8* dst, rgba8* result, std::size_t count, store_mode mode = store_mode::automatic)
+    {
+      NUTS_INSTRUMENT(blend_over, count, count * 3 * sizeof(rgba8));
+
+      std::size_t index = 0;
+
+#if defined(NUTS_MATH_SSE2)
+      const auto zero = _mm_setzero_si128();
+      const auto opaque = _mm_set1_epi16(255);
+
+      const auto apply = [&](__m128i src_part, __m128i dst_part)
+      {
+        const auto inverse_alpha = _mm_sub_epi16(opaque, detail::broadcast_alpha(src_part));
+        return detail::div255(_mm_mullo_epi16(dst_part, inverse_alpha));
+      };
+
+      detail::with_store_mode(mode, result, count * 3 * sizeof(rgba8), [&](auto stores)
+      {
+        for(; index + 4 <= count; index += 4)
+        {
+          detail::prefetch(src + index, stores);
+          detail::prefetch(dst + index, stores);
+
+          const auto src_pixels = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + index));
+          const auto dst_pixels = _mm_loadu_si128(reinterpret_cast<const __m128i*>(dst + index));
+
+          const auto lo = apply(_mm_unpacklo_epi8(src_pixels, zero), _mm_unpacklo_epi8(dst_pixels, zero));
+          const auto hi = apply(_mm_unpackhi_epi8(src_pixels, zero), _mm_unpackhi_epi8(dst_pixels, zero));
+          detail::store(reinterpret_cast<__m128i*>(result + index), _mm_adds_epu8(src_pixels, _mm_packus_epi16(lo, hi)), stores);
+        }
+      });
+#else
+      static_cast<void>(mode);
+#endif
+
+      for(; index < count; ++index)
+      {
+        result[index] = blend_over(src[index], dst[index]);
+      }
+    }
+
+    // result may alias dst.
+    inline void blend_over(const vector4f* src, const vector4f* dst, vector4f* result, std::size_t count, store_mode mode = store_mode::automatic)
+    {
+      NUTS_INSTRUMENT(blend_over, count, count * 3 * sizeof(vector4f));
+
+      std::size_t index = 0;
+
+#if defined(NUTS_MATH_SSE2)
+      const auto one = _mm_set1_ps(1.f);
+
+      detail::with_store_mode(mode, result, count * 3 * sizeof(vector4f), [&](auto stores)
+      {
+        for(; index < count; ++index)
+        {
+          detail::prefetch(src + index, stores);
+          detail::prefetch(dst + index, stores);
+
+          const auto src_color = _mm_loadu_ps(src[index].data());
+          const auto dst_color = _mm_loadu_ps(dst[index].data());
+          const auto inverse_alpha = _mm_sub_ps(one, _mm_shuffle_ps(src_color, src_color, _MM_SHUFFLE(3, 3, 3, 3)));
+          detail::store(result[index].data(), _mm_add_ps(src_color, _mm_mul_ps(dst_color, inverse_alpha)), stores);
+        }
+      });
+#else
+      static_cast<void>(mode);
+#endif
+
+      for(; index < count; ++index)
+      {
+        result[index] = blend_over(src[index], dst[index]);
+      }
+    }
+  }
+}
@@ -0,0 +1,694 @@
+//
+// Copyright © 2017 Constanze Pfennig. All rights reserved.
+//
+
+#pragma once
+
+#include "vector.h"
+#include "simd.h"
+#include "instrumentation.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include <vector>
+
+
+// Lossless codecs for arrays of vectors that exploit that equal components of neighbouring vectors
+// are alike. All of them treat an array as flat components, so the previous value of a component is
+// Dimension places back.
+
+namespace nuts
+{
+  namespace math
+  {
+    namespace detail
+    {
+      template<typename T, std::size_t Dimension>
+      const T* flat(const std::vector<vector<T, Dimension>>& values) noexcept
+      {
+        static_assert(sizeof(vector<T, Dimension>) == Dimension * sizeof(T), "Vectors must be packed.");
+        return values.empty() ? nullptr : values.front().data();
+      }
+
+      template<typename T, std::size_t Dimension>
+      T* flat(std::vector<vector<T, Dimension>>& values) noexcept
+      {
+        return values.empty() ? nullptr : values.front().data();
+      }
+
+      template<typename T>
+      using unsigned_bits = std::conditional_t<sizeof(T) <= 4, std::uint32_t, std::uint64_t>;
+
+      // Fixed size fields in the byte order of the host; the formats are meant for little endian hosts.
+      template<typename Word>
+      Word load_le(const std::uint8_t* data) noexcept
+      {
+        Word result;
+        std::memcpy(&result, data, sizeof(Word));
+        return result;
+      }
+
+      template<typename Word>
+      void store_le(std::uint8_t* data, Word value) noexcept
+      {
+        std::memcpy(data, &value, sizeof(Word));
+      }
+
+      // Values decoded per pass before the running sums or XORs are applied, times Dimension; a multiple
+      // of four and of xor_block.
+      constexpr std::size_t decode_chunk = 1024;
+
+      inline int leading_zeros(std::uint64_t value, int bits) noexcept
+      {
+        assert(value != 0);
+#if defined(__GNUC__)
+        return __builtin_clzll(value) - (64 - bits);
+#else
+        int result = bits;
+
+        for(; value != 0; value >>= 1)
+        {
+          --result;
+        }
+
+        return result;
+#endif
+      }
+
+      inline int trailing_zeros(std::uint64_t value) noexcept
+      {
+        assert(value != 0);
+#if defined(__GNUC__)
+        return __builtin_ctzll(value);
+#else
+        int result = 0;
+
+        for(; (value & 1) == 0; value >>= 1)
+        {
+          ++result;
+        }
+
+        return result;
+#endif
+      }
+
+      // Stream VByte (Lemire, Kurz and Rupp 2017): 2 bit codes give the byte lengths of values, four per
+      // control byte, and the used low bytes of the values follow each other in a separate data stream.
+      // One control byte thus determines the shuffle that moves four 32 bit values at once. Codes select
+      // 1 to 4 bytes of 32 bit values and 1, 2, 4 or 8 bytes of 64 bit ones.
+      template<typename Bits>
+      constexpr std::size_t vbyte_length(unsigned code) noexcept
+      {
+        return sizeof(Bits) == 4 ? code + 1 : std::size_t{1} << code;
+      }
+
+      template<typename Bits>
+      unsigned vbyte_code(Bits value) noexcept
+      {
+        if constexpr(sizeof(Bits) == 4)
+          return (value > 0xff ? 1u : 0u) + (value > 0xffff ? 1u : 0u) + (value > 0xffffff ? 1u : 0u);
+        else
+          return value > 0xffffffff ? 3u : (value > 0xffff ? 2u : (value > 0xff ? 1u : 0u));
+      }
+
+#if defined(NUTS_MATH_SSSE3)
+      struct vbyte_tables
+      {
+        // Data bytes of the four 32 bit values of a control byte.
+        std::uint8_t length[256];
+        // pshufb masks that spread the data bytes over four lanes and gather four lanes into data bytes.
+        std::uint8_t decode[256][16];
+        std::uint8_t encode[256][16];
+      };
+
+      constexpr vbyte_tables make_vbyte_tables() noexcept
+      {
+        vbyte_tables result{};
+
+        for(unsigned control = 0; control < 256; ++control)
+        {
+          unsigned offset = 0;
+
+          for(unsigned lane = 0; lane < 4; ++lane)
+          {
+            const auto length = ((control >> (2 * lane)) & 3) + 1;
+
+            for(unsigned byte = 0; byte < 4; ++byte)
+            {
+              result.decode[control][4 * lane + byte] = static_cast<std::uint8_t>(byte < length ? offset + byte : 0x80);
+
+              if(byte < length)
+                result.encode[control][offset + byte] = static_cast<std::uint8_t>(4 * lane + byte);
+            }
+
+            offset += length;
+          }
+
+          for(auto byte = offset; byte < 16; ++byte)
+          {
+            result.encode[control][byte] = 0x80;
+          }
+
+          result.length[control] = static_cast<std::uint8_t>(offset);
+        }
+
+        return result;
+      }
+
+      inline constexpr vbyte_tables vbyte_table = make_vbyte_tables();
+#endif
+
+      // Writes the codes of count values to control and their bytes from data on and returns the end of
+      // the data. Whole values are stored, so data needs 16 bytes of room beyond its final size.
+      template<typename Bits>
+      std::uint8_t* vbyte_encode(const Bits* values, std::size_t count, std::uint8_t* control, std::uint8_t* data) noexcept
+      {
+        std::size_t index = 0;
+
+#if defined(NUTS_MATH_SSSE3)
+        if constexpr(sizeof(Bits) == 4)
+        {
+          const auto zero = _mm_setzero_si128();
+          const auto three = _mm_set1_epi32(3);
+
+          for(; index + 4 <= count; index += 4)
+          {
+            const auto val = _mm_loadu_si128(reinterpret_cast<const __m128i*>(values + index));
+
+            // 3 minus one for every high byte that is zero together with all above it.
+            auto codes = _mm_add_epi32(three, _mm_cmpeq_epi32(_mm_srli_epi32(val, 8), zero));
+            codes = _mm_add_epi32(codes, _mm_cmpeq_epi32(_mm_srli_epi32(val, 16), zero));
+            codes = _mm_add_epi32(codes, _mm_cmpeq_epi32(_mm_srli_epi32(val, 24), zero));
+
+            // One code per byte, then the 2 bit fields moved together.
+            const auto lanes = static_cast<std::uint32_t>(_mm_cvtsi128_si32(_mm_packus_epi16(_mm_packs_epi32(codes, zero), zero)));
+            const auto code = (lanes | lanes >> 6 | lanes >> 12 | lanes >> 18) & 0xff;
+
+            control[index / 4] = static_cast<std::uint8_t>(code);
+            const auto shuffle = _mm_loadu_si128(reinterpret_cast<const __m128i*>(vbyte_table.encode[code]));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(data), _mm_shuffle_epi8(val, shuffle));
+            data += vbyte_table.length[code];
+          }
+        }
+#endif
+
+        for(; index < count; ++index)
+        {
+          if(index % 4 == 0)
+            control[index / 4] = 0;
+
+          const auto code = vbyte_code(values[index]);
+          control[index / 4] = static_cast<std::uint8_t>(control[index / 4] | code << (2 * (index % 4)));
+          store_le(data, values[index]);
+          data += vbyte_length<Bits>(code);
+        }
+
+        return data;
+      }
+
+      // Reads count values whose codes start at control and returns the end of their data.
+      template<typename Bits>
+      const std::uint8_t* vbyte_decode(const std::uint8_t* control, const std::uint8_t* data, const std::uint8_t* end, Bits* values, std::size_t count) noexcept
+      {
+        std::size_t index = 0;
+
+#if defined(NUTS_MATH_SSSE3)
+        if constexpr(sizeof(Bits) == 4)
+        {
+          // A group of four needs at most 16 bytes; the last ones are left to the bounds checked loop.
+          for(; index + 4 <= count && end - data >= 16; index += 4)
+          {
+            const auto code = control[index / 4];
+            const auto bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data));
+            const auto shuffle = _mm_loadu_si128(reinterpret_cast<const __m128i*>(vbyte_table.decode[code]));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(values + index), _mm_shuffle_epi8(bytes, shuffle));
+            data += vbyte_table.length[code];
+          }
+        }
+#endif
+
+        for(; index < count; ++index)
+        {
+          const auto code = (control[index / 4] >> (2 * (index % 4))) & 3u;
+          const auto length = vbyte_length<Bits>(code);
+          assert(static_cast<std::size_t>(end - data) >= length);
+
+          Bits value = 0;
+
+          if(static_cast<std::size_t>(end - data) >= sizeof(Bits))
+          {
+            value = load_le<Bits>(data);
+
+            if(length < sizeof(Bits))
+              value &= static_cast<Bits>((Bits{1} << (8 * length)) - 1);
+          }
+          else
+          {
+            std::memcpy(&value, data, length);
+          }
+
+          values[index] = value;
+          data += length;
+        }
+
+        return data;
+      }
+
+      // XOR blocks: xor_block consecutive values share one window of meaningful bits, from the lowest to
+      // the highest bit set in any of them. A block is stored as the trailing zero count and the width of
+      // the window, one byte each, followed by the values shifted down by the former and packed at width
+      // bits each from the lowest bit up. Every value is found at a fixed bit offset, without serial
+      // dependencies between values.
+      constexpr std::size_t xor_block = 64;
+
+      template<typename Bits>
+      std::uint8_t* xor_pack(const Bits* values, std::size_t count, std::uint8_t* output) noexcept
+      {
+        constexpr int bits = sizeof(Bits) * 8;
+
+        Bits any = 0;
+
+        for(std::size_t index = 0; index < count; ++index)
+        {
+          any |= values[index];
+        }
+
+        if(any == 0)
+        {
+          output[0] = 0;
+          output[1] = 0;
+          return output + 2;
+        }
+
+        const auto trail = trailing_zeros(any);
+        const auto width = bits - leading_zeros(any, bits) - trail;
+
+        output[0] = static_cast<std::uint8_t>(trail);
+        output[1] = static_cast<std::uint8_t>(width);
+        output += 2;
+
+        std::uint64_t buffer = 0;
+        int filled = 0;
+
+        for(std::size_t index = 0; index < count; ++index)
+        {
+          const auto value = static_cast<std::uint64_t>(values[index] >> trail);
+          buffer |= value << filled;
+
+          if(filled + width >= 64)
+          {
+            store_le(output, buffer);
+            output += 8;
+            buffer = filled > 0 ? value >> (64 - filled) : 0;
+            filled += width - 64;
+          }
+          else
+          {
+            filled += width;
+          }
+        }
+
+        const auto rest = static_cast<std::size_t>((filled + 7) / 8);
+        std::memcpy(output, &buffer, rest);
+        return output + rest;
+      }
+
+      // Reads whole words at the bit offsets of the values, up to 8 bytes beyond the block.
+      template<typename Bits>
+      const std::uint8_t* xor_unpack(const std::uint8_t* input, Bits* values, std::size_t count) noexcept
+      {
+        const int trail = input[0];
+        const int width = input[1];
+        input += 2;
+
+        if(width == 0)
+        {
+          std::fill(values, values + count, Bits{0});
+          return input;
+        }
+
+        const auto mask = width == 64 ? ~std::uint64_t{0} : (std::uint64_t{1} << width) - 1;
+
+        if(width <= 57)
+        {
+          for(std::size_t index = 0; index < count; ++index)
+          {
+            const auto bit = index * static_cast<std::size_t>(width);
+            const auto word = load_le<std::uint64_t>(input + bit / 8) >> (bit % 8);
+            values[index] = static_cast<Bits>((word & mask) << trail);
+          }
+        }
+        else
+        {
+          // Wider values can span nine bytes.
+          for(std::size_t index = 0; index < count; ++index)
+          {
+            const auto bit = index * static_cast<std::size_t>(width);
+            auto word = load_le<std::uint64_t>(input + bit / 8) >> (bit % 8);
+
+            if(bit % 8 + static_cast<std::size_t>(width) > 64)
+              word |= static_cast<std::uint64_t>(input[bit / 8 + 8]) << (64 - bit % 8);
+
+            values[index] = static_cast<Bits>((word & mask) << trail);
+          }
+        }
+
+        return input + (count * static_cast<std::size_t>(width) + 7) / 8;
+      }
+    }
+
+
+    // Byte shuffle: the result holds one stream per component and byte, stream (component, byte)
+    // holding that byte of that component of every vector in order. Slowly changing components turn
+    // into long runs of equal high bytes for a following generic compressor. Four byte components are
+    // transposed 16 vectors at a time in SSE2 registers.
+    template<typename T, std::size_t Dimension>
+    void shuffle_bytes(const std::vector<vector<T, Dimension>>& values, std::vector<std::uint8_t>& result)
+    {
+      const auto count = values.size();
+      const auto* const input = reinterpret_cast<const std::uint8_t*>(detail::flat(values));
+      constexpr auto stride = Dimension * sizeof(T);
+
+      result.resize(count * stride);
+
+      for(std::size_t component = 0; component < Dimension; ++component)
+      {
+        auto* const output = result.data() + component * sizeof(T) * count;
+        const auto* const source = input + component * sizeof(T);
+        std::size_t index = 0;
+
+#if defined(NUTS_MATH_SSE2)
+        if(sizeof(T) == 4)
+        {
+          for(; index + 16 <= count; index += 16)
+          {
+            alignas(16) std::uint32_t words[16];
+
+            for(std::size_t word = 0; word < 16; ++word)
+            {
+              std::memcpy(&words[word], source + (index + word) * stride, 4);
+            }
+
+            const auto* const block = reinterpret_cast<const __m128i*>(words);
+            const auto t0 = _mm_unpacklo_epi8(_mm_load_si128(block + 0), _mm_load_si128(block + 1));
+            const auto t1 = _mm_unpackhi_epi8(_mm_load_si128(block + 0), _mm_load_si128(block + 1));
+            const auto t2 = _mm_unpacklo_epi8(_mm_load_si128(block + 2), _mm_load_si128(block + 3));
+            const auto t3 = _mm_unpackhi_epi8(_mm_load_si128(block + 2), _mm_load_si128(block + 3));
+
+            // Bytes 0 and 1, then 2 and 3 of eight words each.
+            const auto x0 = _mm_unpacklo_epi8(_mm_unpacklo_epi8(t0, t1), _mm_unpackhi_epi8(t0, t1));
+            const auto x1 = _mm_unpackhi_epi8(_mm_unpacklo_epi8(t0, t1), _mm_unpackhi_epi8(t0, t1));
+            const auto y0 = _mm_unpacklo_epi8(_mm_unpacklo_epi8(t2, t3), _mm_unpackhi_epi8(t2, t3));
+            const auto y1 = _mm_unpackhi_epi8(_mm_unpacklo_epi8(t2, t3), _mm_unpackhi_epi8(t2, t3));
+
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(output + 0 * count + index), _mm_unpacklo_epi64(x0, y0));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(output + 1 * count + index), _mm_unpackhi_epi64(x0, y0));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(output + 2 * count + index), _mm_unpacklo_epi64(x1, y1));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(output + 3 * count + index), _mm_unpackhi_epi64(x1, y1));
+          }
+        }
+#endif
+
+        for(; index < count; ++index)
+        {
+          for(std::size_t byte = 0; byte < sizeof(T); ++byte)
+          {
+            output[byte * count + index] = source[index * stride + byte];
+          }
+        }
+      }
+
+      NUTS_INSTRUMENT(shuffle_bytes, count, 2 * result.size());
+    }
+
+    // Inverse of shuffle_bytes; the vector count follows from the size of data.
+    template<typename T, std::size_t Dimension>
+    void unshuffle_bytes(const std::vector<std::uint8_t>& data, std::vector<vector<T, Dimension>>& result)
+    {
+      constexpr auto stride = Dimension * sizeof(T);
+      assert(data.size() % stride == 0);
+
+      const auto count = data.size() / stride;
+      result.resize(count);
+
+      auto* const output = reinterpret_cast<std::uint8_t*>(detail::flat(result));
+
+      for(std::size_t component = 0; component < Dimension; ++component)
+      {
+        const auto* const input = data.data() + component * sizeof(T) * count;
+        auto* const target = output + component * sizeof(T);
+        std::size_t index = 0;
+
+#if defined(NUTS_MATH_SSE2)
+        if(sizeof(T) == 4)
+        {
+          for(; index + 16 <= count; index += 16)
+          {
+            const auto s0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(input + 0 * count + index));
+            const auto s1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(input + 1 * count + index));
+            const auto s2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(input + 2 * count + index));
+            const auto s3 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(input + 3 * count + index));
+
+            // Low and high halves of eight words each, then interleaved into whole words.
+            const auto low0 = _mm_unpacklo_epi8(s0, s1);
+            const auto low1 = _mm_unpackhi_epi8(s0, s1);
+            const auto high0 = _mm_unpacklo_epi8(s2, s3);
+            const auto high1 = _mm_unpackhi_epi8(s2, s3);
+
+            alignas(16) std::uint32_t words[16];
+            auto* const block = reinterpret_cast<__m128i*>(words);
+            _mm_store_si128(block + 0, _mm_unpacklo_epi16(low0, high0));
+            _mm_store_si128(block + 1, _mm_unpackhi_epi16(low0, high0));
+            _mm_store_si128(block + 2, _mm_unpacklo_epi16(low1, high1));
+            _mm_store_si128(block + 3, _mm_unpackhi_epi16(low1, high1));
+
+            for(std::size_t word = 0; word < 16; ++word)
+            {
+              std::memcpy(target + (index + word) * stride, &words[word], 4);
+            }
+          }
+        }
+#endif
+
+        for(; index < count; ++index)
+        {
+          for(std::size_t byte = 0; byte < sizeof(T); ++byte)
+          {
+            target[index * stride + byte] = input[byte * count + index];
+          }
+        }
+      }
+
+      NUTS_INSTRUMENT(unshuffle_bytes, count, 2 * data.size());
+    }
+
+    // Integer vectors: every component is replaced by its difference to the same component of the
+    // previous vector, zigzag mapped so small negative differences stay small. After the vector count
+    // as 8 bytes, the differences follow as Stream VByte (detail::vbyte_encode): all 2 bit length codes
+    // first, then the used low bytes of every difference. Differences and zigzag of 32 bit components
+    // run in SSE2; packing and unpacking of 32 bit differences run four at a time in SSSE3, as a pshufb
+    // selected by one control byte. 64 bit differences and builds without SSSE3 pack one at a time, but
+    // still without the serial byte by byte dependency of varints.
+    template<typename T, std::size_t Dimension>
+    void delta_encode(const std::vector<vector<T, Dimension>>& values, std::vector<std::uint8_t>& result)
+    {
+      static_assert(std::is_integral<T>::value, "Delta coding is for integer vectors.");
+
+      using bits_type = detail::unsigned_bits<T>;
+      using signed_type = std::make_signed_t<bits_type>;
+      constexpr auto bits = static_cast<int>(sizeof(bits_type) * 8);
+
+      const auto size = values.size() * Dimension;
+      const auto* const input = detail::flat(values);
+      std::vector<bits_type> zigzag(size);
+      std::size_t index = 0;
+
+      for(; index < std::min(size, Dimension); ++index)
+      {
+        const auto difference = static_cast<signed_type>(input[index]);
+        zigzag[index] = (static_cast<bits_type>(difference) << 1) ^ static_cast<bits_type>(difference >> (bits - 1));
+      }
+
+#if defined(NUTS_MATH_SSE2)
+      if(sizeof(T) == 4)
+      {
+        for(; index + 4 <= size; index += 4)
+        {
+          const auto current = _mm_loadu_si128(reinterpret_cast<const __m128i*>(input + index));
+          const auto previous = _mm_loadu_si128(reinterpret_cast<const __m128i*>(input + index - Dimension));
+          const auto difference = _mm_sub_epi32(current, previous);
+          _mm_storeu_si128(reinterpret_cast<__m128i*>(zigzag.data() + index), _mm_xor_si128(_mm_slli_epi32(difference, 1), _mm_srai_epi32(difference, 31)));
+        }
+      }
+#endif
+
+      for(; index < size; ++index)
+      {
+        const auto difference = static_cast<signed_type>(static_cast<bits_type>(input[index]) - static_cast<bits_type>(input[index - Dimension]));
+        zigzag[index] = (static_cast<bits_type>(difference) << 1) ^ static_cast<bits_type>(difference >> (bits - 1));
+      }
+
+      const auto control_bytes = (size + 3) / 4;
+
+      // Room for every difference at full width plus the 16 bytes a shuffled store may write past the data.
+      result.resize(8 + control_bytes + size * sizeof(bits_type) + 16);
+      detail::store_le(result.data(), static_cast<std::uint64_t>(values.size()));
+
+      auto* const control = result.data() + 8;
+      const auto* const end = detail::vbyte_encode(zigzag.data(), size, control, control + control_bytes);
+      result.resize(static_cast<std::size_t>(end - result.data()));
+
+      NUTS_INSTRUMENT(delta_encode, values.size(), values.size() * sizeof(vector<T, Dimension>) + result.size());
+    }
+
+    template<typename T, std::size_t Dimension>
+    void delta_decode(const std::vector<std::uint8_t>& data, std::vector<vector<T, Dimension>>& result)
+    {
+      static_assert(std::is_integral<T>::value, "Delta coding is for integer vectors.");
+
+      using bits_type = detail::unsigned_bits<T>;
+
+      assert(data.size() >= 8);
+      result.resize(static_cast<std::size_t>(detail::load_le<std::uint64_t>(data.data())));
+
+      const auto size = result.size() * Dimension;
+      const auto control_bytes = (size + 3) / 4;
+      assert(data.size() >= 8 + control_bytes);
+
+      const auto* const control = data.data() + 8;
+      const auto* input = control + control_bytes;
+      const auto* const end = data.data() + data.size();
+
+      auto* const output = detail::flat(result);
+      const auto chunk = detail::decode_chunk * Dimension;
+      std::vector<bits_type> decoded(std::min(size, chunk));
+      bits_type previous[Dimension] = {};
+
+      // Unpacked a chunk at a time while it stays in the L1 cache, then summed up per component.
+      for(std::size_t first = 0; first < size; first += chunk)
+      {
+        const auto count = std::min(chunk, size - first);
+        input = detail::vbyte_decode(control + first / 4, input, end, decoded.data(), count);
+
+        for(std::size_t index = 0; index < count; index += Dimension)
+        {
+          for(std::size_t component = 0; component < Dimension; ++component)
+          {
+            const auto zigzag = decoded[index + component];
+            previous[component] = static_cast<bits_type>(previous[component] + ((zigzag >> 1) ^ (~(zigzag & 1) + 1)));
+            output[first + index + component] = static_cast<T>(previous[component]);
+          }
+        }
+      }
+
+      NUTS_INSTRUMENT(delta_decode, result.size(), data.size() + result.size() * sizeof(vector<T, Dimension>));
+    }
+
+    // Floating point vectors: every component is XORed with the same component of the previous vector,
+    // which leaves the bits that changed. Like Gorilla (Pelkonen et al. 2015) only the meaningful bits
+    // between the leading and trailing zeros are stored, but with one window per block of 64 components
+    // (detail::xor_pack) rather than one per value, after the vector count as 8 bytes and followed by 8
+    // bytes of padding. That costs some ratio on data whose changes vary much in magnitude; in return
+    // every value sits at a fixed bit offset, so unpacking needs no serial bit reader and the XORs are
+    // undone per component in a chunk that stays in the L1 cache. The XORs are computed in SSE2.
+    template<typename T, std::size_t Dimension>
+    void xor_encode(const std::vector<vector<T, Dimension>>& values, std::vector<std::uint8_t>& result)
+    {
+      static_assert(std::is_floating_point<T>::value, "XOR coding is for floating point vectors.");
+
+      using bits_type = detail::unsigned_bits<T>;
+      static_assert(sizeof(bits_type) == sizeof(T), "Floating point type without a matching integer.");
+
+      const auto size = values.size() * Dimension;
+      std::vector<bits_type> xors(size);
+
+      if(size > 0)
+        std::memcpy(xors.data(), detail::flat(values), size * sizeof(T));
+
+      std::size_t index = size;
+
+#if defined(NUTS_MATH_SSE2)
+      if(sizeof(T) == 4)
+      {
+        // Backwards, so every XOR still reads the original previous value.
+        for(; index >= Dimension + 4; index -= 4)
+        {
+          auto* const current = reinterpret_cast<__m128i*>(xors.data() + index - 4);
+          const auto previous = _mm_loadu_si128(reinterpret_cast<const __m128i*>(xors.data() + index - 4 - Dimension));
+          _mm_storeu_si128(current, _mm_xor_si128(_mm_loadu_si128(current), previous));
+        }
+      }
+#endif
+
+      for(; index > Dimension; --index)
+      {
+        xors[index - 1] ^= xors[index - 1 - Dimension];
+      }
+
+      const auto blocks = (size + detail::xor_block - 1) / detail::xor_block;
+
+      result.resize(8 + 2 * blocks + size * sizeof(T) + 8);
+      detail::store_le(result.data(), static_cast<std::uint64_t>(values.size()));
+
+      auto* output = result.data() + 8;
+
+      for(std::size_t first = 0; first < size; first += detail::xor_block)
+      {
+        output = detail::xor_pack(xors.data() + first, std::min(detail::xor_block, size - first), output);
+      }
+
+      // Unpacking reads whole words at the offsets of the last values.
+      std::fill(output, output + 8, std::uint8_t{0});
+      result.resize(static_cast<std::size_t>(output + 8 - result.data()));
+
+      NUTS_INSTRUMENT(xor_encode, values.size(), values.size() * sizeof(vector<T, Dimension>) + result.size());
+    }
+
+    template<typename T, std::size_t Dimension>
+    void xor_decode(const std::vector<std::uint8_t>& data, std::vector<vector<T, Dimension>>& result)
+    {
+      static_assert(std::is_floating_point<T>::value, "XOR coding is for floating point vectors.");
+
+      using bits_type = detail::unsigned_bits<T>;
+
+      assert(data.size() >= 16);
+      result.resize(static_cast<std::size_t>(detail::load_le<std::uint64_t>(data.data())));
+
+      const auto size = result.size() * Dimension;
+      const auto* input = data.data() + 8;
+
+      auto* const output = detail::flat(result);
+      const auto chunk = detail::decode_chunk * Dimension;
+      std::vector<bits_type> decoded(std::min(size, chunk));
+      bits_type previous[Dimension] = {};
+
+      for(std::size_t first = 0; first < size; first += chunk)
+      {
+        const auto count = std::min(chunk, size - first);
+
+        for(std::size_t block = 0; block < count; block += detail::xor_block)
+        {
+          input = detail::xor_unpack(input, decoded.data() + block, std::min(detail::xor_block, count - block));
+          assert(input + 8 <= data.data() + data.size());
+        }
+
+        for(std::size_t index = 0; index < count; index += Dimension)
+        {
+          for(std::size_t component = 0; component < Dimension; ++component)
+          {
+            previous[component] ^= decoded[index + component];
+            decoded[index + component] = previous[component];
+          }
+        }
+
+        std::memcpy(output + first, decoded.data(), count * sizeof(T));
+      }
+
+      NUTS_INSTRUMENT(xor_decode, result.size(), data.size() + result.size() * sizeof(vector<T, Dimension>));
+    }
+  }
+}
@@ -0,0 +1,513 @@
+//
+// Copyright © 2017 Constanze Pfennig. All rights reserved.
+//
+
+#pragma once
+
+#include "vector.h"
+#include "instrumentation.h"
+#include "../parallel/parallel_for.h"
+
+#include <cstddef>
+
+
+// A dense 2-D or 3-D grid whose cells are stored in square / cubic tiles of TileExtent cells per axis.
+// Neighbouring cells along every axis therefore usually share a cache line or at least a page,
+// which keeps vertical stencils from streaming a whole row per cell.
+
+namespace nuts
+{
+  namespace math
+  {
+    enum class border_mode
+    {
+      clamp,
+      wrap,
+      mirror,
+      constant
+    };
+
+
+    namespace detail
+    {
+      constexpr std::size_t log2(std::size_t val)
+      {
+        return val <= 1 ? 0 : 1 + log2(val / 2);
+      }
+
+      constexpr std::size_t power(std::size_t base, std::size_t exponent)
+      {
+        return exponent == 0 ? 1 : base * power(base, exponent - 1);
+      }
+
+      inline int resolve_border(int coordinate, int extent, border_mode border)
+      {
+        switch(border)
+        {
+        case border_mode::wrap:
+          coordinate %= extent;
+          return coordinate < 0 ? coordinate + extent : coordinate;
+
+        case border_mode::mirror:
+        {
+          if(extent == 1)
+            return 0;
+
+          const auto period = 2 * (extent - 1);
+          coordinate %= period;
+
+          if(coordinate < 0)
+            coordinate += period;
+
+          return coordinate < extent ? coordinate : period - coordinate;
+        }
+
+        default:
+          return std::min(std::max(coordinate, 0), extent - 1);
+        }
+      }
+    }
+
+
+    template<typename T, std::size_t Rank, std::size_t TileExtent = (Rank == 2 ? 16 : 8)>
+    class grid
+    {
+    public:
+      static_assert(Rank == 2 || Rank == 3, "Rank of grid must be 2 or 3.");
+      static_assert(TileExtent >= 2 && (TileExtent & (TileExtent - 1)) == 0, "Tile extent of grid must be a power of two.");
+
+      using value_type = T;
+      using pointer = T * ;
+      using const_pointer = const T*;
+      using reference = T & ;
+      using const_reference = const T&;
+      using size_type = std::size_t;
+      using index_type = vector<int, Rank>;
+
+      static constexpr size_type rank = Rank;
+      static constexpr size_type tile_extent = TileExtent;
+      static constexpr size_type tile_size = detail::power(TileExtent, Rank);
+
+      grid() = default;
+
+      explicit grid(const index_type& extent, border_mode border = border_mode::clamp, const T& border_value = T{})
+        : extent_{extent},
+          border_{border},
+          border_value_{border_value}
+      {
+        size_type tile_count = 1;
+
+        for(size_type axis = 0; axis < Rank; ++axis)
+        {
+          assert(extent[axis] > 0);
+
+          tiles_[axis] = static_cast<int>((static_cast<size_type>(extent[axis]) + TileExtent - 1) >> shift);
+          tile_count *= static_cast<size_type>(tiles_[axis]);
+        }
+
+        data_.resize(tile_count * tile_size, T{});
+      }
+
+      const index_type& extent() const noexcept
+      {
+        return extent_;
+      }
+
+      const index_type& tiles() const noexcept
+      {
+        return tiles_;
+      }
+
+      size_type size() const noexcept
+      {
+        size_type result = 1;
+
+        for(auto val : extent_)
+        {
+          result *= static_cast<size_type>(val);
+        }
+
+        return result;
+      }
+
+      size_type tile_count() const noexcept
+      {
+        return data_.size() / tile_size;
+      }
+
+      border_mode border() const noexcept
+      {
+        return border_;
+      }
+
+      const_reference border_value() const noexcept
+      {
+        return border_value_;
+      }
+
+      bool contains(const index_type& index) const
+      {
+        for(size_type axis = 0; axis < Rank; ++axis)
+        {
+          if(index[axis] < 0 || index[axis] >= extent_[axis])
+            return false;
+        }
+
+        return true;
+      }
+
+      size_type offset(const index_type& index) const
+      {
+        assert(contains(index));
+
+        size_type tile = 0;
+        size_type local = 0;
+
+        for(size_type axis = Rank; axis-- > 0;)
+        {
+          const auto coordinate = static_cast<size_type>(index[axis]);
+
+          tile = tile * static_cast<size_type>(tiles_[axis]) + (coordinate >> shift);
+          local = (local << shift) | (coordinate & (TileExtent - 1));
+        }
+
+        return tile * tile_size + local;
+      }
+
+      index_type tile_origin(size_type tile) const
+      {
+        assert(tile < tile_count());
+
+        index_type result;
+
+        for(size_type axis = 0; axis < Rank; ++axis)
+        {
+          result[axis] = static_cast<int>((tile % static_cast<size_type>(tiles_[axis])) << shift);
+          tile /= static_cast<size_type>(tiles_[axis]);
+        }
+
+        return result;
+      }
+
+      static index_type local_index(size_type local) noexcept
+      {
+        index_type result;
+
+        for(size_type axis = 0; axis < Rank; ++axis)
+        {
+          result[axis] = static_cast<int>((local >> (shift * axis)) & (TileExtent - 1));
+        }
+
+        return result;
+      }
+
+      static constexpr size_type local_stride(size_type axis) noexcept
+      {
+        return size_type{1} << (shift * axis);
+      }
+
+      reference operator[](const index_type& index)
+      {
+        return data_[offset(index)];
+      }
+
+      const_reference operator[](const index_type& index) const
+      {
+        return data_[offset(index)];
+      }
+
+      // Like operator[], but indices outside of the grid are resolved with the border mode.
+      const_reference at(const index_type& index) const
+      {
+        if(contains(index))
+          return data_[offset(index)];
+
+        if(border_ == border_mode::constant)
+          return border_value_;
+
+        index_type resolved;
+
+        for(size_type axis = 0; axis < Rank; ++axis)
+        {
+          resolved[axis] = detail::resolve_border(index[axis], extent_[axis], border_);
+        }
+
+        return data_[offset(resolved)];
+      }
+
+      void fill(const T& val)
+      {
+        std::fill(data_.begin(), data_.end(), val);
+      }
+
+      // Calls function(index, cell) for every cell, tile by tile, with the tiles split across threads.
+      template<typename Function>
+      void for_each(Function function, size_type threads = parallel::thread_count())
+      {
+        parallel::parallel_for(0, tile_count(), [&](size_type first, size_type last)
+        {
+          for(auto tile = first; tile < last; ++tile)
+          {
+            const auto origin = tile_origin(tile);
+
+            for(size_type local = 0; local < tile_size; ++local)
+            {
+              auto index = local_index(local);
+
+              for(size_type axis = 0; axis < Rank; ++axis)
+              {
+                index[axis] += origin[axis];
+              }
+
+              if(contains(index))
+                function(index, data_[tile * tile_size + local]);
+            }
+          }
+        }, threads);
+      }
+
+      // Storage in tile order, including the padding of partially covered tiles.
+      pointer data() noexcept
+      {
+        return data_.data();
+      }
+
+      const_pointer data() const noexcept
+      {
+        return data_.data();
+      }
+
+      size_type storage_size() const noexcept
+      {
+        return data_.size();
+      }
+
+    private:
+      static constexpr size_type shift = detail::log2(TileExtent);
+
+      index_type extent_{};
+      index_type tiles_{};
+      border_mode border_ = border_mode::clamp;
+      T border_value_{};
+      std::vector<T> data_;
+    };
+
+
+    template<typename T, std::size_t TileExtent = 16>
+    using grid2 = grid<T, 2, TileExtent>;
+
+    template<typename T, std::size_t TileExtent = 8>
+    using grid3 = grid<T, 3, TileExtent>;
+
+
+    // Calls function(center, lower, upper) for every cell of field and stores the result in the same cell of result.
+    // lower[axis] and upper[axis] are the direct neighbours along axis, resolved with the border mode of field.
+    template<typename T, std::size_t Rank, std::size_t TileExtent, typename Result, typename Function>
+    void apply_stencil(const grid<T, Rank, TileExtent>& field, grid<Result, Rank, TileExtent>& result, Function function, std::size_t threads = parallel::thread_count())
+    {
+      using grid_type = grid<T, Rank, TileExtent>;
+      using index_type = typename grid_type::index_type;
+
+      assert(std::equal(field.extent().begin(), field.extent().end(), result.extent().begin()));
+
+      NUTS_INSTRUMENT(apply_stencil, field.size(), field.size() * (sizeof(T) + sizeof(Result)));
+
+      const auto cells = field.data();
+      const auto extent = field.extent();
+
+      parallel::parallel_for(0, field.tile_count(), [&](std::size_t first, std::size_t last)
+      {
+        std::array<T, Rank> lower;
+        std::array<T, Rank> upper;
+
+        for(auto tile = first; tile < last; ++tile)
+        {
+          const auto origin = field.tile_origin(tile);
+
+          for(std::size_t local = 0; local < grid_type::tile_size; ++local)
+          {
+            const auto local_index = grid_type::local_index(local);
+            index_type index = local_index;
+
+            // Per component rather than origin + local_index, which would count as a vector_add per cell.
+            for(std::size_t axis = 0; axis < Rank; ++axis)
+            {
+              index[axis] += origin[axis];
+            }
+
+            if(!field.contains(index))
+              continue;
+
+            const auto offset = tile * grid_type::tile_size + local;
+
+            for(std::size_t axis = 0; axis < Rank; ++axis)
+            {
+              const auto stride = grid_type::local_stride(axis);
+
+              if(local_index[axis] > 0)
+              {
+                lower[axis] = cells[offset - stride];
+              }
+              else
+              {
+                --index[axis];
+                lower[axis] = field.at(index);
+                ++index[axis];
+              }
+
+              if(local_index[axis] + 1 < static_cast<int>(TileExtent) && index[axis] + 1 < extent[axis])
+              {
+                upper[axis] = cells[offset + stride];
+              }
+              else
+              {
+                ++index[axis];
+                upper[axis] = field.at(index);
+                --index[axis];
+              }
+            }
+
+            result.data()[offset] = function(cells[offset], lower, upper);
+          }
+        }
+      }, threads);
+    }
+
+
+    template<typename T, std::size_t Rank, std::size_t TileExtent>
+    void gradient(const grid<T, Rank, TileExtent>& field, grid<vector<T, Rank>, Rank, TileExtent>& result, T spacing = T{1})
+    {
+      static_assert(std::is_floating_point<T>::value, "gradient requires a floating point grid.");
+
+      NUTS_INSTRUMENT(gradient, field.size(), field.size() * (sizeof(T) + sizeof(vector<T, Rank>)));
+
+      const auto scale = T{1} / (2 * spacing);
+
+      apply_stencil(field, result, [scale](const T&, const std::array<T, Rank>& lower, const std::array<T, Rank>& upper)
+      {
+        vector<T, Rank> derivative;
+
+        for(std::size_t axis = 0; axis < Rank; ++axis)
+        {
+          derivative[axis] = (upper[axis] - lower[axis]) * scale;
+        }
+
+        return derivative;
+      });
+    }
+
+    template<typename T, std::size_t Rank, std::size_t TileExtent>
+    void divergence(const grid<vector<T, Rank>, Rank, TileExtent>& field, grid<T, Rank, TileExtent>& result, T spacing = T{1})
+    {
+      static_assert(std::is_floating_point<T>::value, "divergence requires a floating point grid.");
+
+      NUTS_INSTRUMENT(divergence, field.size(), field.size() * (sizeof(vector<T, Rank>) + sizeof(T)));
+
+      using cell_type = vector<T, Rank>;
+      const auto scale = T{1} / (2 * spacing);
+
+      apply_stencil(field, result, [scale](const cell_type&, const std::array<cell_type, Rank>& lower, const std::array<cell_type, Rank>& upper)
+      {
+        T sum{0};
+
+        for(std::size_t axis = 0; axis < Rank; ++axis)
+        {
+          sum += upper[axis][axis] - lower[axis][axis];
+        }
+
+        return sum * scale;
+      });
+    }
+
+    template<typename T, std::size_t TileExtent>
+    void curl(const grid<vector<T, 3>, 3, TileExtent>& field, grid<vector<T, 3>, 3, TileExtent>& result, T spacing = T{1})
+    {
+      static_assert(std::is_floating_point<T>::value, "curl requires a floating point grid.");
+
+      NUTS_INSTRUMENT(curl, field.size(), field.size() * 2 * sizeof(vector<T, 3>));
+
+      using cell_type = vector<T, 3>;
+      const auto scale = T{1} / (2 * spacing);
+
+      apply_stencil(field, result, [scale](const cell_type&, const std::array<cell_type, 3>& lower, const std::array<cell_type, 3>& upper)
+      {
+        const auto derivative = [&](std::size_t component, std::size_t axis)
+        {
+          return (upper[axis][component] - lower[axis][component]) * scale;
+        };
+
+        return cell_type{derivative(2, 1) - derivative(1, 2), derivative(0, 2) - derivative(2, 0), derivative(1, 0) - derivative(0, 1)};
+      });
+    }
+
+    template<typename T, std::size_t TileExtent>
+    void curl(const grid<vector<T, 2>, 2, TileExtent>& field, grid<T, 2, TileExtent>& result, T spacing = T{1})
+    {
+      static_assert(std::is_floating_point<T>::value, "curl requires a floating point grid.");
+
+      NUTS_INSTRUMENT(curl, field.size(), field.size() * (sizeof(vector<T, 2>) + sizeof(T)));
+
+      using cell_type = vector<T, 2>;
+      const auto scale = T{1} / (2 * spacing);
+
+      apply_stencil(field, result, [scale](const cell_type&, const std::array<cell_type, 2>& lower, const std::array<cell_type, 2>& upper)
+      {
+        return ((upper[0][1] - lower[0][1]) - (upper[1][0] - lower[1][0])) * scale;
+      });
+    }
+
+    namespace detail
+    {
+      template<typename T, std::size_t Rank, typename Scalar>
+      T laplacian_cell(const T& center, const std::array<T, Rank>& lower, const std::array<T, Rank>& upper, Scalar scale) noexcept
+      {
+        T sum = upper[0] + lower[0];
+
+        for(std::size_t axis = 1; axis < Rank; ++axis)
+        {
+          sum = sum + upper[axis] + lower[axis];
+        }
+
+        return static_cast<T>((sum - center * static_cast<Scalar>(2 * Rank)) * scale);
+      }
+
+      // Vector cells component by component, so the kernel does not count as vector operations.
+      template<typename T, std::size_t Dimension, std::size_t Rank, typename Scalar>
+      vector<T, Dimension> laplacian_cell(const vector<T, Dimension>& center, const std::array<vector<T, Dimension>, Rank>& lower,
+        const std::array<vector<T, Dimension>, Rank>& upper, Scalar scale) noexcept
+      {
+        vector<T, Dimension> result;
+
+        for(std::size_t component = 0; component < Dimension; ++component)
+        {
+          T sum = upper[0][component] + lower[0][component];
+
+          for(std::size_t axis = 1; axis < Rank; ++axis)
+          {
+            sum = sum + upper[axis][component] + lower[axis][component];
+          }
+
+          result[component] = static_cast<T>((sum - center[component] * static_cast<Scalar>(2 * Rank)) * scale);
+        }
+
+        return result;
+      }
+    }
+
+    // Works for scalar and vector cells; Scalar is the component type of the cells.
+    template<typename T, std::size_t Rank, std::size_t TileExtent, typename Scalar>
+    void laplacian(const grid<T, Rank, TileExtent>& field, grid<T, Rank, TileExtent>& result, Scalar spacing)
+    {
+      static_assert(std::is_floating_point<Scalar>::value, "laplacian requires a floating point grid.");
+
+      NUTS_INSTRUMENT(laplacian, field.size(), field.size() * 2 * sizeof(T));
+
+      const auto scale = Scalar{1} / (spacing * spacing);
+
+      apply_stencil(field, result, [scale](const T& center, const std::array<T, Rank>& lower, const std::array<T, Rank>& upper)
+      {
+        return detail::laplacian_cell(center, lower, upper, scale);
+      });
+    }
+  }
+}
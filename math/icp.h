@@ -0,0 +1,433 @@
+//
+// Copyright © 2017 Constanze Pfennig. All rights reserved.
+//
+
+#pragma once
+
+#include "vector.h"
+#include "kd_tree.h"
+#include "../parallel/parallel_for.h"
+
+#include <cmath>
+#include <cstddef>
+#include <limits>
+
+
+namespace nuts
+{
+  namespace math
+  {
+    // Rotation (by rows) followed by a translation.
+    struct rigid_transform
+    {
+      std::array<vector3d, 3> rotation{{vector3d{1.0, 0.0, 0.0}, vector3d{0.0, 1.0, 0.0}, vector3d{0.0, 0.0, 1.0}}};
+      vector3d translation{0.0, 0.0, 0.0};
+
+      vector3d apply(const vector3d& point) const
+      {
+        return vector3d{rotation[0].dot(point), rotation[1].dot(point), rotation[2].dot(point)} + translation;
+      }
+
+      vector3f apply(const vector3f& point) const
+      {
+        return vector3f{apply(vector3d{point})};
+      }
+    };
+
+    // The transform applying second, then first.
+    inline rigid_transform operator*(const rigid_transform& first, const rigid_transform& second)
+    {
+      rigid_transform result;
+
+      for(std::size_t row = 0; row < 3; ++row)
+      {
+        for(std::size_t column = 0; column < 3; ++column)
+        {
+          result.rotation[row][column] = first.rotation[row][0] * second.rotation[0][column] + first.rotation[row][1] * second.rotation[1][column]
+            + first.rotation[row][2] * second.rotation[2][column];
+        }
+      }
+
+      result.translation = first.apply(second.translation);
+      return result;
+    }
+
+
+    enum class icp_metric
+    {
+      // Minimizes the distances between corresponding points.
+      point_to_point,
+      // Minimizes the distances of source points to the tangent planes at their target points; converges
+      // in far fewer iterations on surfaces but needs target normals.
+      point_to_plane
+    };
+
+    struct icp_settings
+    {
+      icp_metric metric = icp_metric::point_to_point;
+      // Correspondences farther apart than this are rejected.
+      float max_distance = std::numeric_limits<float>::max();
+      std::size_t max_iterations = 50;
+      // Iteration stops once an update moves by less than this (translation) and turns by less than this (radians).
+      double tolerance = 1e-6;
+    };
+
+    struct icp_result
+    {
+      rigid_transform transform;
+      // Root mean square distance (point to point) or plane distance of the correspondences of the last iteration.
+      double error = 0.0;
+      std::size_t correspondences = 0;
+      std::size_t iterations = 0;
+      bool converged = false;
+    };
+
+
+    namespace detail
+    {
+      using matrix4d = std::array<std::array<double, 4>, 4>;
+
+      // Eigenvector of the largest eigenvalue of a symmetric 4x4 matrix by cyclic Jacobi rotations.
+      inline vector4d largest_eigenvector(matrix4d matrix)
+      {
+        matrix4d vectors{};
+
+        for(std::size_t index = 0; index < 4; ++index)
+        {
+          vectors[index][index] = 1.0;
+        }
+
+        for(int sweep = 0; sweep < 32; ++sweep)
+        {
+          double off_diagonal = 0.0;
+
+          for(std::size_t row = 0; row < 4; ++row)
+          {
+            for(std::size_t column = row + 1; column < 4; ++column)
+            {
+              off_diagonal += matrix[row][column] * matrix[row][column];
+            }
+          }
+
+          if(off_diagonal < 1e-30)
+            break;
+
+          for(std::size_t p = 0; p < 4; ++p)
+          {
+            for(std::size_t q = p + 1; q < 4; ++q)
+            {
+              if(matrix[p][q] == 0.0)
+                continue;
+
+              const auto theta = (matrix[q][q] - matrix[p][p]) / (2.0 * matrix[p][q]);
+              const auto t = (theta >= 0.0 ? 1.0 : -1.0) / (std::abs(theta) + std::sqrt(theta * theta + 1.0));
+              const auto c = 1.0 / std::sqrt(t * t + 1.0);
+              const auto s = t * c;
+
+              for(std::size_t k = 0; k < 4; ++k)
+              {
+                const auto kp = matrix[k][p];
+                const auto kq = matrix[k][q];
+                matrix[k][p] = c * kp - s * kq;
+                matrix[k][q] = s * kp + c * kq;
+              }
+
+              for(std::size_t k = 0; k < 4; ++k)
+              {
+                const auto pk = matrix[p][k];
+                const auto qk = matrix[q][k];
+                matrix[p][k] = c * pk - s * qk;
+                matrix[q][k] = s * pk + c * qk;
+              }
+
+              for(std::size_t k = 0; k < 4; ++k)
+              {
+                const auto kp = vectors[k][p];
+                const auto kq = vectors[k][q];
+                vectors[k][p] = c * kp - s * kq;
+                vectors[k][q] = s * kp + c * kq;
+              }
+            }
+          }
+        }
+
+        std::size_t best = 0;
+
+        for(std::size_t index = 1; index < 4; ++index)
+        {
+          if(matrix[index][index] > matrix[best][best])
+            best = index;
+        }
+
+        return vector4d{vectors[0][best], vectors[1][best], vectors[2][best], vectors[3][best]};
+      }
+
+      // Rotation rows of the unit quaternion (w, x, y, z).
+      inline std::array<vector3d, 3> quaternion_rotation(const vector4d& quaternion)
+      {
+        const auto w = quaternion[0], x = quaternion[1], y = quaternion[2], z = quaternion[3];
+
+        return {{
+          vector3d{1 - 2 * (y * y + z * z), 2 * (x * y - w * z), 2 * (x * z + w * y)},
+          vector3d{2 * (x * y + w * z), 1 - 2 * (x * x + z * z), 2 * (y * z - w * x)},
+          vector3d{2 * (x * z - w * y), 2 * (y * z + w * x), 1 - 2 * (x * x + y * y)}}};
+      }
+
+      // Solves the symmetric system matrix * x = rhs by Gaussian elimination with partial pivoting.
+      template<std::size_t Size>
+      bool solve(std::array<std::array<double, Size>, Size> matrix, std::array<double, Size> rhs, std::array<double, Size>& x)
+      {
+        for(std::size_t column = 0; column < Size; ++column)
+        {
+          auto pivot = column;
+
+          for(auto row = column + 1; row < Size; ++row)
+          {
+            if(std::abs(matrix[row][column]) > std::abs(matrix[pivot][column]))
+              pivot = row;
+          }
+
+          if(std::abs(matrix[pivot][column]) < 1e-12)
+            return false;
+
+          std::swap(matrix[pivot], matrix[column]);
+          std::swap(rhs[pivot], rhs[column]);
+
+          for(auto row = column + 1; row < Size; ++row)
+          {
+            const auto factor = matrix[row][column] / matrix[column][column];
+
+            for(auto k = column; k < Size; ++k)
+            {
+              matrix[row][k] -= factor * matrix[column][k];
+            }
+
+            rhs[row] -= factor * rhs[column];
+          }
+        }
+
+        for(auto row = Size; row-- > 0;)
+        {
+          auto sum = rhs[row];
+
+          for(auto k = row + 1; k < Size; ++k)
+          {
+            sum -= matrix[row][k] * x[k];
+          }
+
+          x[row] = sum / matrix[row][row];
+        }
+
+        return true;
+      }
+
+      // Sums over the correspondences of one iteration; each thread fills its own and they are added up after.
+      struct icp_sums
+      {
+        std::size_t count = 0;
+        double error = 0.0;
+        // Point to point: sums of source and target points and of their outer products (row a is the sum of source[a] * target).
+        vector3d source{0.0, 0.0, 0.0};
+        vector3d target{0.0, 0.0, 0.0};
+        std::array<vector3d, 3> covariance{};
+        // Point to plane: normal equations of the linearized problem.
+        std::array<std::array<double, 6>, 6> normal_matrix{};
+        std::array<double, 6> rhs{};
+
+        icp_sums& operator+=(const icp_sums& other)
+        {
+          count += other.count;
+          error += other.error;
+          source += other.source;
+          target += other.target;
+
+          for(std::size_t row = 0; row < 3; ++row)
+          {
+            covariance[row] += other.covariance[row];
+          }
+
+          for(std::size_t row = 0; row < 6; ++row)
+          {
+            for(std::size_t column = 0; column < 6; ++column)
+            {
+              normal_matrix[row][column] += other.normal_matrix[row][column];
+            }
+
+            rhs[row] += other.rhs[row];
+          }
+
+          return *this;
+        }
+      };
+
+      // Horn's closed form: the rotation is the quaternion maximizing the correlation of the centered sets.
+      inline rigid_transform solve_point_to_point(const icp_sums& sums)
+      {
+        const auto scale = 1.0 / static_cast<double>(sums.count);
+        const auto source = sums.source * scale;
+        const auto target = sums.target * scale;
+
+        std::array<vector3d, 3> h;
+
+        for(std::size_t row = 0; row < 3; ++row)
+        {
+          h[row] = sums.covariance[row] * scale - target * source[row];
+        }
+
+        const auto sxx = h[0][0], sxy = h[0][1], sxz = h[0][2];
+        const auto syx = h[1][0], syy = h[1][1], syz = h[1][2];
+        const auto szx = h[2][0], szy = h[2][1], szz = h[2][2];
+
+        const matrix4d n{{
+          {{sxx + syy + szz, syz - szy, szx - sxz, sxy - syx}},
+          {{syz - szy, sxx - syy - szz, sxy + syx, szx + sxz}},
+          {{szx - sxz, sxy + syx, -sxx + syy - szz, syz + szy}},
+          {{sxy - syx, szx + sxz, syz + szy, -sxx - syy + szz}}}};
+
+        rigid_transform result;
+        result.rotation = quaternion_rotation(largest_eigenvector(n));
+        result.translation = target - result.apply(source);
+        return result;
+      }
+
+      // Solves for the small rotation (a, b, c) and translation t of the linearized point to plane
+      // problem and turns the rotation vector into an exact rotation.
+      inline bool solve_point_to_plane(const icp_sums& sums, rigid_transform& result)
+      {
+        std::array<double, 6> x{};
+
+        if(!solve(sums.normal_matrix, sums.rhs, x))
+          return false;
+
+        const vector3d axis{x[0], x[1], x[2]};
+        const auto angle = axis.length();
+
+        if(angle > 0.0)
+        {
+          const auto half = 0.5 * angle;
+          const auto sine = std::sin(half) / angle;
+          result.rotation = quaternion_rotation(vector4d{std::cos(half), axis[0] * sine, axis[1] * sine, axis[2] * sine});
+        }
+
+        result.translation = vector3d{x[3], x[4], x[5]};
+        return true;
+      }
+    }
+
+
+    // Iterative closest point registration of source onto target, starting from initial. Every
+    // iteration pairs each transformed source point with its nearest target point through target_tree
+    // (built over target), in parallel chunks that accumulate their own sums, and then solves for the
+    // best rigid update in closed form: Horn's quaternion method for point to point, the linearized
+    // normal equations for point to plane (which needs target_normals). Iteration stops after
+    // max_iterations, once an update falls below tolerance, or when no correspondence is left.
+    inline icp_result icp(const std::vector<vector3f>& source, const std::vector<vector3f>& target, const std::vector<vector3f>& target_normals,
+      const kd_tree& target_tree, const icp_settings& settings, const rigid_transform& initial = rigid_transform{},
+      std::size_t threads = parallel::thread_count())
+    {
+      assert(target_tree.size() == target.size());
+      assert(settings.metric == icp_metric::point_to_point || target_normals.size() == target.size());
+
+      icp_result result;
+      result.transform = initial;
+
+      if(source.empty() || target.empty())
+        return result;
+
+      const auto parts = std::max<std::size_t>(std::min(threads, source.size()), 1);
+      std::vector<detail::icp_sums> partial(parts);
+
+      for(; result.iterations < settings.max_iterations && !result.converged; ++result.iterations)
+      {
+        parallel::parallel_for(0, parts, [&](std::size_t first, std::size_t last)
+        {
+          for(auto part = first; part < last; ++part)
+          {
+            const auto range = parallel::partition(0, source.size(), parts, part);
+            auto& sums = partial[part];
+            sums = detail::icp_sums{};
+
+            for(auto index = range.first; index < range.second; ++index)
+            {
+              const auto point = result.transform.apply(vector3d{source[index]});
+              const auto match = target_tree.nearest(vector3f{point}, settings.max_distance);
+
+              if(match.first == kd_tree::invalid_index)
+                continue;
+
+              const vector3d other{target[match.first]};
+              ++sums.count;
+
+              if(settings.metric == icp_metric::point_to_point)
+              {
+                sums.error += match.second;
+                sums.source += point;
+                sums.target += other;
+
+                for(std::size_t row = 0; row < 3; ++row)
+                {
+                  sums.covariance[row] += other * point[row];
+                }
+              }
+              else
+              {
+                const vector3d normal{target_normals[match.first]};
+                const auto moment = cross(point, normal);
+                const std::array<double, 6> row{moment[0], moment[1], moment[2], normal[0], normal[1], normal[2]};
+                const auto distance = (other - point).dot(normal);
+
+                sums.error += distance * distance;
+
+                for(std::size_t i = 0; i < 6; ++i)
+                {
+                  for(std::size_t j = 0; j < 6; ++j)
+                  {
+                    sums.normal_matrix[i][j] += row[i] * row[j];
+                  }
+
+                  sums.rhs[i] += row[i] * distance;
+                }
+              }
+            }
+          }
+        }, threads);
+
+        detail::icp_sums sums;
+
+        for(const auto& part : partial)
+        {
+          sums += part;
+        }
+
+        result.correspondences = sums.count;
+
+        if(sums.count == 0)
+          break;
+
+        result.error = std::sqrt(sums.error / static_cast<double>(sums.count));
+
+        rigid_transform update;
+
+        if(settings.metric == icp_metric::point_to_point)
+          update = detail::solve_point_to_point(sums);
+        else if(sums.count < 6 || !detail::solve_point_to_plane(sums, update))
+          break;
+
+        result.transform = update * result.transform;
+
+        // The rotation angle follows from the trace of the update.
+        const auto trace = update.rotation[0][0] + update.rotation[1][1] + update.rotation[2][2];
+        const auto angle = std::acos(std::min(std::max(0.5 * (trace - 1.0), -1.0), 1.0));
+        result.converged = update.translation.length() < settings.tolerance && angle < settings.tolerance;
+      }
+
+      return result;
+    }
+
+    inline icp_result icp(const std::vector<vector3f>& source, const std::vector<vector3f>& target, const std::vector<vector3f>& target_normals,
+      const icp_settings& settings, const rigid_transform& initial = rigid_transform{}, std::size_t threads = parallel::thread_count())
+    {
+      return icp(source, target, target_normals, kd_tree{target, threads}, settings, initial, threads);
+    }
+  }
+}
@@ -0,0 +1,323 @@
+//
+// Copyright © 2017 Constanze Pfennig. All rights reserved.
+//
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+#if defined(NUTS_INSTRUMENTATION)
+#include <atomic>
+#include <mutex>
+#include <vector>
+#endif
+
+
+// Counters of calls, elements processed and bytes moved per vector operator category and batch kernel,
+// for finding out where a program spends its arithmetic and bandwidth. They exist only if
+// NUTS_INSTRUMENTATION is defined, consistently in every translation unit. Otherwise NUTS_INSTRUMENT
+// expands to nothing, its arguments are not evaluated and the queries below return zeros.
+//
+// Elements are components for the vector operators, cells for the grid kernels and items (pixels,
+// vectors, codes, vertices, points) for the other batch kernels. Bytes are what an operation reads and
+// writes of its inputs and results, not what it costs in cache traffic; kernels whose output size
+// depends on the data (marching_cubes, voxel_downsample, remove_statistical_outliers) count only their
+// input. The derivative operators of grid also count as the apply_stencil they run on, compound
+// assignments and the unary minus of vector as the binary operators they are built on, and length as a
+// dot product. The vector categories count the caller's operations only: the batch kernels do their
+// index arithmetic component by component and hold NUTS_UNCOUNTED_SCOPE on every thread they run on,
+// so the vector operators they use internally are charged to their own entry, not to vector_add and
+// the like. Callbacks such as those of apply_stencil and grid::for_each are the caller's code and
+// count as usual. Each thread counts into its own block with plain relaxed loads and stores, so
+// counting neither contends between threads nor needs read-modify-write instructions.
+
+namespace nuts
+{
+  namespace math
+  {
+    enum class operation : std::size_t
+    {
+      vector_add,
+      vector_subtract,
+      vector_scale,
+      vector_multiply,
+      vector_dot,
+      vector_cross,
+      vector_compare,
+      pack_rgba8,
+      unpack_rgba8,
+      normalize_rgba8,
+      quantize_rgba8,
+      srgb_to_linear,
+      linear_to_srgb,
+      premultiply,
+      unpremultiply,
+      blend_over,
+      saturating_arithmetic,
+      wrapping_arithmetic,
+      average,
+      shuffle_bytes,
+      unshuffle_bytes,
+      delta_encode,
+      delta_decode,
+      xor_encode,
+      xor_decode,
+      quantize_positions,
+      dequantize_positions,
+      quantize_normals,
+      dequantize_normals,
+      encode_octahedral,
+      decode_octahedral,
+      skin_linear,
+      skin_dual_quaternion,
+      vertex_normals,
+      vertex_tangents,
+      apply_stencil,
+      gradient,
+      divergence,
+      curl,
+      laplacian,
+      marching_cubes,
+      sample,
+      voxel_downsample,
+      remove_statistical_outliers
+    };
+
+    constexpr std::size_t operation_kinds = static_cast<std::size_t>(operation::remove_statistical_outliers) + 1;
+
+    inline const char* operation_name(operation op) noexcept
+    {
+      constexpr std::array<const char*, operation_kinds> names{{
+        "vector_add", "vector_subtract", "vector_scale", "vector_multiply", "vector_dot", "vector_cross", "vector_compare",
+        "pack_rgba8", "unpack_rgba8", "normalize_rgba8", "quantize_rgba8", "srgb_to_linear", "linear_to_srgb", "premultiply",
+        "unpremultiply", "blend_over", "saturating_arithmetic", "wrapping_arithmetic", "average", "shuffle_bytes",
+        "unshuffle_bytes", "delta_encode", "delta_decode", "xor_encode", "xor_decode", "quantize_positions",
+        "dequantize_positions", "quantize_normals", "dequantize_normals", "encode_octahedral", "decode_octahedral",
+        "skin_linear", "skin_dual_quaternion", "vertex_normals", "vertex_tangents", "apply_stencil", "gradient", "divergence",
+        "curl", "laplacian", "marching_cubes", "sample", "voxel_downsample", "remove_statistical_outliers"}};
+
+      return names[static_cast<std::size_t>(op)];
+    }
+
+    struct operation_counts
+    {
+      std::uint64_t calls = 0;
+      std::uint64_t elements = 0;
+      std::uint64_t bytes = 0;
+    };
+
+#if defined(NUTS_INSTRUMENTATION)
+    constexpr bool instrumentation_enabled = true;
+
+    namespace detail
+    {
+      struct operation_counter
+      {
+        std::atomic<std::uint64_t> calls{0};
+        std::atomic<std::uint64_t> elements{0};
+        std::atomic<std::uint64_t> bytes{0};
+      };
+
+      using counter_block = std::array<operation_counter, operation_kinds>;
+
+      // Only the owning thread writes a counter, so a load and a store suffice; other threads only read.
+      inline void add_owned(std::atomic<std::uint64_t>& counter, std::uint64_t value) noexcept
+      {
+        counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+      }
+
+      // The blocks of running threads, the totals of finished ones and the baseline of the last reset.
+      class counter_registry
+      {
+      public:
+        static counter_registry& instance()
+        {
+          static counter_registry registry;
+          return registry;
+        }
+
+        void attach(const counter_block* block)
+        {
+          std::lock_guard<std::mutex> lock{mutex_};
+          blocks_.push_back(block);
+        }
+
+        void detach(const counter_block* block)
+        {
+          std::lock_guard<std::mutex> lock{mutex_};
+
+          for(std::size_t index = 0; index < operation_kinds; ++index)
+          {
+            retired_[index] = sum(retired_[index], (*block)[index]);
+          }
+
+          for(auto& entry : blocks_)
+          {
+            if(entry == block)
+            {
+              entry = blocks_.back();
+              blocks_.pop_back();
+              break;
+            }
+          }
+        }
+
+        operation_counts count(operation op)
+        {
+          std::lock_guard<std::mutex> lock{mutex_};
+
+          const auto index = static_cast<std::size_t>(op);
+          auto result = total(index);
+          result.calls -= baseline_[index].calls;
+          result.elements -= baseline_[index].elements;
+          result.bytes -= baseline_[index].bytes;
+          return result;
+        }
+
+        void reset()
+        {
+          std::lock_guard<std::mutex> lock{mutex_};
+
+          for(std::size_t index = 0; index < operation_kinds; ++index)
+          {
+            baseline_[index] = total(index);
+          }
+        }
+
+      private:
+        static operation_counts sum(operation_counts counts, const operation_counter& counter) noexcept
+        {
+          counts.calls += counter.calls.load(std::memory_order_relaxed);
+          counts.elements += counter.elements.load(std::memory_order_relaxed);
+          counts.bytes += counter.bytes.load(std::memory_order_relaxed);
+          return counts;
+        }
+
+        operation_counts total(std::size_t index) const noexcept
+        {
+          auto result = retired_[index];
+
+          for(const auto* block : blocks_)
+          {
+            result = sum(result, (*block)[index]);
+          }
+
+          return result;
+        }
+
+        std::mutex mutex_;
+        std::vector<const counter_block*> blocks_;
+        std::array<operation_counts, operation_kinds> retired_{};
+        std::array<operation_counts, operation_kinds> baseline_{};
+      };
+
+      // Registers with the registry first, so the registry outlives every thread's counters.
+      class thread_counters
+      {
+      public:
+        thread_counters()
+          : registry_(counter_registry::instance())
+        {
+          registry_.attach(&block_);
+        }
+
+        ~thread_counters()
+        {
+          registry_.detach(&block_);
+        }
+
+        thread_counters(const thread_counters&) = delete;
+        thread_counters& operator=(const thread_counters&) = delete;
+
+        counter_block& block() noexcept
+        {
+          return block_;
+        }
+
+      private:
+        counter_registry& registry_;
+        counter_block block_;
+      };
+
+      inline void instrument(operation op, std::uint64_t elements, std::uint64_t bytes)
+      {
+        thread_local thread_counters counters;
+        auto& counter = counters.block()[static_cast<std::size_t>(op)];
+
+        add_owned(counter.calls, 1);
+        add_owned(counter.elements, elements);
+        add_owned(counter.bytes, bytes);
+      }
+
+      // Nesting depth of uncounted_scope on this thread.
+      inline unsigned& uncounted_depth() noexcept
+      {
+        thread_local unsigned depth = 0;
+        return depth;
+      }
+
+      class uncounted_scope
+      {
+      public:
+        uncounted_scope() noexcept
+        {
+          ++uncounted_depth();
+        }
+
+        ~uncounted_scope()
+        {
+          --uncounted_depth();
+        }
+
+        uncounted_scope(const uncounted_scope&) = delete;
+        uncounted_scope& operator=(const uncounted_scope&) = delete;
+      };
+
+      inline void instrument_vector(operation op, std::uint64_t elements, std::uint64_t bytes)
+      {
+        if(uncounted_depth() == 0)
+          instrument(op, elements, bytes);
+      }
+    }
+
+    // Counts since the start of the program or the last reset_operation_counts, over all threads.
+    inline operation_counts operation_count(operation op)
+    {
+      return detail::counter_registry::instance().count(op);
+    }
+
+    inline void reset_operation_counts()
+    {
+      detail::counter_registry::instance().reset();
+    }
+
+#define NUTS_INSTRUMENT(op, elements, bytes) \
+  ::nuts::math::detail::instrument(::nuts::math::operation::op, static_cast<std::uint64_t>(elements), static_cast<std::uint64_t>(bytes))
+
+// For the vector operators: skipped inside a kernel's NUTS_UNCOUNTED_SCOPE.
+#define NUTS_INSTRUMENT_VECTOR(op, elements, bytes) \
+  ::nuts::math::detail::instrument_vector(::nuts::math::operation::op, static_cast<std::uint64_t>(elements), static_cast<std::uint64_t>(bytes))
+
+#define NUTS_UNCOUNTED_SCOPE() const ::nuts::math::detail::uncounted_scope nuts_uncounted_scope
+
+#else
+    constexpr bool instrumentation_enabled = false;
+
+    inline operation_counts operation_count(operation)
+    {
+      return operation_counts{};
+    }
+
+    inline void reset_operation_counts()
+    {
+    }
+
+#define NUTS_INSTRUMENT(op, elements, bytes) static_cast<void>(0)
+#define NUTS_INSTRUMENT_VECTOR(op, elements, bytes) static_cast<void>(0)
+#define NUTS_UNCOUNTED_SCOPE() static_cast<void>(0)
+
+#endif
+  }
+}
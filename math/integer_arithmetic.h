@@ -0,0 +1,434 @@
+//
+// Copyright © 2017 Constanze Pfennig. All rights reserved.
+//
+
+#pragma once
+
+#include "vector.h"
+#include "simd.h"
+#include "streaming.h"
+#include "instrumentation.h"
+
+#include <limits>
+#include <cstdint>
+#include <cstddef>
+
+
+// Component-wise integer arithmetic which keeps the component type instead of promoting it.
+// The array overloads use packed SSE2 instructions wherever the component type has one, and take a
+// store_mode for arrays beyond the last level cache.
+
+namespace nuts
+{
+  namespace math
+  {
+    namespace detail
+    {
+      template<typename T>
+      using wide_type = std::conditional_t<std::is_signed<T>::value, std::int64_t, std::uint64_t>;
+
+      template<typename T>
+      T wrap(std::make_unsigned_t<T> val)
+      {
+        return static_cast<T>(val);
+      }
+
+      template<typename T>
+      T saturate(wide_type<T> val)
+      {
+        if(val > static_cast<wide_type<T>>(std::numeric_limits<T>::max()))
+          return std::numeric_limits<T>::max();
+
+        if(val < static_cast<wide_type<T>>(std::numeric_limits<T>::min()))
+          return std::numeric_limits<T>::min();
+
+        return static_cast<T>(val);
+      }
+
+      struct saturating_add_op
+      {
+        template<typename T>
+        static T apply(T val1, T val2)
+        {
+          if constexpr(sizeof(T) < sizeof(wide_type<T>))
+          {
+            return saturate<T>(static_cast<wide_type<T>>(val1) + static_cast<wide_type<T>>(val2));
+          }
+          else if constexpr(std::is_signed<T>::value)
+          {
+            if(val2 > 0 && val1 > std::numeric_limits<T>::max() - val2)
+              return std::numeric_limits<T>::max();
+
+            if(val2 < 0 && val1 < std::numeric_limits<T>::min() - val2)
+              return std::numeric_limits<T>::min();
+
+            return val1 + val2;
+          }
+          else
+          {
+            const T result = val1 + val2;
+            return result < val1 ? std::numeric_limits<T>::max() : result;
+          }
+        }
+
+#if defined(NUTS_MATH_SSE2)
+        template<typename T>
+        static constexpr bool has_simd = sizeof(T) <= 2;
+
+        template<typename T>
+        static __m128i apply_simd(__m128i val1, __m128i val2)
+        {
+          if constexpr(sizeof(T) == 1)
+            return std::is_signed<T>::value ? _mm_adds_epi8(val1, val2) : _mm_adds_epu8(val1, val2);
+          else
+            return std::is_signed<T>::value ? _mm_adds_epi16(val1, val2) : _mm_adds_epu16(val1, val2);
+        }
+#endif
+      };
+
+      struct saturating_sub_op
+      {
+        template<typename T>
+        static T apply(T val1, T val2)
+        {
+          if constexpr(std::is_unsigned<T>::value)
+          {
+            return val1 < val2 ? T{0} : static_cast<T>(val1 - val2);
+          }
+          else if constexpr(sizeof(T) < sizeof(wide_type<T>))
+          {
+            return saturate<T>(static_cast<wide_type<T>>(val1) - static_cast<wide_type<T>>(val2));
+          }
+          else
+          {
+            if(val2 < 0 && val1 > std::numeric_limits<T>::max() + val2)
+              return std::numeric_limits<T>::max();
+
+            if(val2 > 0 && val1 < std::numeric_limits<T>::min() + val2)
+              return std::numeric_limits<T>::min();
+
+            return val1 - val2;
+          }
+        }
+
+#if defined(NUTS_MATH_SSE2)
+        template<typename T>
+        static constexpr bool has_simd = sizeof(T) <= 2;
+
+        template<typename T>
+        static __m128i apply_simd(__m128i val1, __m128i val2)
+        {
+          if constexpr(sizeof(T) == 1)
+            return std::is_signed<T>::value ? _mm_subs_epi8(val1, val2) : _mm_subs_epu8(val1, val2);
+          else
+            return std::is_signed<T>::value ? _mm_subs_epi16(val1, val2) : _mm_subs_epu16(val1, val2);
+        }
+#endif
+      };
+
+      struct saturating_mul_op
+      {
+        template<typename T>
+        static T apply(T val1, T val2)
+        {
+          if constexpr(sizeof(T) * 2 <= sizeof(wide_type<T>))
+          {
+            return saturate<T>(static_cast<wide_type<T>>(val1) * static_cast<wide_type<T>>(val2));
+          }
+          else if constexpr(std::is_signed<T>::value)
+          {
+            using unsigned_type = std::make_unsigned_t<T>;
+
+            const bool negative = (val1 < 0) != (val2 < 0);
+            const auto magnitude1 = val1 < 0 ? static_cast<unsigned_type>(0u - static_cast<unsigned_type>(val1)) : static_cast<unsigned_type>(val1);
+            const auto magnitude2 = val2 < 0 ? static_cast<unsigned_type>(0u - static_cast<unsigned_type>(val2)) : static_cast<unsigned_type>(val2);
+            const auto limit = static_cast<unsigned_type>(std::numeric_limits<T>::max()) + (negative ? 1u : 0u);
+
+            if(magnitude1 != 0 && magnitude2 > limit / magnitude1)
+              return negative ? std::numeric_limits<T>::min() : std::numeric_limits<T>::max();
+
+            const auto product = static_cast<unsigned_type>(magnitude1 * magnitude2);
+            return wrap<T>(negative ? static_cast<unsigned_type>(0u - product) : product);
+          }
+          else
+          {
+            if(val1 != 0 && val2 > std::numeric_limits<T>::max() / val1)
+              return std::numeric_limits<T>::max();
+
+            return val1 * val2;
+          }
+        }
+
+#if defined(NUTS_MATH_SSE2)
+        template<typename T>
+        static constexpr bool has_simd = false;
+#endif
+      };
+
+      struct wrapping_add_op
+      {
+        template<typename T>
+        static T apply(T val1, T val2)
+        {
+          using unsigned_type = std::make_unsigned_t<T>;
+          return wrap<T>(static_cast<unsigned_type>(static_cast<unsigned_type>(val1) + static_cast<unsigned_type>(val2)));
+        }
+
+#if defined(NUTS_MATH_SSE2)
+        template<typename T>
+        static constexpr bool has_simd = true;
+
+        template<typename T>
+        static __m128i apply_simd(__m128i val1, __m128i val2)
+        {
+          if constexpr(sizeof(T) == 1)
+            return _mm_add_epi8(val1, val2);
+          else if constexpr(sizeof(T) == 2)
+            return _mm_add_epi16(val1, val2);
+          else if constexpr(sizeof(T) == 4)
+            return _mm_add_epi32(val1, val2);
+          else
+            return _mm_add_epi64(val1, val2);
+        }
+#endif
+      };
+
+      struct wrapping_sub_op
+      {
+        template<typename T>
+        static T apply(T val1, T val2)
+        {
+          using unsigned_type = std::make_unsigned_t<T>;
+          return wrap<T>(static_cast<unsigned_type>(static_cast<unsigned_type>(val1) - static_cast<unsigned_type>(val2)));
+        }
+
+#if defined(NUTS_MATH_SSE2)
+        template<typename T>
+        static constexpr bool has_simd = true;
+
+        template<typename T>
+        static __m128i apply_simd(__m128i val1, __m128i val2)
+        {
+          if constexpr(sizeof(T) == 1)
+            return _mm_sub_epi8(val1, val2);
+          else if constexpr(sizeof(T) == 2)
+            return _mm_sub_epi16(val1, val2);
+          else if constexpr(sizeof(T) == 4)
+            return _mm_sub_epi32(val1, val2);
+          else
+            return _mm_sub_epi64(val1, val2);
+        }
+#endif
+      };
+
+      struct wrapping_mul_op
+      {
+        template<typename T>
+        static T apply(T val1, T val2)
+        {
+          // Multiply in an unsigned type at least as wide as int so that the promotion of narrow
+          // operands cannot overflow a signed int.
+          using unsigned_type = std::common_type_t<std::make_unsigned_t<T>, unsigned int>;
+          return wrap<T>(static_cast<std::make_unsigned_t<T>>(static_cast<unsigned_type>(val1) * static_cast<unsigned_type>(val2)));
+        }
+
+#if defined(NUTS_MATH_SSE2)
+#if defined(NUTS_MATH_SSE41)
+        template<typename T>
+        static constexpr bool has_simd = sizeof(T) == 2 || sizeof(T) == 4;
+#else
+        template<typename T>
+        static constexpr bool has_simd = sizeof(T) == 2;
+#endif
+
+        template<typename T>
+        static __m128i apply_simd(__m128i val1, __m128i val2)
+        {
+#if defined(NUTS_MATH_SSE41)
+          if constexpr(sizeof(T) == 4)
+            return _mm_mullo_epi32(val1, val2);
+          else
+#endif
+            return _mm_mullo_epi16(val1, val2);
+        }
+#endif
+      };
+
+      struct average_op
+      {
+        // Rounds half up like pavgb, without widening: (a + b + 1) >> 1 == (a >> 1) + (b >> 1) + ((a | b) & 1).
+        template<typename T>
+        static T apply(T val1, T val2)
+        {
+          return static_cast<T>((val1 >> 1) + (val2 >> 1) + ((val1 | val2) & 1));
+        }
+
+#if defined(NUTS_MATH_SSE2)
+        template<typename T>
+        static constexpr bool has_simd = std::is_unsigned<T>::value && sizeof(T) <= 2;
+
+        template<typename T>
+        static __m128i apply_simd(__m128i val1, __m128i val2)
+        {
+          if constexpr(sizeof(T) == 1)
+            return _mm_avg_epu8(val1, val2);
+          else
+            return _mm_avg_epu16(val1, val2);
+        }
+#endif
+      };
+
+      template<typename Op, typename T>
+      void apply_packed(const T* first1, const T* first2, T* result, std::size_t count, store_mode mode)
+      {
+        std::size_t index = 0;
+
+#if defined(NUTS_MATH_SSE2)
+        if constexpr(Op::template has_simd<T>)
+        {
+          constexpr std::size_t lanes = sizeof(__m128i) / sizeof(T);
+
+          with_store_mode(mode, result, count * 3 * sizeof(T), [&](auto stores)
+          {
+            for(; index + lanes <= count; index += lanes)
+            {
+              prefetch(first1 + index, stores);
+              prefetch(first2 + index, stores);
+
+              const auto val1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(first1 + index));
+              const auto val2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(first2 + index));
+              store(reinterpret_cast<__m128i*>(result + index), Op::template apply_simd<T>(val1, val2), stores);
+            }
+          });
+        }
+#endif
+
+        static_cast<void>(mode);
+
+        for(; index < count; ++index)
+        {
+          result[index] = Op::apply(first1[index], first2[index]);
+        }
+      }
+
+      template<typename Op, typename T, std::size_t Dimension>
+      vector<T, Dimension> apply_packed(const vector<T, Dimension>& vec, const vector<T, Dimension>& other)
+      {
+        static_assert(std::is_integral<T>::value, "Saturating and wrapping arithmetic requires an integral vector type.");
+
+        vector<T, Dimension> result;
+        apply_packed<Op>(vec.data(), other.data(), result.data(), Dimension, store_mode::cached);
+        return result;
+      }
+
+      template<typename Op, typename T, std::size_t Dimension>
+      void apply_packed(const vector<T, Dimension>* first1, const vector<T, Dimension>* first2, vector<T, Dimension>* result, std::size_t count, store_mode mode)
+      {
+        static_assert(std::is_integral<T>::value, "Saturating and wrapping arithmetic requires an integral vector type.");
+        static_assert(sizeof(vector<T, Dimension>) == sizeof(T) * Dimension, "vector must be tightly packed.");
+
+        apply_packed<Op>(reinterpret_cast<const T*>(first1), reinterpret_cast<const T*>(first2), reinterpret_cast<T*>(result), count * Dimension, mode);
+      }
+    }
+
+
+    template<typename T, std::size_t Dimension>
+    vector<T, Dimension> saturating_add(const vector<T, Dimension>& vec, const vector<T, Dimension>& other)
+    {
+      return detail::apply_packed<detail::saturating_add_op>(vec, other);
+    }
+
+    template<typename T, std::size_t Dimension>
+    vector<T, Dimension> saturating_sub(const vector<T, Dimension>& vec, const vector<T, Dimension>& other)
+    {
+      return detail::apply_packed<detail::saturating_sub_op>(vec, other);
+    }
+
+    template<typename T, std::size_t Dimension>
+    vector<T, Dimension> saturating_mul(const vector<T, Dimension>& vec, const vector<T, Dimension>& other)
+    {
+      return detail::apply_packed<detail::saturating_mul_op>(vec, other);
+    }
+
+    template<typename T, std::size_t Dimension>
+    vector<T, Dimension> wrapping_add(const vector<T, Dimension>& vec, const vector<T, Dimension>& other)
+    {
+      return detail::apply_packed<detail::wrapping_add_op>(vec, other);
+    }
+
+    template<typename T, std::size_t Dimension>
+    vector<T, Dimension> wrapping_sub(const vector<T, Dimension>& vec, const vector<T, Dimension>& other)
+    {
+      return detail::apply_packed<detail::wrapping_sub_op>(vec, other);
+    }
+
+    template<typename T, std::size_t Dimension>
+    vector<T, Dimension> wrapping_mul(const vector<T, Dimension>& vec, const vector<T, Dimension>& other)
+    {
+      return detail::apply_packed<detail::wrapping_mul_op>(vec, other);
+    }
+
+    template<typename T, std::size_t Dimension>
+    vector<T, Dimension> average(const vector<T, Dimension>& vec, const vector<T, Dimension>& other)
+    {
+      return detail::apply_packed<detail::average_op>(vec, other);
+    }
+
+
+    template<typename T, std::size_t Dimension>
+    void saturating_add(const vector<T, Dimension>* first1, const vector<T, Dimension>* first2, vector<T, Dimension>* result, std::size_t count, store_mode mode = store_mode::automatic)
+    {
+      NUTS_INSTRUMENT(saturating_arithmetic, count, count * 3 * sizeof(vector<T, Dimension>));
+
+      detail::apply_packed<detail::saturating_add_op>(first1, first2, result, count, mode);
+    }
+
+    template<typename T, std::size_t Dimension>
+    void saturating_sub(const vector<T, Dimension>* first1, const vector<T, Dimension>* first2, vector<T, Dimension>* result, std::size_t count, store_mode mode = store_mode::automatic)
+    {
+      NUTS_INSTRUMENT(saturating_arithmetic, count, count * 3 * sizeof(vector<T, Dimension>));
+
+      detail::apply_packed<detail::saturating_sub_op>(first1, first2, result, count, mode);
+    }
+
+    template<typename T, std::size_t Dimension>
+    void saturating_mul(const vector<T, Dimension>* first1, const vector<T, Dimension>* first2, vector<T, Dimension>* result, std::size_t count, store_mode mode = store_mode::automatic)
+    {
+      NUTS_INSTRUMENT(saturating_arithmetic, count, count * 3 * sizeof(vector<T, Dimension>));
+
+      detail::apply_packed<detail::saturating_mul_op>(first1, first2, result, count, mode);
+    }
+
+    template<typename T, std::size_t Dimension>
+    void wrapping_add(const vector<T, Dimension>* first1, const vector<T, Dimension>* first2, vector<T, Dimension>* result, std::size_t count, store_mode mode = store_mode::automatic)
+    {
+      NUTS_INSTRUMENT(wrapping_arithmetic, count, count * 3 * sizeof(vector<T, Dimension>));
+
+      detail::apply_packed<detail::wrapping_add_op>(first1, first2, result, count, mode);
+    }
+
+    template<typename T, std::size_t Dimension>
+    void wrapping_sub(const vector<T, Dimension>* first1, const vector<T, Dimension>* first2, vector<T, Dimension>* result, std::size_t count, store_mode mode = store_mode::automatic)
+    {
+      NUTS_INSTRUMENT(wrapping_arithmetic, count, count * 3 * sizeof(vector<T, Dimension>));
+
+      detail::apply_packed<detail::wrapping_sub_op>(first1, first2, result, count, mode);
+    }
+
+    template<typename T, std::size_t Dimension>
+    void wrapping_mul(const vector<T, Dimension>* first1, const vector<T, Dimension>* first2, vector<T, Dimension>* result, std::size_t count, store_mode mode = store_mode::automatic)
+    {
+      NUTS_INSTRUMENT(wrapping_arithmetic, count, count * 3 * sizeof(vector<T, Dimension>));
+
+      detail::apply_packed<detail::wrapping_mul_op>(first1, first2, result, count, mode);
+    }
+
+    template<typename T, std::size_t Dimension>
+    void average(const vector<T, Dimension>* first1, const vector<T, Dimension>* first2, vector<T, Dimension>* result, std::size_t count, store_mode mode = store_mode::automatic)
+    {
+      NUTS_INSTRUMENT(average, count, count * 3 * sizeof(vector<T, Dimension>));
+
+      detail::apply_packed<detail::average_op>(first1, first2, result, count, mode);
+    }
+  }
+}
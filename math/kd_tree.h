@@ -0,0 +1,226 @@
+//
+// Copyright © 2017 Constanze Pfennig. All rights reserved.
+//
+
+#pragma once
+
+#include "vector.h"
+#include "../parallel/parallel_for.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <numeric>
+
+
+namespace nuts
+{
+  namespace math
+  {
+    // Static k-d tree over a point set for nearest neighbour queries. Every node halves its points at
+    // the median of the widest axis, so the tree is balanced and stored in heap order (children of node
+    // n at 2n + 1 and 2n + 2) without child pointers. The points are kept in tree order, so a leaf
+    // scans one contiguous block; queries report indices into the original array.
+    class kd_tree
+    {
+    public:
+      using size_type = std::size_t;
+      using index_type = std::uint32_t;
+
+      static constexpr index_type invalid_index = std::numeric_limits<index_type>::max();
+      static constexpr size_type leaf_size = 8;
+
+      kd_tree() = default;
+
+      explicit kd_tree(const std::vector<vector3f>& points, size_type threads = parallel::thread_count())
+      {
+        build(points, threads);
+      }
+
+      size_type size() const noexcept
+      {
+        return points_.size();
+      }
+
+      void build(const std::vector<vector3f>& points, size_type threads = parallel::thread_count())
+      {
+        assert(points.size() < invalid_index);
+
+        indices_.resize(points.size());
+        std::iota(indices_.begin(), indices_.end(), index_type{0});
+
+        size_type depth = 0;
+
+        while((points.size() >> depth) > leaf_size)
+        {
+          ++depth;
+        }
+
+        nodes_.assign((size_type{2} << depth) - 1, node{});
+
+        // Subtrees below the top levels are built on their own threads.
+        size_type parallel_depth = 0;
+
+        while((size_type{1} << parallel_depth) < threads)
+        {
+          ++parallel_depth;
+        }
+
+        if(!points.empty())
+          build_node(points, 0, 0, points.size(), parallel_depth);
+
+        points_.resize(points.size());
+
+        for(size_type index = 0; index < points.size(); ++index)
+        {
+          points_[index] = points[indices_[index]];
+        }
+      }
+
+      // Closest point within max_distance; returns its index and squared distance, or invalid_index.
+      std::pair<index_type, float> nearest(const vector3f& query, float max_distance = std::numeric_limits<float>::max()) const
+      {
+        std::pair<index_type, float> best{invalid_index, max_distance < std::numeric_limits<float>::max() ? max_distance * max_distance : max_distance};
+
+        traverse(query, [&]() { return best.second; }, [&](size_type position, float distance2)
+        {
+          if(distance2 < best.second)
+            best = {indices_[position], distance2};
+        });
+
+        return best;
+      }
+
+      // Up to k closest points, written to indices and squared distances in increasing distance.
+      // Returns the number of points found.
+      size_type k_nearest(const vector3f& query, size_type k, index_type* indices, float* distances2) const
+      {
+        size_type count = 0;
+
+        if(k == 0)
+          return 0;
+
+        const auto bound = [&]() { return count < k ? std::numeric_limits<float>::max() : distances2[k - 1]; };
+
+        traverse(query, bound, [&](size_type position, float distance2)
+        {
+          if(count == k && distance2 >= distances2[k - 1])
+            return;
+
+          // Insertion into the sorted result; k is small in practice.
+          auto slot = count < k ? count++ : k - 1;
+
+          for(; slot > 0 && distances2[slot - 1] > distance2; --slot)
+          {
+            distances2[slot] = distances2[slot - 1];
+            indices[slot] = indices[slot - 1];
+          }
+
+          distances2[slot] = distance2;
+          indices[slot] = indices_[position];
+        });
+
+        return count;
+      }
+
+    private:
+      struct node
+      {
+        float split = 0.f;
+        index_type first = 0;
+        index_type last = 0;
+        // 0 to 2 for inner nodes, 3 for leaves.
+        std::uint8_t axis = 3;
+      };
+
+      void build_node(const std::vector<vector3f>& points, size_type index, size_type first, size_type last, size_type parallel_depth)
+      {
+        auto& current = nodes_[index];
+        current.first = static_cast<index_type>(first);
+        current.last = static_cast<index_type>(last);
+
+        if(last - first <= leaf_size || 2 * index + 2 >= nodes_.size())
+          return;
+
+        vector3f lower = points[indices_[first]];
+        vector3f upper = lower;
+
+        for(auto position = first + 1; position < last; ++position)
+        {
+          const auto& point = points[indices_[position]];
+
+          for(size_type axis = 0; axis < 3; ++axis)
+          {
+            lower[axis] = std::min(lower[axis], point[axis]);
+            upper[axis] = std::max(upper[axis], point[axis]);
+          }
+        }
+
+        const std::array<float, 3> extent{upper[0] - lower[0], upper[1] - lower[1], upper[2] - lower[2]};
+        const auto axis = extent[0] >= extent[1] && extent[0] >= extent[2] ? 0 : (extent[1] >= extent[2] ? 1 : 2);
+        const auto middle = first + (last - first) / 2;
+        const auto begin = indices_.begin();
+
+        std::nth_element(begin + static_cast<std::ptrdiff_t>(first), begin + static_cast<std::ptrdiff_t>(middle), begin + static_cast<std::ptrdiff_t>(last),
+          [&](index_type index1, index_type index2) { return points[index1][axis] < points[index2][axis]; });
+
+        current.axis = static_cast<std::uint8_t>(axis);
+        current.split = points[indices_[middle]][axis];
+
+        parallel::parallel_for(0, 2, [&](size_type child_first, size_type child_last)
+        {
+          for(auto child = child_first; child < child_last; ++child)
+          {
+            build_node(points, 2 * index + 1 + child, child == 0 ? first : middle, child == 0 ? middle : last, parallel_depth > 0 ? parallel_depth - 1 : 0);
+          }
+        }, parallel_depth > 0 ? 2 : 1);
+      }
+
+      // Visits the points of every leaf that may hold a point closer than bound(), nearer side first.
+      template<typename Bound, typename Visit>
+      void traverse(const vector3f& query, Bound bound, Visit visit) const
+      {
+        if(nodes_.empty() || points_.empty())
+          return;
+
+        std::array<std::pair<size_type, float>, 64> stack;
+        size_type top = 0;
+        stack[top++] = {0, 0.f};
+
+        while(top > 0)
+        {
+          const auto entry = stack[--top];
+
+          if(entry.second >= bound())
+            continue;
+
+          auto index = entry.first;
+
+          while(nodes_[index].axis != 3)
+          {
+            const auto& current = nodes_[index];
+            const auto offset = query[current.axis] - current.split;
+            const auto near_child = 2 * index + (offset < 0.f ? 1 : 2);
+            const auto far_child = 2 * index + (offset < 0.f ? 2 : 1);
+
+            stack[top++] = {far_child, offset * offset};
+            index = near_child;
+          }
+
+          const auto& leaf = nodes_[index];
+
+          for(size_type position = leaf.first; position < leaf.last; ++position)
+          {
+            const auto difference = points_[position] - query;
+            visit(position, difference.dot(difference));
+          }
+        }
+      }
+
+      std::vector<node> nodes_;
+      std::vector<vector3f> points_;
+      std::vector<index_type> indices_;
+    };
+  }
+}
@@ -0,0 +1,359 @@
+//
+// Copyright © 2017 Constanze Pfennig. All rights reserved.
+//
+
+#pragma once
+
+#include "vector.h"
+#include "grid.h"
+#include "instrumentation.h"
+#include "../parallel/parallel_for.h"
+
+#include <cstddef>
+#include <cstdint>
+
+
+namespace nuts
+{
+  namespace math
+  {
+    namespace detail
+    {
+      // Corner c of a cell lies at (c & 1, c >> 1 & 1, c >> 2 & 1). Cell edge 4 * axis + k runs along axis
+      // and starts at the corner whose coordinates along axis + 1 and axis + 2 (mod 3) are k & 1 and k >> 1.
+      constexpr int edge_start_corner(int edge)
+      {
+        const auto axis = edge / 4;
+        return (edge & 1) << (axis + 1) % 3 | (edge >> 1 & 1) << (axis + 2) % 3;
+      }
+
+      constexpr int cell_edge(int corner1, int corner2)
+      {
+        const auto axis = (corner1 ^ corner2) == 1 ? 0 : ((corner1 ^ corner2) == 2 ? 1 : 2);
+        return 4 * axis + (corner1 >> (axis + 1) % 3 & 1) + 2 * (corner1 >> (axis + 2) % 3 & 1);
+      }
+
+      struct marching_cubes_table
+      {
+        std::array<std::array<std::int8_t, 15>, 256> triangles{};
+        std::array<std::uint8_t, 256> triangle_count{};
+      };
+
+      // Builds the triangle table instead of spelling it out. On every cube face each intersected edge
+      // where the sign changes from outside to inside (walking counter-clockwise seen from outside) is
+      // connected to the next edge where it changes back. This separates the inside corners on
+      // ambiguous faces, and since the choice only depends on the face, neighbouring cells agree and
+      // the surface stays closed. The segments chain into loops around the cube which are fanned into
+      // triangles, wound counter-clockwise when seen from the outside (the side above the iso value).
+      constexpr marching_cubes_table make_marching_cubes_table()
+      {
+        marching_cubes_table table{};
+
+        for(int cube = 0; cube < 256; ++cube)
+        {
+          std::array<int, 12> next{};
+
+          for(auto& val : next)
+          {
+            val = -1;
+          }
+
+          for(int axis = 0; axis < 3; ++axis)
+          {
+            for(int side = 0; side < 2; ++side)
+            {
+              const auto u = 1 << (axis + 1) % 3;
+              const auto v = 1 << (axis + 2) % 3;
+              const auto base = side << axis;
+
+              std::array<int, 4> corners{base, base | u, base | u | v, base | v};
+
+              if(side == 0)
+              {
+                corners[1] = base | v;
+                corners[3] = base | u;
+              }
+
+              // 1 where the walk enters the inside on the edge after corner i, 2 where it leaves it.
+              std::array<int, 4> kind{};
+
+              for(int index = 0; index < 4; ++index)
+              {
+                const auto inside1 = cube >> corners[index] & 1;
+                const auto inside2 = cube >> corners[(index + 1) % 4] & 1;
+
+                if(inside1 != inside2)
+                  kind[index] = inside1 ? 2 : 1;
+              }
+
+              for(int index = 0; index < 4; ++index)
+              {
+                if(kind[index] != 1)
+                  continue;
+
+                for(int step = 1; step < 4; ++step)
+                {
+                  const auto other = (index + step) % 4;
+
+                  if(kind[other] == 2)
+                  {
+                    next[cell_edge(corners[other], corners[(other + 1) % 4])] = cell_edge(corners[index], corners[(index + 1) % 4]);
+                    break;
+                  }
+                }
+              }
+            }
+          }
+
+          std::array<bool, 12> visited{};
+          int count = 0;
+
+          for(int edge = 0; edge < 12; ++edge)
+          {
+            if(next[edge] < 0 || visited[edge])
+              continue;
+
+            std::array<int, 12> loop{};
+            int length = 0;
+
+            for(auto current = edge; !visited[current]; current = next[current])
+            {
+              visited[current] = true;
+              loop[length++] = current;
+            }
+
+            for(int index = 1; index + 1 < length; ++index)
+            {
+              table.triangles[cube][3 * count] = static_cast<std::int8_t>(loop[0]);
+              table.triangles[cube][3 * count + 1] = static_cast<std::int8_t>(loop[index + 1]);
+              table.triangles[cube][3 * count + 2] = static_cast<std::int8_t>(loop[index]);
+              ++count;
+            }
+          }
+
+          table.triangle_count[cube] = static_cast<std::uint8_t>(count);
+        }
+
+        return table;
+      }
+
+      inline constexpr marching_cubes_table marching_cubes_cases = make_marching_cubes_table();
+
+
+      struct marching_cubes_slice
+      {
+        std::vector<float> values;
+        std::vector<std::uint32_t> vertex_ids;
+      };
+
+      template<typename T, std::size_t TileExtent>
+      void load_slice(const grid<T, 3, TileExtent>& field, int z, std::vector<float>& values)
+      {
+        const auto& extent = field.extent();
+        values.resize(static_cast<std::size_t>(extent[0]) * static_cast<std::size_t>(extent[1]));
+
+        auto out = values.begin();
+
+        for(int y = 0; y < extent[1]; ++y)
+        {
+          for(int x = 0; x < extent[0]; ++x)
+          {
+            *out++ = static_cast<float>(field[vector3i{x, y, z}]);
+          }
+        }
+      }
+    }
+
+
+    // Extracts the surface where field crosses iso as an indexed triangle list. Every grid edge crossing
+    // yields exactly one vertex shared by all triangles that use it; positions are the grid indices
+    // scaled by spacing. The grid is processed in slabs of z slices across threads: a first pass counts
+    // vertices per slice and triangles per cell slice, so the outputs are sized once and every slab
+    // writes to its own, deterministic range.
+    template<typename T, std::size_t TileExtent>
+    void marching_cubes(const grid<T, 3, TileExtent>& field, float iso, std::vector<vector3f>& vertices, std::vector<std::uint32_t>& indices,
+      float spacing = 1.f, std::size_t threads = parallel::thread_count())
+    {
+      NUTS_INSTRUMENT(marching_cubes, field.size(), field.size() * sizeof(T));
+
+      const auto& table = detail::marching_cubes_cases;
+      const auto& extent = field.extent();
+      const auto width = static_cast<std::size_t>(extent[0]);
+      const auto slice_size = width * static_cast<std::size_t>(extent[1]);
+      const auto depth = static_cast<std::size_t>(extent[2]);
+
+      vertices.clear();
+      indices.clear();
+
+      if(extent[0] < 2 || extent[1] < 2 || extent[2] < 2)
+        return;
+
+      // Number of crossing edges starting at each point slice and of triangles in each cell slice.
+      std::vector<std::size_t> vertex_offsets(depth + 1, 0);
+      std::vector<std::size_t> index_offsets(depth, 0);
+
+      const auto cube_index = [&](const std::vector<float>& lower, const std::vector<float>& upper, std::size_t offset)
+      {
+        int cube = 0;
+
+        for(int corner = 0; corner < 8; ++corner)
+        {
+          const auto& values = corner & 4 ? upper : lower;
+          const auto val = values[offset + (corner & 1) + (corner & 2 ? width : 0)];
+          cube |= (val < iso ? 1 : 0) << corner;
+        }
+
+        return cube;
+      };
+
+      parallel::parallel_for(0, depth, [&](std::size_t first, std::size_t last)
+      {
+        std::vector<float> lower;
+        std::vector<float> upper;
+
+        detail::load_slice(field, static_cast<int>(first), lower);
+
+        for(auto z = first; z < last; ++z)
+        {
+          const auto has_upper = z + 1 < depth;
+
+          if(has_upper)
+            detail::load_slice(field, static_cast<int>(z + 1), upper);
+
+          std::size_t vertex_count = 0;
+          std::size_t triangle_count = 0;
+
+          for(std::size_t y = 0; y < static_cast<std::size_t>(extent[1]); ++y)
+          {
+            for(std::size_t x = 0; x < width; ++x)
+            {
+              const auto offset = y * width + x;
+              const auto inside = lower[offset] < iso;
+
+              vertex_count += x + 1 < width && (lower[offset + 1] < iso) != inside;
+              vertex_count += y + 1 < static_cast<std::size_t>(extent[1]) && (lower[offset + width] < iso) != inside;
+              vertex_count += has_upper && (upper[offset] < iso) != inside;
+
+              if(has_upper && x + 1 < width && y + 1 < static_cast<std::size_t>(extent[1]))
+                triangle_count += table.triangle_count[cube_index(lower, upper, offset)];
+            }
+          }
+
+          vertex_offsets[z + 1] = vertex_count;
+          index_offsets[z] = 3 * triangle_count;
+          lower.swap(upper);
+        }
+      }, threads);
+
+      for(std::size_t z = 0; z < depth; ++z)
+      {
+        vertex_offsets[z + 1] += vertex_offsets[z];
+      }
+
+      std::size_t index_count = 0;
+
+      for(auto& offset : index_offsets)
+      {
+        const auto count = offset;
+        offset = index_count;
+        index_count += count;
+      }
+
+      vertices.resize(vertex_offsets[depth]);
+      indices.resize(index_count);
+
+      // Assigns ids to the crossings starting at point slice z in the same order as the counting pass.
+      // Neighbouring slabs both build the slice between them and arrive at the same ids; only the
+      // slab below writes the positions.
+      const auto build_slice = [&](std::size_t z, const std::vector<float>& values, const std::vector<float>* upper, std::vector<std::uint32_t>& ids, bool emit)
+      {
+        ids.resize(3 * slice_size);
+        auto id = static_cast<std::uint32_t>(vertex_offsets[z]);
+
+        for(std::size_t y = 0; y < static_cast<std::size_t>(extent[1]); ++y)
+        {
+          for(std::size_t x = 0; x < width; ++x)
+          {
+            const auto offset = y * width + x;
+            const auto val = values[offset];
+
+            const std::array<const float*, 3> neighbours{
+              x + 1 < width ? &values[offset + 1] : nullptr,
+              y + 1 < static_cast<std::size_t>(extent[1]) ? &values[offset + width] : nullptr,
+              upper != nullptr ? &(*upper)[offset] : nullptr};
+
+            for(std::size_t axis = 0; axis < 3; ++axis)
+            {
+              if(neighbours[axis] == nullptr || (*neighbours[axis] < iso) == (val < iso))
+                continue;
+
+              if(emit)
+              {
+                const auto t = (iso - val) / (*neighbours[axis] - val);
+                vector3f position{static_cast<float>(x), static_cast<float>(y), static_cast<float>(z)};
+                position[axis] += t;
+
+                for(std::size_t component = 0; component < 3; ++component)
+                {
+                  position[component] *= spacing;
+                }
+
+                vertices[id] = position;
+              }
+
+              ids[3 * offset + axis] = id++;
+            }
+          }
+        }
+      };
+
+      parallel::parallel_for(0, depth - 1, [&](std::size_t first, std::size_t last)
+      {
+        detail::marching_cubes_slice lower;
+        detail::marching_cubes_slice upper;
+        std::vector<float> above;
+
+        detail::load_slice(field, static_cast<int>(first), lower.values);
+        detail::load_slice(field, static_cast<int>(first + 1), upper.values);
+        build_slice(first, lower.values, &upper.values, lower.vertex_ids, true);
+
+        for(auto z = first; z < last; ++z)
+        {
+          const auto has_above = z + 2 < depth;
+
+          if(has_above)
+            detail::load_slice(field, static_cast<int>(z + 2), above);
+
+          // The last slab owns the topmost slice as well.
+          build_slice(z + 1, upper.values, has_above ? &above : nullptr, upper.vertex_ids, z + 1 < last || z + 2 == depth);
+
+          auto out = indices.begin() + static_cast<std::ptrdiff_t>(index_offsets[z]);
+
+          for(std::size_t y = 0; y + 1 < static_cast<std::size_t>(extent[1]); ++y)
+          {
+            for(std::size_t x = 0; x + 1 < width; ++x)
+            {
+              const auto offset = y * width + x;
+              const auto cube = cube_index(lower.values, upper.values, offset);
+              const auto& triangles = table.triangles[cube];
+
+              for(int index = 0; index < 3 * table.triangle_count[cube]; ++index)
+              {
+                const int edge = triangles[index];
+                const int axis = edge / 4;
+                const int corner = detail::edge_start_corner(edge);
+                const auto& slice = corner & 4 ? upper : lower;
+                const auto point = offset + (corner & 1) + (corner & 2 ? width : 0);
+
+                *out++ = slice.vertex_ids[3 * point + axis];
+              }
+            }
+          }
+
+          std::swap(lower, upper);
+          upper.values.swap(above);
+        }
+      }, threads);
+    }
+  }
+}
@@ -0,0 +1,475 @@
+//
+// Copyright © 2017 Constanze Pfennig. All rights reserved.
+//
+
+#pragma once
+
+#include "vector.h"
+#include "radix_sort.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+
+
+namespace nuts
+{
+  namespace math
+  {
+    using mesh_index = std::uint32_t;
+
+    constexpr mesh_index invalid_mesh_index = std::numeric_limits<mesh_index>::max();
+
+
+    // Indexed triangle mesh with positions stored per component (structure of arrays).
+    // Half-edge h belongs to triangle h / 3 and runs from indices()[h] to the next corner of that
+    // triangle; the adjacency stores the opposite half-edge of each one, if built.
+    class triangle_mesh
+    {
+    public:
+      using size_type = std::size_t;
+
+      triangle_mesh() = default;
+
+      triangle_mesh(const std::vector<vector3f>& positions, std::vector<mesh_index> indices)
+        : indices_{std::move(indices)}
+      {
+        assert(indices_.size() % 3 == 0);
+
+        resize_vertices(positions.size());
+
+        for(size_type index = 0; index < positions.size(); ++index)
+        {
+          set_position(index, positions[index]);
+        }
+      }
+
+      size_type vertex_count() const noexcept
+      {
+        return positions_[0].size();
+      }
+
+      size_type triangle_count() const noexcept
+      {
+        return indices_.size() / 3;
+      }
+
+      void resize_vertices(size_type count)
+      {
+        for(auto& component : positions_)
+        {
+          component.resize(count);
+        }
+      }
+
+      vector3f position(size_type index) const
+      {
+        return vector3f{positions_[0][index], positions_[1][index], positions_[2][index]};
+      }
+
+      void set_position(size_type index, const vector3f& position)
+      {
+        for(size_type axis = 0; axis < 3; ++axis)
+        {
+          positions_[axis][index] = position[axis];
+        }
+      }
+
+      // Contiguous array of one position component for all vertices.
+      float* positions(size_type axis) noexcept
+      {
+        return positions_[axis].data();
+      }
+
+      const float* positions(size_type axis) const noexcept
+      {
+        return positions_[axis].data();
+      }
+
+      std::vector<mesh_index>& indices() noexcept
+      {
+        return indices_;
+      }
+
+      const std::vector<mesh_index>& indices() const noexcept
+      {
+        return indices_;
+      }
+
+      static size_type next_half_edge(size_type half_edge) noexcept
+      {
+        return half_edge % 3 == 2 ? half_edge - 2 : half_edge + 1;
+      }
+
+      bool has_adjacency() const noexcept
+      {
+        return !opposite_.empty() || indices_.empty();
+      }
+
+      // Opposite half-edge per half-edge, or invalid_mesh_index on borders and non-manifold edges.
+      const std::vector<mesh_index>& opposite() const noexcept
+      {
+        return opposite_;
+      }
+
+      // Pairs half-edges by sorting them on their undirected vertex pair with a radix sort, so
+      // the build is linear in the number of triangles and needs no hash map.
+      void build_adjacency()
+      {
+        const auto count = indices_.size();
+        std::vector<std::uint64_t> keys(count);
+        std::vector<mesh_index> half_edges(count);
+
+        for(size_type half_edge = 0; half_edge < count; ++half_edge)
+        {
+          const std::uint64_t from = indices_[half_edge];
+          const std::uint64_t to = indices_[next_half_edge(half_edge)];
+
+          keys[half_edge] = std::min(from, to) << 32 | std::max(from, to);
+          half_edges[half_edge] = static_cast<mesh_index>(half_edge);
+        }
+
+        radix_sort(keys, half_edges);
+
+        opposite_.assign(count, invalid_mesh_index);
+
+        for(size_type first = 0; first < count;)
+        {
+          auto last = first + 1;
+
+          while(last < count && keys[last] == keys[first])
+          {
+            ++last;
+          }
+
+          // Only edges shared by exactly two oppositely oriented half-edges are manifold.
+          if(last - first == 2)
+          {
+            const auto half_edge1 = half_edges[first];
+            const auto half_edge2 = half_edges[first + 1];
+
+            if(indices_[half_edge1] == indices_[next_half_edge(half_edge2)])
+            {
+              opposite_[half_edge1] = half_edge2;
+              opposite_[half_edge2] = half_edge1;
+            }
+          }
+
+          first = last;
+        }
+      }
+
+      void clear_adjacency()
+      {
+        opposite_.clear();
+        opposite_.shrink_to_fit();
+      }
+
+      // Reorders the vertices by remap (old index to new index); vertices mapped to invalid_mesh_index are dropped.
+      void remap_vertices(const std::vector<mesh_index>& remap, size_type new_count)
+      {
+        assert(remap.size() == vertex_count());
+
+        for(auto& component : positions_)
+        {
+          std::vector<float> reordered(new_count);
+
+          for(size_type index = 0; index < remap.size(); ++index)
+          {
+            if(remap[index] != invalid_mesh_index)
+              reordered[remap[index]] = component[index];
+          }
+
+          component.swap(reordered);
+        }
+
+        for(auto& index : indices_)
+        {
+          index = remap[index];
+        }
+      }
+
+    private:
+      std::array<std::vector<float>, 3> positions_;
+      std::vector<mesh_index> indices_;
+      std::vector<mesh_index> opposite_;
+    };
+
+
+    // Triangle corners around each vertex in compressed rows: the corners of vertex v are
+    // corners[first[v]] up to corners[first[v + 1]], and corner c belongs to triangle c / 3.
+    // It only depends on the topology, so it can be kept while the positions change.
+    struct vertex_adjacency
+    {
+      std::vector<std::size_t> first;
+      std::vector<mesh_index> corners;
+
+      std::size_t vertex_count() const noexcept
+      {
+        return first.empty() ? 0 : first.size() - 1;
+      }
+    };
+
+    inline vertex_adjacency build_vertex_adjacency(const std::vector<mesh_index>& indices, std::size_t vertex_count)
+    {
+      vertex_adjacency adjacency;
+      adjacency.first.assign(vertex_count + 1, 0);
+      adjacency.corners.resize(indices.size());
+
+      for(auto index : indices)
+      {
+        ++adjacency.first[index + 1];
+      }
+
+      for(std::size_t vertex = 0; vertex < vertex_count; ++vertex)
+      {
+        adjacency.first[vertex + 1] += adjacency.first[vertex];
+      }
+
+      std::vector<std::size_t> fill(adjacency.first.begin(), adjacency.first.end() - 1);
+
+      for(std::size_t corner = 0; corner < indices.size(); ++corner)
+      {
+        adjacency.corners[fill[indices[corner]]++] = static_cast<mesh_index>(corner);
+      }
+
+      return adjacency;
+    }
+
+
+    namespace detail
+    {
+      constexpr std::size_t vertex_cache_size = 32;
+
+      // Vertex scores after Tom Forsyth, "Linear-Speed Vertex Cache Optimisation".
+      struct vertex_cache_scores
+      {
+        std::array<float, vertex_cache_size + 3> position;
+        std::array<float, 32> valence;
+
+        vertex_cache_scores()
+        {
+          for(std::size_t index = 0; index < position.size(); ++index)
+          {
+            if(index < 3)
+              position[index] = 0.75f;
+            else if(index < vertex_cache_size)
+              position[index] = std::pow(1.f - static_cast<float>(index - 3) / (vertex_cache_size - 3), 1.5f);
+            else
+              position[index] = 0.f;
+          }
+
+          valence[0] = 0.f;
+
+          for(std::size_t index = 1; index < valence.size(); ++index)
+          {
+            valence[index] = 2.f / std::sqrt(static_cast<float>(index));
+          }
+        }
+
+        float operator()(int cache_position, std::size_t remaining) const
+        {
+          if(remaining == 0)
+            return -1.f;
+
+          const auto cache_score = cache_position < 0 ? 0.f : position[static_cast<std::size_t>(cache_position)];
+          const auto valence_score = remaining < valence.size() ? valence[remaining] : 2.f / std::sqrt(static_cast<float>(remaining));
+          return cache_score + valence_score;
+        }
+      };
+    }
+
+
+    // Reorders the triangles for the post-transform vertex cache with Forsyth's greedy algorithm:
+    // the next triangle is the best scored one among those touching the simulated LRU cache, falling
+    // back to the next unemitted triangle in input order when the cache runs dry.
+    inline void optimize_vertex_cache(std::vector<mesh_index>& indices, std::size_t vertex_count)
+    {
+      assert(indices.size() % 3 == 0);
+
+      static const detail::vertex_cache_scores score;
+
+      const auto triangle_count = indices.size() / 3;
+
+      if(triangle_count == 0)
+        return;
+
+      // Triangles adjacent to each vertex in compressed rows.
+      std::vector<std::size_t> remaining(vertex_count, 0);
+
+      for(auto index : indices)
+      {
+        ++remaining[index];
+      }
+
+      std::vector<std::size_t> first_triangle(vertex_count + 1, 0);
+
+      for(std::size_t vertex = 0; vertex < vertex_count; ++vertex)
+      {
+        first_triangle[vertex + 1] = first_triangle[vertex] + remaining[vertex];
+      }
+
+      std::vector<mesh_index> adjacent(indices.size());
+      std::vector<std::size_t> fill(first_triangle.begin(), first_triangle.end() - 1);
+
+      for(std::size_t index = 0; index < indices.size(); ++index)
+      {
+        adjacent[fill[indices[index]]++] = static_cast<mesh_index>(index / 3);
+      }
+
+      std::vector<float> vertex_score(vertex_count);
+
+      for(std::size_t vertex = 0; vertex < vertex_count; ++vertex)
+      {
+        vertex_score[vertex] = score(-1, remaining[vertex]);
+      }
+
+      std::vector<bool> emitted(triangle_count, false);
+
+      std::vector<mesh_index> result;
+      result.reserve(indices.size());
+
+      std::array<mesh_index, detail::vertex_cache_size + 3> cache;
+      std::array<mesh_index, detail::vertex_cache_size + 3> new_cache;
+      std::size_t cache_count = 0;
+      std::size_t cursor = 0;
+
+      auto best = static_cast<std::size_t>(0);
+
+      while(result.size() < indices.size())
+      {
+        emitted[best] = true;
+
+        // Move the vertices of the emitted triangle to the front of the cache.
+        std::size_t new_count = 0;
+
+        for(std::size_t corner = 0; corner < 3; ++corner)
+        {
+          const auto vertex = indices[3 * best + corner];
+          result.push_back(vertex);
+          new_cache[new_count++] = vertex;
+
+          auto& rows = remaining[vertex];
+          const auto begin = adjacent.begin() + static_cast<std::ptrdiff_t>(first_triangle[vertex]);
+          const auto found = std::find(begin, begin + static_cast<std::ptrdiff_t>(rows), static_cast<mesh_index>(best));
+          std::iter_swap(found, begin + static_cast<std::ptrdiff_t>(rows) - 1);
+          --rows;
+        }
+
+        for(std::size_t index = 0; index < cache_count; ++index)
+        {
+          const auto vertex = cache[index];
+
+          if(vertex != new_cache[0] && vertex != new_cache[1] && vertex != new_cache[2])
+            new_cache[new_count++] = vertex;
+        }
+
+        cache.swap(new_cache);
+        cache_count = std::min(new_count, detail::vertex_cache_size);
+
+        for(std::size_t index = cache_count; index < new_count; ++index)
+        {
+          vertex_score[cache[index]] = score(-1, remaining[cache[index]]);
+        }
+
+        for(std::size_t index = 0; index < cache_count; ++index)
+        {
+          vertex_score[cache[index]] = score(static_cast<int>(index), remaining[cache[index]]);
+        }
+
+        // Rescore the triangles touching the cache and pick the best one.
+        auto best_score = -1.f;
+        auto next = triangle_count;
+
+        for(std::size_t index = 0; index < new_count; ++index)
+        {
+          const auto vertex = cache[index];
+          const auto begin = first_triangle[vertex];
+
+          for(auto row = begin; row < begin + remaining[vertex]; ++row)
+          {
+            const auto triangle = adjacent[row];
+            const auto val = vertex_score[indices[3 * triangle]] + vertex_score[indices[3 * triangle + 1]] + vertex_score[indices[3 * triangle + 2]];
+
+            if(val > best_score)
+            {
+              best_score = val;
+              next = triangle;
+            }
+          }
+        }
+
+        if(next == triangle_count)
+        {
+          while(cursor < triangle_count && emitted[cursor])
+          {
+            ++cursor;
+          }
+
+          next = cursor;
+        }
+
+        if(next == triangle_count)
+          break;
+
+        best = next;
+      }
+
+      indices.swap(result);
+    }
+
+    // Numbers the vertices in order of first use, so that vertex fetches walk memory forward. Returns
+    // the remap from old to new index; unreferenced vertices map to invalid_mesh_index.
+    inline std::vector<mesh_index> vertex_fetch_remap(const std::vector<mesh_index>& indices, std::size_t vertex_count, std::size_t& new_count)
+    {
+      std::vector<mesh_index> remap(vertex_count, invalid_mesh_index);
+      mesh_index next = 0;
+
+      for(auto index : indices)
+      {
+        if(remap[index] == invalid_mesh_index)
+          remap[index] = next++;
+      }
+
+      new_count = next;
+      return remap;
+    }
+
+    // Average number of vertex transforms per triangle with a FIFO cache of the given size; 0.5 is the ideal for large regular meshes.
+    inline float average_cache_miss_ratio(const std::vector<mesh_index>& indices, std::size_t vertex_count, std::size_t cache_size = 16)
+    {
+      if(indices.empty())
+        return 0.f;
+
+      std::vector<std::size_t> inserted(vertex_count, 0);
+      std::size_t time = cache_size + 1;
+      std::size_t misses = 0;
+
+      for(auto index : indices)
+      {
+        if(time - inserted[index] > cache_size)
+        {
+          inserted[index] = time++;
+          ++misses;
+        }
+      }
+
+      return static_cast<float>(misses) / static_cast<float>(indices.size() / 3);
+    }
+
+    inline void optimize_vertex_cache(triangle_mesh& mesh)
+    {
+      mesh.clear_adjacency();
+      optimize_vertex_cache(mesh.indices(), mesh.vertex_count());
+    }
+
+    // Reorders the vertices of mesh in order of first use and drops unreferenced ones.
+    inline void optimize_vertex_fetch(triangle_mesh& mesh)
+    {
+      std::size_t new_count = 0;
+      const auto remap = vertex_fetch_remap(mesh.indices(), mesh.vertex_count(), new_count);
+
+      mesh.remap_vertices(remap, new_count);
+    }
+  }
+}
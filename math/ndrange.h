@@ -0,0 +1,435 @@
+//
+// Copyright © 2017 Constanze Pfennig. All rights reserved.
+//
+
+#pragma once
+
+#include "vector.h"
+#include "../parallel/parallel_for.h"
+
+#include <cstddef>
+#include <cstdint>
+
+
+namespace nuts
+{
+  namespace math
+  {
+    // The half-open box [first, last) of integer indices. All traversals run along x fastest.
+    template<std::size_t Rank>
+    class ndrange
+    {
+    public:
+      static_assert(Rank == 2 || Rank == 3, "Rank of ndrange must be 2 or 3.");
+
+      using index_type = vector<int, Rank>;
+      using size_type = std::size_t;
+
+      class iterator
+      {
+      public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = index_type;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const index_type*;
+        using reference = const index_type&;
+
+        iterator() = default;
+
+        iterator(const ndrange* range, const index_type& index)
+          : range_{range},
+            index_{index}
+        {
+        }
+
+        reference operator*() const
+        {
+          return index_;
+        }
+
+        pointer operator->() const
+        {
+          return &index_;
+        }
+
+        iterator& operator++()
+        {
+          for(size_type axis = 0; axis < Rank; ++axis)
+          {
+            if(++index_[axis] < range_->last()[axis] || axis + 1 == Rank)
+              break;
+
+            index_[axis] = range_->first()[axis];
+          }
+
+          return *this;
+        }
+
+        iterator operator++(int)
+        {
+          auto result = *this;
+          ++*this;
+          return result;
+        }
+
+        bool operator==(const iterator& other) const
+        {
+          return index_ == other.index_;
+        }
+
+        bool operator!=(const iterator& other) const
+        {
+          return index_ != other.index_;
+        }
+
+      private:
+        const ndrange* range_ = nullptr;
+        index_type index_{};
+      };
+
+      using const_iterator = iterator;
+
+      ndrange() = default;
+
+      ndrange(const index_type& first, const index_type& last)
+        : first_{first},
+          last_{last}
+      {
+        for(size_type axis = 0; axis < Rank; ++axis)
+        {
+          last_[axis] = std::max(last_[axis], first_[axis]);
+        }
+      }
+
+      explicit ndrange(const index_type& extent)
+        : ndrange{index_type{}, extent}
+      {
+      }
+
+      const index_type& first() const noexcept
+      {
+        return first_;
+      }
+
+      const index_type& last() const noexcept
+      {
+        return last_;
+      }
+
+      index_type extent() const
+      {
+        return last_ - first_;
+      }
+
+      size_type size() const
+      {
+        size_type result = 1;
+
+        for(size_type axis = 0; axis < Rank; ++axis)
+        {
+          result *= static_cast<size_type>(last_[axis] - first_[axis]);
+        }
+
+        return result;
+      }
+
+      bool empty() const
+      {
+        return size() == 0;
+      }
+
+      bool contains(const index_type& index) const
+      {
+        for(size_type axis = 0; axis < Rank; ++axis)
+        {
+          if(index[axis] < first_[axis] || index[axis] >= last_[axis])
+            return false;
+        }
+
+        return true;
+      }
+
+      iterator begin() const
+      {
+        return empty() ? end() : iterator{this, first_};
+      }
+
+      iterator end() const
+      {
+        auto index = first_;
+        index[Rank - 1] = last_[Rank - 1];
+        return iterator{this, index};
+      }
+
+      // Number of tiles of the given extent needed to cover the range. Tiles at the upper border are cut off.
+      index_type tiles(const index_type& tile_extent) const
+      {
+        index_type result;
+
+        for(size_type axis = 0; axis < Rank; ++axis)
+        {
+          assert(tile_extent[axis] > 0);
+          result[axis] = (last_[axis] - first_[axis] + tile_extent[axis] - 1) / tile_extent[axis];
+        }
+
+        return result;
+      }
+
+      size_type tile_count(const index_type& tile_extent) const
+      {
+        const auto counts = tiles(tile_extent);
+        size_type result = 1;
+
+        for(auto count : counts)
+        {
+          result *= static_cast<size_type>(count);
+        }
+
+        return result;
+      }
+
+      // Tile with the given row-major index.
+      ndrange tile(size_type index, const index_type& tile_extent) const
+      {
+        const auto counts = tiles(tile_extent);
+        index_type tile_first;
+        index_type tile_last;
+
+        for(size_type axis = 0; axis < Rank; ++axis)
+        {
+          const auto count = static_cast<size_type>(counts[axis]);
+
+          tile_first[axis] = first_[axis] + static_cast<int>(index % count) * tile_extent[axis];
+          tile_last[axis] = std::min(tile_first[axis] + tile_extent[axis], last_[axis]);
+          index /= count;
+        }
+
+        return ndrange{tile_first, tile_last};
+      }
+
+    private:
+      index_type first_{};
+      index_type last_{};
+    };
+
+
+    using ndrange2 = ndrange<2>;
+    using ndrange3 = ndrange<3>;
+
+
+    // Roughly 4096 cells per tile, which keeps a tile of a few small arrays inside L1 / L2.
+    template<std::size_t Rank>
+    vector<int, Rank> default_tile_extent()
+    {
+      if constexpr(Rank == 2)
+        return vector<int, 2>{64, 64};
+      else
+        return vector<int, 3>{16, 16, 16};
+    }
+
+
+    namespace detail
+    {
+      inline std::uint64_t spread_bits2(std::uint64_t val)
+      {
+        val &= 0xffffffffull;
+        val = (val | val << 16) & 0x0000ffff0000ffffull;
+        val = (val | val << 8) & 0x00ff00ff00ff00ffull;
+        val = (val | val << 4) & 0x0f0f0f0f0f0f0f0full;
+        val = (val | val << 2) & 0x3333333333333333ull;
+        return (val | val << 1) & 0x5555555555555555ull;
+      }
+
+      inline std::uint64_t compact_bits2(std::uint64_t val)
+      {
+        val &= 0x5555555555555555ull;
+        val = (val | val >> 1) & 0x3333333333333333ull;
+        val = (val | val >> 2) & 0x0f0f0f0f0f0f0f0full;
+        val = (val | val >> 4) & 0x00ff00ff00ff00ffull;
+        val = (val | val >> 8) & 0x0000ffff0000ffffull;
+        return (val | val >> 16) & 0x00000000ffffffffull;
+      }
+
+      inline std::uint64_t spread_bits3(std::uint64_t val)
+      {
+        val &= 0x1fffffull;
+        val = (val | val << 32) & 0x001f00000000ffffull;
+        val = (val | val << 16) & 0x001f0000ff0000ffull;
+        val = (val | val << 8) & 0x100f00f00f00f00full;
+        val = (val | val << 4) & 0x10c30c30c30c30c3ull;
+        return (val | val << 2) & 0x1249249249249249ull;
+      }
+
+      inline std::uint64_t compact_bits3(std::uint64_t val)
+      {
+        val &= 0x1249249249249249ull;
+        val = (val | val >> 2) & 0x10c30c30c30c30c3ull;
+        val = (val | val >> 4) & 0x100f00f00f00f00full;
+        val = (val | val >> 8) & 0x001f0000ff0000ffull;
+        val = (val | val >> 16) & 0x001f00000000ffffull;
+        return (val | val >> 32) & 0x1fffffull;
+      }
+
+      template<std::size_t Rank, typename Function>
+      void for_each_row_major(const vector<int, Rank>& first, const vector<int, Rank>& last, Function& function)
+      {
+        vector<int, Rank> index;
+
+        if constexpr(Rank == 2)
+        {
+          for(index[1] = first[1]; index[1] < last[1]; ++index[1])
+          {
+            for(index[0] = first[0]; index[0] < last[0]; ++index[0])
+            {
+              function(static_cast<const vector<int, Rank>&>(index));
+            }
+          }
+        }
+        else
+        {
+          for(index[2] = first[2]; index[2] < last[2]; ++index[2])
+          {
+            for(index[1] = first[1]; index[1] < last[1]; ++index[1])
+            {
+              for(index[0] = first[0]; index[0] < last[0]; ++index[0])
+              {
+                function(static_cast<const vector<int, Rank>&>(index));
+              }
+            }
+          }
+        }
+      }
+
+      // Splits every axis longer than the largest power of two below the longest extent and visits
+      // the children in Morton order. For boxes at the origin this is exactly the Morton order of the
+      // enclosing power-of-two box with the cells outside of the range skipped.
+      template<std::size_t Rank, typename Function>
+      void for_each_morton(const vector<int, Rank>& first, const vector<int, Rank>& last, Function& function)
+      {
+        int longest = 0;
+
+        for(std::size_t axis = 0; axis < Rank; ++axis)
+        {
+          longest = std::max(longest, last[axis] - first[axis]);
+        }
+
+        if(longest <= 1)
+        {
+          if(longest == 1)
+            function(first);
+
+          return;
+        }
+
+        int half = 1;
+
+        while(half * 2 < longest)
+        {
+          half *= 2;
+        }
+
+        for(std::size_t child = 0; child < (std::size_t{1} << Rank); ++child)
+        {
+          auto child_first = first;
+          auto child_last = last;
+          bool empty = false;
+
+          for(std::size_t axis = 0; axis < Rank; ++axis)
+          {
+            const auto split = last[axis] - first[axis] > half ? first[axis] + half : last[axis];
+
+            if(child >> axis & 1)
+            {
+              child_first[axis] = split;
+              empty = empty || split == last[axis];
+            }
+            else
+            {
+              child_last[axis] = split;
+            }
+          }
+
+          if(!empty)
+            for_each_morton(child_first, child_last, function);
+        }
+      }
+    }
+
+
+    // Coordinates must be non-negative, and for three dimensions below 2^21.
+    inline std::uint64_t morton_encode(const vector2i& index)
+    {
+      assert(index[0] >= 0 && index[1] >= 0);
+      return detail::spread_bits2(static_cast<std::uint64_t>(index[0])) | detail::spread_bits2(static_cast<std::uint64_t>(index[1])) << 1;
+    }
+
+    inline std::uint64_t morton_encode(const vector3i& index)
+    {
+      assert(index[0] >= 0 && index[1] >= 0 && index[2] >= 0);
+      return detail::spread_bits3(static_cast<std::uint64_t>(index[0])) | detail::spread_bits3(static_cast<std::uint64_t>(index[1])) << 1 |
+        detail::spread_bits3(static_cast<std::uint64_t>(index[2])) << 2;
+    }
+
+    inline vector2i morton_decode2(std::uint64_t code)
+    {
+      return vector2i{detail::compact_bits2(code), detail::compact_bits2(code >> 1)};
+    }
+
+    inline vector3i morton_decode3(std::uint64_t code)
+    {
+      return vector3i{detail::compact_bits3(code), detail::compact_bits3(code >> 1), detail::compact_bits3(code >> 2)};
+    }
+
+
+    // Calls function(index) for every index in row-major order.
+    template<std::size_t Rank, typename Function>
+    void for_each(const ndrange<Rank>& range, Function function)
+    {
+      detail::for_each_row_major(range.first(), range.last(), function);
+    }
+
+    // Calls function(index) tile by tile, with the tiles and the indices inside each tile in row-major order.
+    template<std::size_t Rank, typename Function>
+    void for_each_blocked(const ndrange<Rank>& range, const vector<int, Rank>& tile_extent, Function function)
+    {
+      const auto count = range.tile_count(tile_extent);
+
+      for(std::size_t index = 0; index < count; ++index)
+      {
+        const auto tile = range.tile(index, tile_extent);
+        detail::for_each_row_major(tile.first(), tile.last(), function);
+      }
+    }
+
+    // Calls function(index) in Morton (Z-curve) order relative to the first corner of the range.
+    template<std::size_t Rank, typename Function>
+    void for_each_morton(const ndrange<Rank>& range, Function function)
+    {
+      if(!range.empty())
+        detail::for_each_morton(range.first(), range.last(), function);
+    }
+
+    // Splits the range into tiles and calls function(tile) for each one, with consecutive runs of tiles spread across threads.
+    template<std::size_t Rank, typename Function>
+    void parallel_for_tiles(const ndrange<Rank>& range, Function function, const vector<int, Rank>& tile_extent = default_tile_extent<Rank>(), std::size_t threads = parallel::thread_count())
+    {
+      parallel::parallel_for(0, range.tile_count(tile_extent), [&](std::size_t first, std::size_t last)
+      {
+        for(auto index = first; index < last; ++index)
+        {
+          function(range.tile(index, tile_extent));
+        }
+      }, threads);
+    }
+
+    // Calls function(index) for every index, tile by tile, with the tiles spread across threads.
+    template<std::size_t Rank, typename Function>
+    void parallel_for(const ndrange<Rank>& range, Function function, const vector<int, Rank>& tile_extent = default_tile_extent<Rank>(), std::size_t threads = parallel::thread_count())
+    {
+      parallel_for_tiles(range, [&](const ndrange<Rank>& tile)
+      {
+        detail::for_each_row_major(tile.first(), tile.last(), function);
+      }, tile_extent, threads);
+    }
+  }
+}
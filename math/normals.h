@@ -0,0 +1,281 @@
+//
+// Copyright © 2017 Constanze Pfennig. All rights reserved.
+//
+
+#pragma once
+
+#include "vector.h"
+#include "mesh.h"
+#include "simd.h"
+#include "instrumentation.h"
+#include "../parallel/parallel_for.h"
+
+#include <cmath>
+#include <cstddef>
+
+
+namespace nuts
+{
+  namespace math
+  {
+    enum class normal_weighting
+    {
+      // Each triangle counts with its area.
+      area,
+      // Each triangle counts with its interior angle at the vertex, independent of the tessellation.
+      angle
+    };
+
+
+    namespace detail
+    {
+      // Weighted normal of every triangle corner: the area weighted normal is the plain cross product
+      // of two edges, the angle weighted one the unit normal times the corner angle.
+      inline void corner_normal(const vector3f& position0, const vector3f& position1, const vector3f& position2, normal_weighting weighting, vector3f* result)
+      {
+        const auto edge1 = position1 - position0;
+        const auto edge2 = position2 - position0;
+        const auto normal = cross(edge1, edge2);
+
+        if(weighting == normal_weighting::area)
+        {
+          result[0] = result[1] = result[2] = normal;
+          return;
+        }
+
+        const auto length = normal.length();
+
+        if(length <= 0.f)
+        {
+          result[0] = result[1] = result[2] = vector3f{0.f, 0.f, 0.f};
+          return;
+        }
+
+        const auto edge3 = position2 - position1;
+        const auto scale = 1.f / length;
+
+        // atan2 of |e1 x e2| and e1.e2 is accurate for all angles, unlike acos of the normalized dot.
+        result[0] = normal * (std::atan2(length, edge1.dot(edge2)) * scale);
+        result[1] = normal * (std::atan2(length, -edge1.dot(edge3)) * scale);
+        result[2] = normal * (std::atan2(length, edge2.dot(edge3)) * scale);
+      }
+
+      inline void corner_normals(const std::vector<vector3f>& positions, const std::vector<mesh_index>& indices, normal_weighting weighting,
+        std::size_t first, std::size_t last, vector3f* result)
+      {
+        auto triangle = first;
+
+#if defined(NUTS_MATH_SSE2)
+        // Four triangles per step, with the corners transposed into one register per component.
+        for(; triangle + 4 <= last; triangle += 4)
+        {
+          __m128 x[3];
+          __m128 y[3];
+          __m128 z[3];
+
+          for(std::size_t corner = 0; corner < 3; ++corner)
+          {
+            const auto& position0 = positions[indices[3 * triangle + corner]];
+            const auto& position1 = positions[indices[3 * triangle + 3 + corner]];
+            const auto& position2 = positions[indices[3 * triangle + 6 + corner]];
+            const auto& position3 = positions[indices[3 * triangle + 9 + corner]];
+
+            x[corner] = _mm_setr_ps(position0[0], position1[0], position2[0], position3[0]);
+            y[corner] = _mm_setr_ps(position0[1], position1[1], position2[1], position3[1]);
+            z[corner] = _mm_setr_ps(position0[2], position1[2], position2[2], position3[2]);
+          }
+
+          const auto edge1_x = _mm_sub_ps(x[1], x[0]), edge1_y = _mm_sub_ps(y[1], y[0]), edge1_z = _mm_sub_ps(z[1], z[0]);
+          const auto edge2_x = _mm_sub_ps(x[2], x[0]), edge2_y = _mm_sub_ps(y[2], y[0]), edge2_z = _mm_sub_ps(z[2], z[0]);
+
+          const auto normal_x = _mm_sub_ps(_mm_mul_ps(edge1_y, edge2_z), _mm_mul_ps(edge1_z, edge2_y));
+          const auto normal_y = _mm_sub_ps(_mm_mul_ps(edge1_z, edge2_x), _mm_mul_ps(edge1_x, edge2_z));
+          const auto normal_z = _mm_sub_ps(_mm_mul_ps(edge1_x, edge2_y), _mm_mul_ps(edge1_y, edge2_x));
+
+          alignas(16) std::array<float, 4> out_x;
+          alignas(16) std::array<float, 4> out_y;
+          alignas(16) std::array<float, 4> out_z;
+          _mm_store_ps(out_x.data(), normal_x);
+          _mm_store_ps(out_y.data(), normal_y);
+          _mm_store_ps(out_z.data(), normal_z);
+
+          if(weighting == normal_weighting::area)
+          {
+            for(std::size_t lane = 0; lane < 4; ++lane)
+            {
+              auto out = result + 3 * (triangle + lane - first);
+              out[0] = out[1] = out[2] = vector3f{out_x[lane], out_y[lane], out_z[lane]};
+            }
+
+            continue;
+          }
+
+          // The angles need atan2, which has no SSE counterpart; only the dot products stay vectorized.
+          const auto edge3_x = _mm_sub_ps(x[2], x[1]), edge3_y = _mm_sub_ps(y[2], y[1]), edge3_z = _mm_sub_ps(z[2], z[1]);
+
+          const auto dot = [](__m128 ax, __m128 ay, __m128 az, __m128 bx, __m128 by, __m128 bz)
+          {
+            return _mm_add_ps(_mm_add_ps(_mm_mul_ps(ax, bx), _mm_mul_ps(ay, by)), _mm_mul_ps(az, bz));
+          };
+
+          alignas(16) std::array<float, 4> length;
+          alignas(16) std::array<std::array<float, 4>, 3> cosine;
+          _mm_store_ps(length.data(), _mm_sqrt_ps(dot(normal_x, normal_y, normal_z, normal_x, normal_y, normal_z)));
+          _mm_store_ps(cosine[0].data(), dot(edge1_x, edge1_y, edge1_z, edge2_x, edge2_y, edge2_z));
+          _mm_store_ps(cosine[1].data(), _mm_sub_ps(_mm_setzero_ps(), dot(edge1_x, edge1_y, edge1_z, edge3_x, edge3_y, edge3_z)));
+          _mm_store_ps(cosine[2].data(), dot(edge2_x, edge2_y, edge2_z, edge3_x, edge3_y, edge3_z));
+
+          for(std::size_t lane = 0; lane < 4; ++lane)
+          {
+            auto out = result + 3 * (triangle + lane - first);
+            const vector3f normal{out_x[lane], out_y[lane], out_z[lane]};
+            const auto scale = length[lane] > 0.f ? 1.f / length[lane] : 0.f;
+
+            for(std::size_t corner = 0; corner < 3; ++corner)
+            {
+              out[corner] = normal * (std::atan2(length[lane], cosine[corner][lane]) * scale);
+            }
+          }
+        }
+#endif
+
+        for(; triangle < last; ++triangle)
+        {
+          corner_normal(positions[indices[3 * triangle]], positions[indices[3 * triangle + 1]], positions[indices[3 * triangle + 2]],
+            weighting, result + 3 * (triangle - first));
+        }
+      }
+
+      inline vector3f normalize_or_zero(const vector3f& vec)
+      {
+        const auto length = vec.length();
+        return length > 0.f ? vec * (1.f / length) : vector3f{0.f, 0.f, 0.f};
+      }
+    }
+
+
+    // Unit normal per vertex, the weighted sum of the normals of its triangles. Both passes run in
+    // parallel without atomics: the face pass writes one weighted normal per triangle corner, and the
+    // vertex pass gathers the corners of each vertex through adjacency, so no two threads ever add to
+    // the same vertex. Vertices without (non-degenerate) triangles get a zero normal. adjacency only
+    // depends on the indices and can be reused when the positions change, e.g. after deformation.
+    inline void vertex_normals(const std::vector<vector3f>& positions, const std::vector<mesh_index>& indices, const vertex_adjacency& adjacency,
+      std::vector<vector3f>& normals, normal_weighting weighting = normal_weighting::area, std::size_t threads = parallel::thread_count())
+    {
+      assert(indices.size() % 3 == 0);
+      assert(adjacency.vertex_count() == positions.size());
+
+      NUTS_INSTRUMENT(vertex_normals, positions.size(), positions.size() * 2 * sizeof(vector3f) + indices.size() * sizeof(mesh_index));
+
+      std::vector<vector3f> corners(indices.size());
+
+      parallel::parallel_for(0, indices.size() / 3, [&](std::size_t first, std::size_t last)
+      {
+        NUTS_UNCOUNTED_SCOPE();
+
+        detail::corner_normals(positions, indices, weighting, first, last, corners.data() + 3 * first);
+      }, threads);
+
+      normals.resize(positions.size());
+
+      parallel::parallel_for(0, positions.size(), [&](std::size_t first, std::size_t last)
+      {
+        NUTS_UNCOUNTED_SCOPE();
+
+        for(auto vertex = first; vertex < last; ++vertex)
+        {
+          vector3f sum{0.f, 0.f, 0.f};
+
+          for(auto row = adjacency.first[vertex]; row < adjacency.first[vertex + 1]; ++row)
+          {
+            sum += corners[adjacency.corners[row]];
+          }
+
+          normals[vertex] = detail::normalize_or_zero(sum);
+        }
+      }, threads);
+    }
+
+    inline void vertex_normals(const std::vector<vector3f>& positions, const std::vector<mesh_index>& indices, std::vector<vector3f>& normals,
+      normal_weighting weighting = normal_weighting::area, std::size_t threads = parallel::thread_count())
+    {
+      vertex_normals(positions, indices, build_vertex_adjacency(indices, positions.size()), normals, weighting, threads);
+    }
+
+    // Tangent frame per vertex for normal mapping with the texture coordinates uvs: xyz is the unit
+    // tangent along increasing u, orthogonalized against the vertex normal, and w the handedness
+    // (1 or -1) so that the bitangent is cross(normal, tangent) * w. Triangle tangents are weighted by
+    // their area and accumulated per vertex in the same conflict free way as vertex_normals.
+    inline void vertex_tangents(const std::vector<vector3f>& positions, const std::vector<vector2f>& uvs, const std::vector<vector3f>& normals,
+      const std::vector<mesh_index>& indices, const vertex_adjacency& adjacency, std::vector<vector4f>& tangents, std::size_t threads = parallel::thread_count())
+    {
+      assert(indices.size() % 3 == 0);
+      assert(uvs.size() == positions.size() && normals.size() == positions.size());
+      assert(adjacency.vertex_count() == positions.size());
+
+      NUTS_INSTRUMENT(vertex_tangents, positions.size(),
+        positions.size() * (2 * sizeof(vector3f) + sizeof(vector2f) + sizeof(vector4f)) + indices.size() * sizeof(mesh_index));
+
+      const auto triangle_count = indices.size() / 3;
+
+      // Tangent and bitangent per triangle, scaled by the sign of the uv area so mirrored triangles agree.
+      std::vector<vector3f> frames(2 * triangle_count);
+
+      parallel::parallel_for(0, triangle_count, [&](std::size_t first, std::size_t last)
+      {
+        NUTS_UNCOUNTED_SCOPE();
+
+        for(auto triangle = first; triangle < last; ++triangle)
+        {
+          const auto vertex0 = indices[3 * triangle];
+          const auto vertex1 = indices[3 * triangle + 1];
+          const auto vertex2 = indices[3 * triangle + 2];
+
+          const auto edge1 = positions[vertex1] - positions[vertex0];
+          const auto edge2 = positions[vertex2] - positions[vertex0];
+          const auto uv1 = uvs[vertex1] - uvs[vertex0];
+          const auto uv2 = uvs[vertex2] - uvs[vertex0];
+
+          const auto area = uv1[0] * uv2[1] - uv2[0] * uv1[1];
+          const auto sign = area < 0.f ? -1.f : (area > 0.f ? 1.f : 0.f);
+
+          frames[2 * triangle] = (edge1 * uv2[1] - edge2 * uv1[1]) * sign;
+          frames[2 * triangle + 1] = (edge2 * uv1[0] - edge1 * uv2[0]) * sign;
+        }
+      }, threads);
+
+      tangents.resize(positions.size());
+
+      parallel::parallel_for(0, positions.size(), [&](std::size_t first, std::size_t last)
+      {
+        NUTS_UNCOUNTED_SCOPE();
+
+        for(auto vertex = first; vertex < last; ++vertex)
+        {
+          vector3f tangent{0.f, 0.f, 0.f};
+          vector3f bitangent{0.f, 0.f, 0.f};
+
+          for(auto row = adjacency.first[vertex]; row < adjacency.first[vertex + 1]; ++row)
+          {
+            const auto triangle = adjacency.corners[row] / 3;
+            tangent += frames[2 * triangle];
+            bitangent += frames[2 * triangle + 1];
+          }
+
+          // Gram-Schmidt against the normal.
+          const auto& normal = normals[vertex];
+          tangent = detail::normalize_or_zero(tangent - normal * normal.dot(tangent));
+
+          const auto handedness = cross(normal, tangent).dot(bitangent) < 0.f ? -1.f : 1.f;
+          tangents[vertex] = vector4f{tangent[0], tangent[1], tangent[2], handedness};
+        }
+      }, threads);
+    }
+
+    inline void vertex_tangents(const std::vector<vector3f>& positions, const std::vector<vector2f>& uvs, const std::vector<vector3f>& normals,
+      const std::vector<mesh_index>& indices, std::vector<vector4f>& tangents, std::size_t threads = parallel::thread_count())
+    {
+      vertex_tangents(positions, uvs, normals, indices, build_vertex_adjacency(indices, positions.size()), tangents, threads);
+    }
+  }
+}
@@ -0,0 +1,210 @@
+//
+// Copyright © 2017 Constanze Pfennig. All rights reserved.
+//
+
+#pragma once
+
+#include "vector.h"
+#include "instrumentation.h"
+#include "kd_tree.h"
+#include "ndrange.h"
+#include "radix_sort.h"
+#include "../parallel/parallel_for.h"
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+
+
+namespace nuts
+{
+  namespace math
+  {
+    namespace detail
+    {
+      // Component-wise bounds of points, reduced over per-thread partial bounds.
+      inline std::pair<vector3f, vector3f> bounds(const std::vector<vector3f>& points, std::size_t threads)
+      {
+        const auto parts = std::max<std::size_t>(std::min(threads, points.size()), 1);
+        std::vector<std::pair<vector3f, vector3f>> partial(parts, {points.front(), points.front()});
+
+        parallel::parallel_for(0, parts, [&](std::size_t first, std::size_t last)
+        {
+          for(auto part = first; part < last; ++part)
+          {
+            const auto range = parallel::partition(0, points.size(), parts, part);
+
+            for(auto index = range.first; index < range.second; ++index)
+            {
+              for(std::size_t axis = 0; axis < 3; ++axis)
+              {
+                partial[part].first[axis] = std::min(partial[part].first[axis], points[index][axis]);
+                partial[part].second[axis] = std::max(partial[part].second[axis], points[index][axis]);
+              }
+            }
+          }
+        }, threads);
+
+        auto result = partial.front();
+
+        for(const auto& bound : partial)
+        {
+          for(std::size_t axis = 0; axis < 3; ++axis)
+          {
+            result.first[axis] = std::min(result.first[axis], bound.first[axis]);
+            result.second[axis] = std::max(result.second[axis], bound.second[axis]);
+          }
+        }
+
+        return result;
+      }
+    }
+
+
+    // Replaces the points in every occupied cube of edge voxel_size by their centroid. Cell coordinates
+    // are Morton encoded in parallel and sorted with a radix sort, so the points of one cell become a
+    // contiguous run (no hash map), and the centroids of the runs are averaged in parallel. The result
+    // is in Morton order of the cells. The cloud may span at most 2^21 cells per axis.
+    inline void voxel_downsample(const std::vector<vector3f>& points, float voxel_size, std::vector<vector3f>& result,
+      std::size_t threads = parallel::thread_count())
+    {
+      assert(voxel_size > 0.f);
+
+      NUTS_INSTRUMENT(voxel_downsample, points.size(), points.size() * sizeof(vector3f));
+
+      result.clear();
+
+      if(points.empty())
+        return;
+
+      const auto lower = detail::bounds(points, threads).first;
+      const auto scale = 1.f / voxel_size;
+
+      std::vector<std::uint64_t> keys(points.size());
+      std::vector<std::uint32_t> order(points.size());
+
+      parallel::parallel_for(0, points.size(), [&](std::size_t first, std::size_t last)
+      {
+        NUTS_UNCOUNTED_SCOPE();
+
+        for(auto index = first; index < last; ++index)
+        {
+          const auto cell = (points[index] - lower) * scale;
+          const vector3i coordinates{static_cast<int>(cell[0]), static_cast<int>(cell[1]), static_cast<int>(cell[2])};
+
+          assert(coordinates[0] < (1 << 21) && coordinates[1] < (1 << 21) && coordinates[2] < (1 << 21));
+
+          keys[index] = morton_encode(coordinates);
+          order[index] = static_cast<std::uint32_t>(index);
+        }
+      }, threads);
+
+      radix_sort(keys, order);
+
+      std::vector<std::size_t> runs;
+
+      for(std::size_t index = 0; index < keys.size(); ++index)
+      {
+        if(index == 0 || keys[index] != keys[index - 1])
+          runs.push_back(index);
+      }
+
+      runs.push_back(keys.size());
+      result.resize(runs.size() - 1);
+
+      parallel::parallel_for(0, result.size(), [&](std::size_t first, std::size_t last)
+      {
+        NUTS_UNCOUNTED_SCOPE();
+
+        for(auto cell = first; cell < last; ++cell)
+        {
+          vector3d sum{0.0, 0.0, 0.0};
+
+          for(auto index = runs[cell]; index < runs[cell + 1]; ++index)
+          {
+            sum += vector3d{points[order[index]]};
+          }
+
+          result[cell] = vector3f{sum * (1.0 / static_cast<double>(runs[cell + 1] - runs[cell]))};
+        }
+      }, threads);
+    }
+
+    // Statistical outlier removal: for every point the mean distance to its k nearest neighbours is
+    // computed with a k-d tree, in parallel over the points. Points whose mean distance exceeds the
+    // mean over the cloud by more than std_ratio standard deviations are dropped. The remaining points
+    // keep their order; inliers, if given, receives 1 for every kept and 0 for every dropped point.
+    inline void remove_statistical_outliers(const std::vector<vector3f>& points, std::size_t k, float std_ratio, std::vector<vector3f>& result,
+      std::vector<std::uint8_t>* inliers = nullptr, std::size_t threads = parallel::thread_count())
+    {
+      assert(k > 0);
+
+      NUTS_INSTRUMENT(remove_statistical_outliers, points.size(), points.size() * sizeof(vector3f));
+
+      result.clear();
+
+      if(points.size() < 2)
+      {
+        result = points;
+
+        if(inliers != nullptr)
+          inliers->assign(points.size(), 1);
+
+        return;
+      }
+
+      const kd_tree tree{points, threads};
+      std::vector<float> mean_distance(points.size());
+
+      parallel::parallel_for(0, points.size(), [&](std::size_t first, std::size_t last)
+      {
+        NUTS_UNCOUNTED_SCOPE();
+
+        // One more neighbour than asked for, since every point finds itself.
+        std::vector<kd_tree::index_type> neighbours(k + 1);
+        std::vector<float> distances2(k + 1);
+
+        for(auto index = first; index < last; ++index)
+        {
+          const auto count = tree.k_nearest(points[index], k + 1, neighbours.data(), distances2.data());
+          float sum = 0.f;
+
+          for(std::size_t neighbour = 1; neighbour < count; ++neighbour)
+          {
+            sum += std::sqrt(distances2[neighbour]);
+          }
+
+          mean_distance[index] = count > 1 ? sum / static_cast<float>(count - 1) : 0.f;
+        }
+      }, threads);
+
+      double sum = 0.0;
+      double sum2 = 0.0;
+
+      for(auto distance : mean_distance)
+      {
+        sum += distance;
+        sum2 += static_cast<double>(distance) * distance;
+      }
+
+      const auto count = static_cast<double>(points.size());
+      const auto mean = sum / count;
+      const auto deviation = std::sqrt(std::max(sum2 / count - mean * mean, 0.0));
+      const auto threshold = static_cast<float>(mean + std_ratio * deviation);
+
+      if(inliers != nullptr)
+        inliers->resize(points.size());
+
+      for(std::size_t index = 0; index < points.size(); ++index)
+      {
+        const auto keep = mean_distance[index] <= threshold;
+
+        if(keep)
+          result.push_back(points[index]);
+
+        if(inliers != nullptr)
+          (*inliers)[index] = keep ? 1 : 0;
+      }
+    }
+  }
+}
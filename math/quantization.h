@@ -0,0 +1,460 @@
+//
+// Copyright © 2017 Constanze Pfennig. All rights reserved.
+//
+
+#pragma once
+
+#include "vector.h"
+#include "simd.h"
+#include "instrumentation.h"
+#include "../parallel/parallel_for.h"
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+
+// Lossy packing of vector3f arrays into 32 or 48 bits per vector: positions on a grid with a bounded
+// absolute error per component, unit normals in octahedral encoding. Codes are stored little endian
+// in 4 or 6 bytes per vector.
+
+namespace nuts
+{
+  namespace math
+  {
+    enum class quantized_size
+    {
+      bits32 = 4,
+      bits48 = 6
+    };
+
+    // Grid of the quantized positions: component a of a position is origin[a] + q * step[a] for a q
+    // of bits[a] bits.
+    struct position_grid
+    {
+      vector3f origin;
+      vector3f step;
+      std::array<int, 3> bits;
+      quantized_size size;
+    };
+
+    namespace detail
+    {
+      constexpr std::size_t quantize_block = 4;
+
+      inline std::size_t code_bytes(quantized_size size) noexcept
+      {
+        return static_cast<std::size_t>(size);
+      }
+
+      inline void store_code(std::uint64_t code, std::size_t bytes, std::uint8_t* target) noexcept
+      {
+        for(std::size_t byte = 0; byte < bytes; ++byte)
+        {
+          target[byte] = static_cast<std::uint8_t>(code >> (8 * byte));
+        }
+      }
+
+      inline std::uint64_t load_code(const std::uint8_t* source, std::size_t bytes) noexcept
+      {
+        std::uint64_t code = 0;
+
+        for(std::size_t byte = 0; byte < bytes; ++byte)
+        {
+          code |= static_cast<std::uint64_t>(source[byte]) << (8 * byte);
+        }
+
+        return code;
+      }
+
+      inline float sign_not_zero(float value) noexcept
+      {
+        return value >= 0.f ? 1.f : -1.f;
+      }
+    }
+
+
+    // Smallest grid over the bounds of points whose rounding error stays within max_error in every
+    // component. Fails, returning false, when the bits needed exceed size or 24 bits on one axis, or
+    // when max_error is too close to the float resolution of the coordinates.
+    inline bool make_position_grid(const std::vector<vector3f>& points, float max_error, quantized_size size, position_grid& grid)
+    {
+      assert(max_error > 0.f);
+
+      vector3f lower = points.empty() ? vector3f{0.f, 0.f, 0.f} : points.front();
+      vector3f upper = lower;
+
+      for(const auto& point : points)
+      {
+        for(std::size_t axis = 0; axis < 3; ++axis)
+        {
+          lower[axis] = std::min(lower[axis], point[axis]);
+          upper[axis] = std::max(upper[axis], point[axis]);
+        }
+      }
+
+      grid.origin = lower;
+      grid.size = size;
+
+      int total = 0;
+
+      for(std::size_t axis = 0; axis < 3; ++axis)
+      {
+        // Rounding to the nearest step errs by half a step. Encoding and decoding in float add a few
+        // units in the last place of the largest magnitude involved, which are kept off the bound.
+        const auto magnitude = std::max({std::abs(lower[axis]), std::abs(upper[axis]), upper[axis] - lower[axis]});
+        const auto rounding = 4.f * magnitude * std::numeric_limits<float>::epsilon();
+
+        if(rounding >= 0.5f * max_error)
+          return false;
+
+        const auto step = 2.f * (max_error - rounding);
+        const auto levels = std::ceil(static_cast<double>(upper[axis] - lower[axis]) / step);
+
+        int bits = 0;
+
+        while(bits <= 24 && std::ldexp(1.0, bits) - 1.0 < levels)
+        {
+          ++bits;
+        }
+
+        grid.step[axis] = step;
+        grid.bits[axis] = bits;
+        total += bits;
+
+        if(bits > 24)
+          return false;
+      }
+
+      return total <= static_cast<int>(8 * detail::code_bytes(size));
+    }
+
+    // Packs every position into the code q[0] | q[1] << bits[0] | q[2] << (bits[0] + bits[1]);
+    // positions outside the grid are clamped to it.
+    inline void quantize_positions(const std::vector<vector3f>& points, const position_grid& grid, std::vector<std::uint8_t>& result,
+      std::size_t threads = parallel::thread_count())
+    {
+      const auto bytes = detail::code_bytes(grid.size);
+      result.resize(points.size() * bytes);
+
+      NUTS_INSTRUMENT(quantize_positions, points.size(), points.size() * sizeof(vector3f) + result.size());
+
+      std::array<float, 3> maximum;
+      std::array<float, 3> inverse_step;
+
+      for(std::size_t axis = 0; axis < 3; ++axis)
+      {
+        maximum[axis] = static_cast<float>((std::uint32_t{1} << grid.bits[axis]) - 1);
+        inverse_step[axis] = 1.f / grid.step[axis];
+      }
+
+      const auto pack = [&](std::size_t index, const std::array<std::int32_t, 3>& q)
+      {
+        const auto code = static_cast<std::uint64_t>(q[0]) | static_cast<std::uint64_t>(q[1]) << grid.bits[0]
+          | static_cast<std::uint64_t>(q[2]) << (grid.bits[0] + grid.bits[1]);
+        detail::store_code(code, bytes, result.data() + index * bytes);
+      };
+
+      parallel::parallel_for(0, points.size(), [&](std::size_t first, std::size_t last)
+      {
+        auto index = first;
+
+#if defined(NUTS_MATH_SSE2)
+        for(; index + detail::quantize_block <= last; index += detail::quantize_block)
+        {
+          alignas(16) std::array<std::array<std::int32_t, 4>, 3> q;
+
+          for(std::size_t axis = 0; axis < 3; ++axis)
+          {
+            const auto values = _mm_setr_ps(points[index][axis], points[index + 1][axis], points[index + 2][axis], points[index + 3][axis]);
+            const auto scaled = _mm_mul_ps(_mm_sub_ps(values, _mm_set1_ps(grid.origin[axis])), _mm_set1_ps(inverse_step[axis]));
+            const auto clamped = _mm_min_ps(_mm_max_ps(scaled, _mm_setzero_ps()), _mm_set1_ps(maximum[axis]));
+            _mm_store_si128(reinterpret_cast<__m128i*>(q[axis].data()), _mm_cvtps_epi32(clamped));
+          }
+
+          for(std::size_t lane = 0; lane < 4; ++lane)
+          {
+            pack(index + lane, {q[0][lane], q[1][lane], q[2][lane]});
+          }
+        }
+#endif
+
+        for(; index < last; ++index)
+        {
+          std::array<std::int32_t, 3> q;
+
+          for(std::size_t axis = 0; axis < 3; ++axis)
+          {
+            const auto scaled = (points[index][axis] - grid.origin[axis]) * inverse_step[axis];
+            q[axis] = static_cast<std::int32_t>(std::nearbyint(std::min(std::max(scaled, 0.f), maximum[axis])));
+          }
+
+          pack(index, q);
+        }
+      }, threads);
+    }
+
+    inline void dequantize_positions(const std::vector<std::uint8_t>& data, const position_grid& grid, std::vector<vector3f>& result,
+      std::size_t threads = parallel::thread_count())
+    {
+      const auto bytes = detail::code_bytes(grid.size);
+      assert(data.size() % bytes == 0);
+
+      result.resize(data.size() / bytes);
+
+      NUTS_INSTRUMENT(dequantize_positions, result.size(), data.size() + result.size() * sizeof(vector3f));
+
+      const auto unpack = [&](std::size_t index, std::size_t axis)
+      {
+        const auto code = detail::load_code(data.data() + index * bytes, bytes);
+        const auto shift = axis == 0 ? 0 : (axis == 1 ? grid.bits[0] : grid.bits[0] + grid.bits[1]);
+        return static_cast<std::int32_t>((code >> shift) & ((std::uint64_t{1} << grid.bits[axis]) - 1));
+      };
+
+      parallel::parallel_for(0, result.size(), [&](std::size_t first, std::size_t last)
+      {
+        auto index = first;
+
+#if defined(NUTS_MATH_SSE2)
+        for(; index + detail::quantize_block <= last; index += detail::quantize_block)
+        {
+          alignas(16) std::array<std::array<float, 4>, 3> out;
+
+          for(std::size_t axis = 0; axis < 3; ++axis)
+          {
+            const auto q = _mm_setr_epi32(unpack(index, axis), unpack(index + 1, axis), unpack(index + 2, axis), unpack(index + 3, axis));
+            const auto values = _mm_add_ps(_mm_set1_ps(grid.origin[axis]), _mm_mul_ps(_mm_cvtepi32_ps(q), _mm_set1_ps(grid.step[axis])));
+            _mm_store_ps(out[axis].data(), values);
+          }
+
+          for(std::size_t lane = 0; lane < 4; ++lane)
+          {
+            result[index + lane] = vector3f{out[0][lane], out[1][lane], out[2][lane]};
+          }
+        }
+#endif
+
+        for(; index < last; ++index)
+        {
+          for(std::size_t axis = 0; axis < 3; ++axis)
+          {
+            result[index][axis] = grid.origin[axis] + static_cast<float>(unpack(index, axis)) * grid.step[axis];
+          }
+        }
+      }, threads);
+    }
+
+
+    // Octahedral encoding (Meyer et al. 2010): the unit sphere is projected onto the octahedron
+    // |x| + |y| + |z| = 1, whose lower half is folded over the upper one, and the resulting square
+    // [-1, 1]^2 is quantized to bits per axis, at most 24. The code is u | v << bits. Decoded normals
+    // are normalized; their components err by less than 4 / 2^bits, but no less than about 1e-6 from
+    // float rounding.
+    inline std::uint64_t octahedral_encode(const vector3f& normal, int bits) noexcept
+    {
+      assert(bits > 0 && bits <= 24);
+
+      const auto scale = 1.f / (std::abs(normal[0]) + std::abs(normal[1]) + std::abs(normal[2]));
+      auto u = normal[0] * scale;
+      auto v = normal[1] * scale;
+
+      if(normal[2] < 0.f)
+      {
+        const auto folded_u = (1.f - std::abs(v)) * detail::sign_not_zero(u);
+        v = (1.f - std::abs(u)) * detail::sign_not_zero(v);
+        u = folded_u;
+      }
+
+      const auto maximum = static_cast<float>((std::uint32_t{1} << bits) - 1);
+      const auto qu = static_cast<std::uint64_t>(std::nearbyint(std::min(std::max(u * 0.5f + 0.5f, 0.f), 1.f) * maximum));
+      const auto qv = static_cast<std::uint64_t>(std::nearbyint(std::min(std::max(v * 0.5f + 0.5f, 0.f), 1.f) * maximum));
+      return qu | qv << bits;
+    }
+
+    inline vector3f octahedral_decode(std::uint64_t code, int bits) noexcept
+    {
+      assert(bits > 0 && bits <= 24);
+
+      const auto mask = (std::uint64_t{1} << bits) - 1;
+      const auto scale = 2.f / static_cast<float>(mask);
+      auto u = static_cast<float>(code & mask) * scale - 1.f;
+      auto v = static_cast<float>((code >> bits) & mask) * scale - 1.f;
+      const auto z = 1.f - std::abs(u) - std::abs(v);
+
+      if(z < 0.f)
+      {
+        const auto unfolded_u = (1.f - std::abs(v)) * detail::sign_not_zero(u);
+        v = (1.f - std::abs(u)) * detail::sign_not_zero(v);
+        u = unfolded_u;
+      }
+
+      const auto length = std::sqrt(u * u + v * v + z * z);
+      return vector3f{u / length, v / length, z / length};
+    }
+
+    namespace detail
+    {
+#if defined(NUTS_MATH_SSE2)
+      inline __m128 sign_not_zero(__m128 value) noexcept
+      {
+        const auto negative = _mm_cmplt_ps(value, _mm_setzero_ps());
+        return _mm_or_ps(_mm_and_ps(negative, _mm_set1_ps(-1.f)), _mm_andnot_ps(negative, _mm_set1_ps(1.f)));
+      }
+
+      inline __m128 abs(__m128 value) noexcept
+      {
+        return _mm_andnot_ps(_mm_set1_ps(-0.f), value);
+      }
+
+      inline __m128 select(__m128 mask, __m128 if_true, __m128 if_false) noexcept
+      {
+        return _mm_or_ps(_mm_and_ps(mask, if_true), _mm_andnot_ps(mask, if_false));
+      }
+
+      // Octahedral codes of four normals given per component.
+      inline void octahedral_encode(__m128 x, __m128 y, __m128 z, int bits, __m128i& qu, __m128i& qv) noexcept
+      {
+        const auto scale = _mm_div_ps(_mm_set1_ps(1.f), _mm_add_ps(_mm_add_ps(abs(x), abs(y)), abs(z)));
+        const auto u = _mm_mul_ps(x, scale);
+        const auto v = _mm_mul_ps(y, scale);
+        const auto lower = _mm_cmplt_ps(z, _mm_setzero_ps());
+        const auto one = _mm_set1_ps(1.f);
+        const auto half = _mm_set1_ps(0.5f);
+
+        const auto folded_u = select(lower, _mm_mul_ps(_mm_sub_ps(one, abs(v)), sign_not_zero(u)), u);
+        const auto folded_v = select(lower, _mm_mul_ps(_mm_sub_ps(one, abs(u)), sign_not_zero(v)), v);
+
+        const auto maximum = _mm_set1_ps(static_cast<float>((std::uint32_t{1} << bits) - 1));
+        const auto unit_u = _mm_min_ps(_mm_max_ps(_mm_add_ps(_mm_mul_ps(folded_u, half), half), _mm_setzero_ps()), one);
+        const auto unit_v = _mm_min_ps(_mm_max_ps(_mm_add_ps(_mm_mul_ps(folded_v, half), half), _mm_setzero_ps()), one);
+        qu = _mm_cvtps_epi32(_mm_mul_ps(unit_u, maximum));
+        qv = _mm_cvtps_epi32(_mm_mul_ps(unit_v, maximum));
+      }
+
+      inline void octahedral_decode(__m128i qu, __m128i qv, int bits, __m128& x, __m128& y, __m128& z) noexcept
+      {
+        const auto scale = _mm_set1_ps(2.f / static_cast<float>((std::uint32_t{1} << bits) - 1));
+        const auto one = _mm_set1_ps(1.f);
+        const auto u = _mm_sub_ps(_mm_mul_ps(_mm_cvtepi32_ps(qu), scale), one);
+        const auto v = _mm_sub_ps(_mm_mul_ps(_mm_cvtepi32_ps(qv), scale), one);
+        const auto w = _mm_sub_ps(_mm_sub_ps(one, abs(u)), abs(v));
+        const auto lower = _mm_cmplt_ps(w, _mm_setzero_ps());
+
+        const auto unfolded_u = select(lower, _mm_mul_ps(_mm_sub_ps(one, abs(v)), sign_not_zero(u)), u);
+        const auto unfolded_v = select(lower, _mm_mul_ps(_mm_sub_ps(one, abs(u)), sign_not_zero(v)), v);
+        const auto length = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(unfolded_u, unfolded_u), _mm_mul_ps(unfolded_v, unfolded_v)), _mm_mul_ps(w, w)));
+
+        x = _mm_div_ps(unfolded_u, length);
+        y = _mm_div_ps(unfolded_v, length);
+        z = _mm_div_ps(w, length);
+      }
+#endif
+    }
+
+    // Octahedral codes of unit normals with 16 bits per axis for bits32 and 24 bits for bits48.
+    inline void quantize_normals(const std::vector<vector3f>& normals, quantized_size size, std::vector<std::uint8_t>& result,
+      std::size_t threads = parallel::thread_count())
+    {
+      const auto bytes = detail::code_bytes(size);
+      const auto bits = static_cast<int>(4 * bytes);
+      result.resize(normals.size() * bytes);
+
+      NUTS_INSTRUMENT(quantize_normals, normals.size(), normals.size() * sizeof(vector3f) + result.size());
+
+      parallel::parallel_for(0, normals.size(), [&](std::size_t first, std::size_t last)
+      {
+        auto index = first;
+
+#if defined(NUTS_MATH_SSE2)
+        for(; index + detail::quantize_block <= last; index += detail::quantize_block)
+        {
+          const auto& n0 = normals[index];
+          const auto& n1 = normals[index + 1];
+          const auto& n2 = normals[index + 2];
+          const auto& n3 = normals[index + 3];
+
+          __m128i qu;
+          __m128i qv;
+          detail::octahedral_encode(_mm_setr_ps(n0[0], n1[0], n2[0], n3[0]), _mm_setr_ps(n0[1], n1[1], n2[1], n3[1]),
+            _mm_setr_ps(n0[2], n1[2], n2[2], n3[2]), bits, qu, qv);
+
+          alignas(16) std::array<std::int32_t, 4> u;
+          alignas(16) std::array<std::int32_t, 4> v;
+          _mm_store_si128(reinterpret_cast<__m128i*>(u.data()), qu);
+          _mm_store_si128(reinterpret_cast<__m128i*>(v.data()), qv);
+
+          for(std::size_t lane = 0; lane < 4; ++lane)
+          {
+            const auto code = static_cast<std::uint64_t>(u[lane]) | static_cast<std::uint64_t>(v[lane]) << bits;
+            detail::store_code(code, bytes, result.data() + (index + lane) * bytes);
+          }
+        }
+#endif
+
+        for(; index < last; ++index)
+        {
+          detail::store_code(octahedral_encode(normals[index], bits), bytes, result.data() + index * bytes);
+        }
+      }, threads);
+    }
+
+    inline void dequantize_normals(const std::vector<std::uint8_t>& data, quantized_size size, std::vector<vector3f>& result,
+      std::size_t threads = parallel::thread_count())
+    {
+      const auto bytes = detail::code_bytes(size);
+      const auto bits = static_cast<int>(4 * bytes);
+      assert(data.size() % bytes == 0);
+
+      result.resize(data.size() / bytes);
+
+      NUTS_INSTRUMENT(dequantize_normals, result.size(), data.size() + result.size() * sizeof(vector3f));
+
+      parallel::parallel_for(0, result.size(), [&](std::size_t first, std::size_t last)
+      {
+        auto index = first;
+
+#if defined(NUTS_MATH_SSE2)
+        for(; index + detail::quantize_block <= last; index += detail::quantize_block)
+        {
+          alignas(16) std::array<std::int32_t, 4> u;
+          alignas(16) std::array<std::int32_t, 4> v;
+          const auto mask = (std::uint64_t{1} << bits) - 1;
+
+          for(std::size_t lane = 0; lane < 4; ++lane)
+          {
+            const auto code = detail::load_code(data.data() + (index + lane) * bytes, bytes);
+            u[lane] = static_cast<std::int32_t>(code & mask);
+            v[lane] = static_cast<std::int32_t>((code >> bits) & mask);
+          }
+
+          __m128 x;
+          __m128 y;
+          __m128 z;
+          detail::octahedral_decode(_mm_load_si128(reinterpret_cast<const __m128i*>(u.data())), _mm_load_si128(reinterpret_cast<const __m128i*>(v.data())),
+            bits, x, y, z);
+
+          alignas(16) std::array<std::array<float, 4>, 3> out;
+          _mm_store_ps(out[0].data(), x);
+          _mm_store_ps(out[1].data(), y);
+          _mm_store_ps(out[2].data(), z);
+
+          for(std::size_t lane = 0; lane < 4; ++lane)
+          {
+            result[index + lane] = vector3f{out[0][lane], out[1][lane], out[2][lane]};
+          }
+        }
+#endif
+
+        for(; index < last; ++index)
+        {
+          result[index] = octahedral_decode(detail::load_code(data.data() + index * bytes, bytes), bits);
+        }
+      }, threads);
+    }
+  }
+}
@@ -0,0 +1,65 @@
+//
+// Copyright © 2017 Constanze Pfennig. All rights reserved.
+//
+
+#pragma once
+
+#include <array>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+
+namespace nuts
+{
+  namespace math
+  {
+    // Stable LSD radix sort of keys with values moved along, one byte per pass. Passes in which
+    // every key has the same byte are skipped, so small keys in a wide type only pay for their used bytes.
+    template<typename Key, typename Value>
+    void radix_sort(std::vector<Key>& keys, std::vector<Value>& values)
+    {
+      static_assert(std::is_unsigned<Key>::value, "radix_sort requires unsigned keys.");
+      assert(keys.size() == values.size());
+
+      const auto count = keys.size();
+      std::vector<Key> key_buffer(count);
+      std::vector<Value> value_buffer(count);
+
+      for(std::size_t shift = 0; shift < 8 * sizeof(Key); shift += 8)
+      {
+        std::array<std::size_t, 256> offsets{};
+
+        for(auto key : keys)
+        {
+          ++offsets[key >> shift & 0xff];
+        }
+
+        if(count == 0 || offsets[keys.front() >> shift & 0xff] == count)
+          continue;
+
+        std::size_t sum = 0;
+
+        for(auto& offset : offsets)
+        {
+          const auto bucket = offset;
+          offset = sum;
+          sum += bucket;
+        }
+
+        for(std::size_t index = 0; index < count; ++index)
+        {
+          const auto target = offsets[keys[index] >> shift & 0xff]++;
+          key_buffer[target] = keys[index];
+          value_buffer[target] = std::move(values[index]);
+        }
+
+        keys.swap(key_buffer);
+        values.swap(value_buffer);
+      }
+    }
+  }
+}
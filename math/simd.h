@@ -0,0 +1,20 @@
+//
+// Copyright © 2017 Constanze Pfennig. All rights reserved.
+//
+
+#pragma once
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define NUTS_MATH_SSE2 1
+#include <emmintrin.h>
+#endif
+
+#if defined(__SSSE3__)
+#define NUTS_MATH_SSSE3 1
+#include <tmmintrin.h>
+#endif
+
+#if defined(__SSE4_1__)
+#define NUTS_MATH_SSE41 1
+#include <smmintrin.h>
+#endif
@@ -0,0 +1,519 @@
+//
+// Copyright © 2017 Constanze Pfennig. All rights reserved.
+//
+
+#pragma once
+
+#include "vector.h"
+#include "mesh.h"
+#include "radix_sort.h"
+#include "../parallel/parallel_for.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+
+
+namespace nuts
+{
+  namespace math
+  {
+    // Symmetric 4x4 error quadric of Garland and Heckbert, stored as its upper triangle.
+    class quadric
+    {
+    public:
+      quadric() = default;
+
+      // Squared distance to the plane n.p + d = 0 (n normalized), times weight.
+      quadric(const vector3d& normal, double d, double weight)
+        : data_{
+            weight * normal[0] * normal[0], weight * normal[0] * normal[1], weight * normal[0] * normal[2], weight * normal[0] * d,
+            weight * normal[1] * normal[1], weight * normal[1] * normal[2], weight * normal[1] * d,
+            weight * normal[2] * normal[2], weight * normal[2] * d,
+            weight * d * d}
+      {
+      }
+
+      quadric& operator+=(const quadric& other)
+      {
+        for(std::size_t index = 0; index < data_.size(); ++index)
+        {
+          data_[index] += other.data_[index];
+        }
+
+        return *this;
+      }
+
+      quadric operator+(const quadric& other) const
+      {
+        auto result = *this;
+        return result += other;
+      }
+
+      double error(const vector3d& position) const
+      {
+        const auto x = position[0];
+        const auto y = position[1];
+        const auto z = position[2];
+
+        return data_[0] * x * x + 2 * data_[1] * x * y + 2 * data_[2] * x * z + 2 * data_[3] * x
+          + data_[4] * y * y + 2 * data_[5] * y * z + 2 * data_[6] * y
+          + data_[7] * z * z + 2 * data_[8] * z
+          + data_[9];
+      }
+
+      // Position of least error; false if the quadric is (nearly) singular.
+      bool minimum(vector3d& position) const
+      {
+        const auto a = data_[0], b = data_[1], c = data_[2];
+        const auto e = data_[4], f = data_[5], h = data_[7];
+
+        const auto cofactor0 = e * h - f * f;
+        const auto cofactor1 = c * f - b * h;
+        const auto cofactor2 = b * f - c * e;
+        const auto determinant = a * cofactor0 + b * cofactor1 + c * cofactor2;
+        const auto scale = std::abs(a) + std::abs(e) + std::abs(h);
+
+        if(std::abs(determinant) <= 1e-12 * scale * scale * scale)
+          return false;
+
+        const auto inverse = 1.0 / determinant;
+        const auto rhs0 = -data_[3], rhs1 = -data_[6], rhs2 = -data_[8];
+
+        position[0] = (cofactor0 * rhs0 + cofactor1 * rhs1 + cofactor2 * rhs2) * inverse;
+        position[1] = (cofactor1 * rhs0 + (a * h - c * c) * rhs1 + (b * c - a * f) * rhs2) * inverse;
+        position[2] = (cofactor2 * rhs0 + (b * c - a * f) * rhs1 + (a * e - b * b) * rhs2) * inverse;
+        return true;
+      }
+
+    private:
+      std::array<double, 10> data_{};
+    };
+
+
+    namespace detail
+    {
+      // Normal scaled by twice the triangle area.
+      inline vector3d triangle_normal(const vector3d& position0, const vector3d& position1, const vector3d& position2)
+      {
+        return cross(position1 - position0, position2 - position0);
+      }
+
+      // Bits of a non-negative float, which order like its value.
+      inline std::uint32_t order_preserving_bits(float val)
+      {
+        std::uint32_t bits;
+        std::memcpy(&bits, &val, sizeof(bits));
+        return bits;
+      }
+
+      struct no_attributes
+      {
+        void interpolate(mesh_index, mesh_index, double)
+        {
+        }
+
+        void compact(const std::vector<mesh_index>&, std::size_t)
+        {
+        }
+      };
+
+      template<typename Attribute>
+      struct vertex_attributes
+      {
+        std::vector<Attribute>& values;
+
+        void interpolate(mesh_index target, mesh_index source, double t)
+        {
+          values[target] = static_cast<Attribute>(values[target] * (1.0 - t) + values[source] * t);
+        }
+
+        void compact(const std::vector<mesh_index>& remap, std::size_t count)
+        {
+          std::vector<Attribute> result(count);
+
+          for(std::size_t index = 0; index < remap.size(); ++index)
+          {
+            if(remap[index] != invalid_mesh_index)
+              result[remap[index]] = values[index];
+          }
+
+          values.swap(result);
+        }
+      };
+
+      template<typename Attributes>
+      double simplify(std::vector<vector3d>& positions, std::vector<mesh_index>& indices, std::size_t target_triangle_count, double max_error,
+        Attributes attributes, std::size_t threads)
+      {
+        assert(indices.size() % 3 == 0);
+
+        const auto vertex_count = positions.size();
+        auto triangle_count = indices.size() / 3;
+
+        // Area weighted plane quadrics per triangle, gathered per vertex without write conflicts.
+        std::vector<quadric> quadrics(vertex_count);
+        {
+          std::vector<quadric> planes(triangle_count);
+
+          parallel::parallel_for(0, triangle_count, [&](std::size_t first, std::size_t last)
+          {
+            for(auto triangle = first; triangle < last; ++triangle)
+            {
+              const auto& position0 = positions[indices[3 * triangle]];
+              const auto normal = triangle_normal(position0, positions[indices[3 * triangle + 1]], positions[indices[3 * triangle + 2]]);
+              const auto length = normal.length();
+
+              if(length > 0)
+                planes[triangle] = quadric{normal * (1 / length), -normal.dot(position0) / length, 0.5 * length};
+            }
+          }, threads);
+
+          const auto adjacency = build_vertex_adjacency(indices, vertex_count);
+
+          parallel::parallel_for(0, vertex_count, [&](std::size_t first, std::size_t last)
+          {
+            for(auto vertex = first; vertex < last; ++vertex)
+            {
+              for(auto row = adjacency.first[vertex]; row < adjacency.first[vertex + 1]; ++row)
+              {
+                quadrics[vertex] += planes[adjacency.corners[row] / 3];
+              }
+            }
+          }, threads);
+        }
+
+        std::vector<mesh_index> remap(vertex_count);
+        std::vector<std::uint8_t> locked(vertex_count);
+        std::vector<std::uint8_t> removed(triangle_count);
+        vertex_adjacency adjacency;
+        std::vector<std::uint64_t> edge_keys;
+        std::vector<mesh_index> edge_ids;
+        std::vector<std::uint32_t> cost_keys;
+        std::vector<mesh_index> order;
+        std::vector<std::pair<double, vector3d>> collapse;
+        std::vector<mesh_index> ring;
+        std::vector<mesh_index> other_ring;
+        std::vector<std::uint8_t> border(vertex_count);
+        double result_error = 0;
+        bool borders_added = false;
+
+        while(triangle_count > target_triangle_count)
+        {
+          // Vertex to triangle adjacency of the current index buffer.
+          adjacency = build_vertex_adjacency(indices, vertex_count);
+
+          // Unique edges; an edge seen only once lies on the border.
+          edge_keys.resize(indices.size());
+          edge_ids.resize(indices.size());
+
+          for(std::size_t half_edge = 0; half_edge < indices.size(); ++half_edge)
+          {
+            const std::uint64_t from = indices[half_edge];
+            const std::uint64_t to = indices[triangle_mesh::next_half_edge(half_edge)];
+
+            edge_keys[half_edge] = std::min(from, to) << 32 | std::max(from, to);
+            edge_ids[half_edge] = static_cast<mesh_index>(half_edge);
+          }
+
+          radix_sort(edge_keys, edge_ids);
+
+          std::size_t edge_count = 0;
+          std::fill(border.begin(), border.end(), 0);
+
+          for(std::size_t index = 0; index < edge_keys.size();)
+          {
+            auto next = index + 1;
+
+            while(next < edge_keys.size() && edge_keys[next] == edge_keys[index])
+            {
+              ++next;
+            }
+
+            // Border edges keep their shape through a plane perpendicular to the adjacent triangle.
+            if(next - index == 1)
+            {
+              const auto half_edge = edge_ids[index];
+              const auto from = indices[half_edge];
+              const auto to = indices[triangle_mesh::next_half_edge(half_edge)];
+              const auto opposite = indices[triangle_mesh::next_half_edge(triangle_mesh::next_half_edge(half_edge))];
+
+              border[from] = 1;
+              border[to] = 1;
+
+              const auto direction = positions[to] - positions[from];
+              auto plane = cross(direction, triangle_normal(positions[from], positions[to], positions[opposite]));
+              const auto length = plane.length();
+
+              if(!borders_added && length > 0)
+              {
+                plane = plane * (1 / length);
+                const quadric constraint{plane, -plane.dot(positions[from]), 10 * direction.dot(direction)};
+                quadrics[from] += constraint;
+                quadrics[to] += constraint;
+              }
+            }
+
+            edge_keys[edge_count++] = edge_keys[index];
+            index = next;
+          }
+
+          borders_added = true;
+          edge_keys.resize(edge_count);
+
+          // Cost and target position of every edge collapse.
+          collapse.resize(edge_count);
+
+          parallel::parallel_for(0, edge_count, [&](std::size_t first, std::size_t last)
+          {
+            for(auto index = first; index < last; ++index)
+            {
+              const auto vertex1 = static_cast<mesh_index>(edge_keys[index] >> 32);
+              const auto vertex2 = static_cast<mesh_index>(edge_keys[index]);
+              const auto combined = quadrics[vertex1] + quadrics[vertex2];
+
+              vector3d best;
+
+              if(!combined.minimum(best))
+              {
+                best = positions[vertex1];
+
+                for(const auto& candidate : {positions[vertex2], vector3d{(positions[vertex1] + positions[vertex2]) * 0.5}})
+                {
+                  if(combined.error(candidate) < combined.error(best))
+                    best = candidate;
+                }
+              }
+
+              collapse[index] = {std::max(combined.error(best), 0.0), best};
+            }
+          }, threads);
+
+          // Bucket the edges by cost: the bits of a non-negative float sort like its value.
+          cost_keys.resize(edge_count);
+          order.resize(edge_count);
+
+          for(std::size_t index = 0; index < edge_count; ++index)
+          {
+            cost_keys[index] = order_preserving_bits(static_cast<float>(collapse[index].first));
+            order[index] = static_cast<mesh_index>(index);
+          }
+
+          radix_sort(cost_keys, order);
+
+          for(std::size_t vertex = 0; vertex < vertex_count; ++vertex)
+          {
+            remap[vertex] = static_cast<mesh_index>(vertex);
+          }
+
+          std::fill(locked.begin(), locked.end(), 0);
+
+          const auto triangle_count_before = triangle_count;
+
+          // Collapse the cheapest edges first. Collapsing locks the one-rings of both vertices, so the
+          // adjacency seen by every later collapse of this pass is still accurate.
+          for(auto edge : order)
+          {
+            if(triangle_count <= target_triangle_count || collapse[edge].first > max_error)
+              break;
+
+            const auto vertex1 = static_cast<mesh_index>(edge_keys[edge] >> 32);
+            const auto vertex2 = static_cast<mesh_index>(edge_keys[edge]);
+
+            if(locked[vertex1] || locked[vertex2])
+              continue;
+
+            const auto& position = collapse[edge].second;
+
+            // Distinct neighbours of a vertex and the number of triangles it shares with the other end of the edge.
+            const auto collect_ring = [&](mesh_index vertex, mesh_index other, std::vector<mesh_index>& neighbours)
+            {
+              std::size_t shared = 0;
+              neighbours.clear();
+
+              for(auto row = adjacency.first[vertex]; row < adjacency.first[vertex + 1]; ++row)
+              {
+                const auto triangle = adjacency.corners[row] / 3;
+
+                if(removed[triangle])
+                  continue;
+
+                bool on_edge = false;
+
+                for(std::size_t corner = 0; corner < 3; ++corner)
+                {
+                  const auto neighbour = indices[3 * triangle + corner];
+                  on_edge = on_edge || neighbour == other;
+
+                  if(neighbour != vertex && neighbour != other)
+                    neighbours.push_back(neighbour);
+                }
+
+                shared += on_edge;
+              }
+
+              std::sort(neighbours.begin(), neighbours.end());
+              neighbours.erase(std::unique(neighbours.begin(), neighbours.end()), neighbours.end());
+              return shared;
+            };
+
+            // Link condition: the vertices may only have the opposite corners of the triangles on the edge
+            // as common neighbours, otherwise the collapse pinches the surface.
+            const auto shared_triangles = collect_ring(vertex1, vertex2, ring);
+            collect_ring(vertex2, vertex1, other_ring);
+
+            std::size_t common = 0;
+
+            for(auto neighbour : other_ring)
+            {
+              common += std::binary_search(ring.begin(), ring.end(), neighbour);
+            }
+
+            // An inner edge between two border vertices would join the borders.
+            const auto valid = shared_triangles > 0 && common == shared_triangles
+              && !(border[vertex1] && border[vertex2] && shared_triangles > 1);
+
+            const auto keeps_orientation = [&](mesh_index moved)
+            {
+              for(auto row = adjacency.first[moved]; row < adjacency.first[moved + 1]; ++row)
+              {
+                const auto triangle = adjacency.corners[row] / 3;
+
+                if(removed[triangle])
+                  continue;
+
+                std::array<vector3d, 3> corners;
+                bool on_edge = false;
+
+                for(std::size_t corner = 0; corner < 3; ++corner)
+                {
+                  const auto vertex = indices[3 * triangle + corner];
+                  on_edge = on_edge || vertex == (moved == vertex1 ? vertex2 : vertex1);
+                  corners[corner] = vertex == moved ? position : positions[vertex];
+                }
+
+                if(on_edge)
+                  continue;
+
+                const auto before = triangle_normal(positions[indices[3 * triangle]], positions[indices[3 * triangle + 1]], positions[indices[3 * triangle + 2]]);
+                const auto after = triangle_normal(corners[0], corners[1], corners[2]);
+
+                if(before.dot(after) <= 0.25 * before.length() * after.length())
+                  return false;
+              }
+
+              return true;
+            };
+
+            if(!valid || !keeps_orientation(vertex1) || !keeps_orientation(vertex2))
+              continue;
+
+            // Keep vertex1 at the new position, parameterizing attributes along the edge.
+            const auto direction = positions[vertex2] - positions[vertex1];
+            const auto length_squared = direction.dot(direction);
+            const auto t = length_squared > 0 ? std::min(std::max((position - positions[vertex1]).dot(direction) / length_squared, 0.0), 1.0) : 0.0;
+
+            attributes.interpolate(vertex1, vertex2, t);
+            positions[vertex1] = position;
+            quadrics[vertex1] += quadrics[vertex2];
+            remap[vertex2] = vertex1;
+            result_error = std::max(result_error, collapse[edge].first);
+
+            for(auto vertex : {vertex1, vertex2})
+            {
+              for(auto row = adjacency.first[vertex]; row < adjacency.first[vertex + 1]; ++row)
+              {
+                const auto triangle = adjacency.corners[row] / 3;
+
+                if(removed[triangle])
+                  continue;
+
+                bool on_edge = false;
+
+                for(std::size_t corner = 0; corner < 3; ++corner)
+                {
+                  const auto other = indices[3 * triangle + corner];
+                  locked[other] = 1;
+                  on_edge = on_edge || other == (vertex == vertex1 ? vertex2 : vertex1);
+                }
+
+                if(on_edge)
+                {
+                  removed[triangle] = 1;
+                  --triangle_count;
+                }
+              }
+            }
+          }
+
+          if(triangle_count == triangle_count_before)
+            break;
+
+          // Apply the pass: redirect collapsed vertices and drop the triangles on collapsed edges.
+          std::size_t kept = 0;
+
+          for(std::size_t triangle = 0; triangle < removed.size(); ++triangle)
+          {
+            if(removed[triangle])
+              continue;
+
+            for(std::size_t corner = 0; corner < 3; ++corner)
+            {
+              indices[3 * kept + corner] = remap[indices[3 * triangle + corner]];
+            }
+
+            ++kept;
+          }
+
+          indices.resize(3 * kept);
+          removed.assign(kept, 0);
+        }
+
+        // Drop the vertices that are no longer referenced.
+        std::size_t new_count = 0;
+        const auto fetch_remap = vertex_fetch_remap(indices, vertex_count, new_count);
+        std::vector<vector3d> compacted(new_count);
+
+        for(std::size_t vertex = 0; vertex < vertex_count; ++vertex)
+        {
+          if(fetch_remap[vertex] != invalid_mesh_index)
+            compacted[fetch_remap[vertex]] = positions[vertex];
+        }
+
+        for(auto& index : indices)
+        {
+          index = fetch_remap[index];
+        }
+
+        positions.swap(compacted);
+        attributes.compact(fetch_remap, new_count);
+
+        return result_error;
+      }
+    }
+
+
+    // Simplifies the mesh by quadric error edge collapses until at most target_triangle_count triangles
+    // remain or the next collapse would exceed max_error. Collapses run in passes: edge costs are
+    // computed in parallel, bucketed with a radix sort on their float bits instead of kept in a heap,
+    // and the cheapest independent edges are collapsed. Border edges are held in place by additional
+    // perpendicular planes, and collapses that would fold a triangle over or break manifoldness are
+    // skipped. Unreferenced vertices are removed. Returns the largest error of an applied collapse.
+    inline double simplify(std::vector<vector3d>& positions, std::vector<mesh_index>& indices, std::size_t target_triangle_count,
+      double max_error = std::numeric_limits<double>::max(), std::size_t threads = parallel::thread_count())
+    {
+      return detail::simplify(positions, indices, target_triangle_count, max_error, detail::no_attributes{}, threads);
+    }
+
+    // Like simplify above; attributes (one per vertex, e.g. texture coordinates or colors) of a collapsed
+    // edge are interpolated at the projection of the new position onto the edge.
+    template<typename Attribute>
+    double simplify(std::vector<vector3d>& positions, std::vector<mesh_index>& indices, std::vector<Attribute>& attributes, std::size_t target_triangle_count,
+      double max_error = std::numeric_limits<double>::max(), std::size_t threads = parallel::thread_count())
+    {
+      assert(attributes.size() == positions.size());
+      return detail::simplify(positions, indices, target_triangle_count, max_error, detail::vertex_attributes<Attribute>{attributes}, threads);
+    }
+  }
+}
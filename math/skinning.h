@@ -0,0 +1,442 @@
+//
+// Copyright © 2017 Constanze Pfennig. All rights reserved.
+//
+
+#pragma once
+
+#include "vector.h"
+#include "simd.h"
+#include "instrumentation.h"
+#include "../parallel/parallel_for.h"
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+
+
+namespace nuts
+{
+  namespace math
+  {
+    // Affine bone transform as the upper three rows of a 4x4 matrix; a point p maps to
+    // (rows[0].(p, 1), rows[1].(p, 1), rows[2].(p, 1)).
+    using bone_matrix = std::array<vector4f, 3>;
+
+    // Rigid transform as a unit dual quaternion. Quaternions store (x, y, z, w) with w the scalar part.
+    struct dual_quaternion
+    {
+      vector4f real;
+      vector4f dual;
+    };
+
+
+    inline vector3f transform_point(const bone_matrix& matrix, const vector3f& point)
+    {
+      const vector4f homogeneous{point[0], point[1], point[2], 1.f};
+      return vector3f{matrix[0].dot(homogeneous), matrix[1].dot(homogeneous), matrix[2].dot(homogeneous)};
+    }
+
+    inline vector3f transform_vector(const bone_matrix& matrix, const vector3f& vec)
+    {
+      const vector4f homogeneous{vec[0], vec[1], vec[2], 0.f};
+      return vector3f{matrix[0].dot(homogeneous), matrix[1].dot(homogeneous), matrix[2].dot(homogeneous)};
+    }
+
+    // Dual quaternion of the rotation and translation of matrix, which must not scale or shear.
+    inline dual_quaternion to_dual_quaternion(const bone_matrix& matrix)
+    {
+      const auto m00 = matrix[0][0], m11 = matrix[1][1], m22 = matrix[2][2];
+      const auto trace = m00 + m11 + m22;
+      vector4f real;
+
+      // Shepperd's method: start from the largest of w, x, y and z to avoid cancellation.
+      if(trace > 0.f)
+      {
+        const auto s = 2.f * std::sqrt(trace + 1.f);
+        real = vector4f{(matrix[2][1] - matrix[1][2]) / s, (matrix[0][2] - matrix[2][0]) / s, (matrix[1][0] - matrix[0][1]) / s, 0.25f * s};
+      }
+      else if(m00 > m11 && m00 > m22)
+      {
+        const auto s = 2.f * std::sqrt(1.f + m00 - m11 - m22);
+        real = vector4f{0.25f * s, (matrix[0][1] + matrix[1][0]) / s, (matrix[0][2] + matrix[2][0]) / s, (matrix[2][1] - matrix[1][2]) / s};
+      }
+      else if(m11 > m22)
+      {
+        const auto s = 2.f * std::sqrt(1.f + m11 - m00 - m22);
+        real = vector4f{(matrix[0][1] + matrix[1][0]) / s, 0.25f * s, (matrix[1][2] + matrix[2][1]) / s, (matrix[0][2] - matrix[2][0]) / s};
+      }
+      else
+      {
+        const auto s = 2.f * std::sqrt(1.f + m22 - m00 - m11);
+        real = vector4f{(matrix[0][2] + matrix[2][0]) / s, (matrix[1][2] + matrix[2][1]) / s, 0.25f * s, (matrix[1][0] - matrix[0][1]) / s};
+      }
+
+      // dual = 0.5 * (translation, 0) * real
+      const vector3f translation{matrix[0][3], matrix[1][3], matrix[2][3]};
+      const vector3f axis{real[0], real[1], real[2]};
+      const auto dual = translation * (0.5f * real[3]) + cross(translation, axis) * 0.5f;
+
+      return dual_quaternion{real, vector4f{dual[0], dual[1], dual[2], -0.5f * translation.dot(axis)}};
+    }
+
+    // Applies a unit dual quaternion to a point.
+    inline vector3f transform_point(const dual_quaternion& transform, const vector3f& point)
+    {
+      const vector3f axis{transform.real[0], transform.real[1], transform.real[2]};
+      const vector3f dual{transform.dual[0], transform.dual[1], transform.dual[2]};
+      const auto w = transform.real[3];
+
+      const auto rotated = point + cross(axis, cross(axis, point) + point * w) * 2.f;
+      return rotated + (dual * w - axis * transform.dual[3] + cross(axis, dual)) * 2.f;
+    }
+
+    inline vector3f transform_vector(const dual_quaternion& transform, const vector3f& vec)
+    {
+      const vector3f axis{transform.real[0], transform.real[1], transform.real[2]};
+      return vec + cross(axis, cross(axis, vec) + vec * transform.real[3]) * 2.f;
+    }
+
+
+    // Bone influences per vertex, stored per influence slot (structure of arrays), so the kernels read
+    // each slot as a contiguous stream. Unused slots keep weight 0.
+    template<std::size_t Influences>
+    class skin_weights
+    {
+      static_assert(Influences >= 1 && Influences <= 8, "skin_weights supports 1 to 8 influences per vertex.");
+
+    public:
+      using size_type = std::size_t;
+      using bone_index = std::uint16_t;
+
+      static constexpr size_type influences = Influences;
+
+      skin_weights() = default;
+
+      explicit skin_weights(size_type vertex_count)
+      {
+        resize(vertex_count);
+      }
+
+      size_type vertex_count() const noexcept
+      {
+        return weights_[0].size();
+      }
+
+      void resize(size_type count)
+      {
+        for(size_type slot = 0; slot < Influences; ++slot)
+        {
+          bones_[slot].resize(count, 0);
+          weights_[slot].resize(count, 0.f);
+        }
+      }
+
+      void set(size_type vertex, size_type slot, bone_index bone, float weight)
+      {
+        assert(slot < Influences);
+
+        bones_[slot][vertex] = bone;
+        weights_[slot][vertex] = weight;
+      }
+
+      bone_index bone(size_type vertex, size_type slot) const
+      {
+        return bones_[slot][vertex];
+      }
+
+      float weight(size_type vertex, size_type slot) const
+      {
+        return weights_[slot][vertex];
+      }
+
+      const bone_index* bones(size_type slot) const noexcept
+      {
+        return bones_[slot].data();
+      }
+
+      const float* weights(size_type slot) const noexcept
+      {
+        return weights_[slot].data();
+      }
+
+      // Scales the weights of every vertex to sum up to 1; vertices without weight are left alone.
+      void normalize()
+      {
+        for(size_type vertex = 0; vertex < vertex_count(); ++vertex)
+        {
+          float sum = 0.f;
+
+          for(size_type slot = 0; slot < Influences; ++slot)
+          {
+            sum += weights_[slot][vertex];
+          }
+
+          if(sum <= 0.f)
+            continue;
+
+          for(size_type slot = 0; slot < Influences; ++slot)
+          {
+            weights_[slot][vertex] /= sum;
+          }
+        }
+      }
+
+    private:
+      std::array<std::vector<bone_index>, Influences> bones_;
+      std::array<std::vector<float>, Influences> weights_;
+    };
+
+    using skin_weights4 = skin_weights<4>;
+    using skin_weights8 = skin_weights<8>;
+
+
+    namespace detail
+    {
+      // Bytes read and written per vertex: its bone indices and weights and the given number of vectors.
+      template<std::size_t Influences>
+      constexpr std::size_t skinned_vertex_bytes(std::size_t vectors)
+      {
+        return Influences * (sizeof(typename skin_weights<Influences>::bone_index) + sizeof(float)) + vectors * sizeof(vector3f);
+      }
+
+      // Palette with every matrix stored by columns, so that blending is one multiply-add per column
+      // and influence, and transforming a point is a sum of scaled columns.
+      inline std::vector<vector4f> transpose_palette(const std::vector<bone_matrix>& palette)
+      {
+        std::vector<vector4f> columns(4 * palette.size());
+
+        for(std::size_t bone = 0; bone < palette.size(); ++bone)
+        {
+          for(std::size_t column = 0; column < 4; ++column)
+          {
+            columns[4 * bone + column] = vector4f{palette[bone][0][column], palette[bone][1][column], palette[bone][2][column], 0.f};
+          }
+        }
+
+        return columns;
+      }
+
+      inline vector3f normalize_or_keep(const vector3f& vec)
+      {
+        const auto length = vec.length();
+        return length > 0.f ? vec * (1.f / length) : vec;
+      }
+
+      template<std::size_t Influences>
+      void skin_linear(const skin_weights<Influences>& weights, const std::vector<vector4f>& columns, const vector3f* positions, const vector3f* normals,
+        vector3f* result_positions, vector3f* result_normals, std::size_t first, std::size_t last)
+      {
+#if defined(NUTS_MATH_SSE2)
+        const auto palette = reinterpret_cast<const float*>(columns.data());
+        alignas(16) std::array<float, 4> out;
+
+        for(auto vertex = first; vertex < last; ++vertex)
+        {
+          auto column0 = _mm_setzero_ps();
+          auto column1 = _mm_setzero_ps();
+          auto column2 = _mm_setzero_ps();
+          auto column3 = _mm_setzero_ps();
+
+          for(std::size_t slot = 0; slot < Influences; ++slot)
+          {
+            const auto weight = _mm_set1_ps(weights.weights(slot)[vertex]);
+            const auto matrix = palette + 16 * std::size_t{weights.bones(slot)[vertex]};
+
+            column0 = _mm_add_ps(column0, _mm_mul_ps(weight, _mm_loadu_ps(matrix)));
+            column1 = _mm_add_ps(column1, _mm_mul_ps(weight, _mm_loadu_ps(matrix + 4)));
+            column2 = _mm_add_ps(column2, _mm_mul_ps(weight, _mm_loadu_ps(matrix + 8)));
+            column3 = _mm_add_ps(column3, _mm_mul_ps(weight, _mm_loadu_ps(matrix + 12)));
+          }
+
+          const auto& position = positions[vertex];
+          auto point = _mm_add_ps(_mm_mul_ps(column0, _mm_set1_ps(position[0])), _mm_mul_ps(column1, _mm_set1_ps(position[1])));
+          point = _mm_add_ps(point, _mm_add_ps(_mm_mul_ps(column2, _mm_set1_ps(position[2])), column3));
+
+          _mm_store_ps(out.data(), point);
+          result_positions[vertex] = vector3f{out[0], out[1], out[2]};
+
+          if(normals != nullptr)
+          {
+            const auto& normal = normals[vertex];
+            auto direction = _mm_add_ps(_mm_mul_ps(column0, _mm_set1_ps(normal[0])), _mm_mul_ps(column1, _mm_set1_ps(normal[1])));
+            direction = _mm_add_ps(direction, _mm_mul_ps(column2, _mm_set1_ps(normal[2])));
+
+            _mm_store_ps(out.data(), direction);
+            result_normals[vertex] = normalize_or_keep(vector3f{out[0], out[1], out[2]});
+          }
+        }
+#else
+        for(auto vertex = first; vertex < last; ++vertex)
+        {
+          std::array<vector4f, 4> blended{};
+
+          for(std::size_t slot = 0; slot < Influences; ++slot)
+          {
+            const auto weight = weights.weights(slot)[vertex];
+            const auto matrix = &columns[4 * std::size_t{weights.bones(slot)[vertex]}];
+
+            for(std::size_t column = 0; column < 4; ++column)
+            {
+              blended[column] += matrix[column] * weight;
+            }
+          }
+
+          const auto& position = positions[vertex];
+          const auto point = blended[0] * position[0] + blended[1] * position[1] + blended[2] * position[2] + blended[3];
+          result_positions[vertex] = vector3f{point[0], point[1], point[2]};
+
+          if(normals != nullptr)
+          {
+            const auto& normal = normals[vertex];
+            const auto direction = blended[0] * normal[0] + blended[1] * normal[1] + blended[2] * normal[2];
+            result_normals[vertex] = normalize_or_keep(vector3f{direction[0], direction[1], direction[2]});
+          }
+        }
+#endif
+      }
+
+      template<std::size_t Influences>
+      void skin_dual_quaternion(const skin_weights<Influences>& weights, const std::vector<dual_quaternion>& palette, const vector3f* positions,
+        const vector3f* normals, vector3f* result_positions, vector3f* result_normals, std::size_t first, std::size_t last)
+      {
+        for(auto vertex = first; vertex < last; ++vertex)
+        {
+          dual_quaternion blended;
+
+#if defined(NUTS_MATH_SSE2)
+          // q and -q are the same rotation; flip each influence into the hemisphere of the first one.
+          const auto& pivot = palette[weights.bones(0)[vertex]].real;
+          auto real = _mm_setzero_ps();
+          auto dual = _mm_setzero_ps();
+
+          for(std::size_t slot = 0; slot < Influences; ++slot)
+          {
+            const auto& transform = palette[weights.bones(slot)[vertex]];
+            const auto weight = weights.weights(slot)[vertex];
+            const auto signed_weight = _mm_set1_ps(pivot.dot(transform.real) < 0.f ? -weight : weight);
+
+            real = _mm_add_ps(real, _mm_mul_ps(signed_weight, _mm_loadu_ps(&transform.real[0])));
+            dual = _mm_add_ps(dual, _mm_mul_ps(signed_weight, _mm_loadu_ps(&transform.dual[0])));
+          }
+
+          _mm_storeu_ps(&blended.real[0], real);
+          _mm_storeu_ps(&blended.dual[0], dual);
+#else
+          const auto& pivot = palette[weights.bones(0)[vertex]].real;
+          blended = dual_quaternion{vector4f{0.f, 0.f, 0.f, 0.f}, vector4f{0.f, 0.f, 0.f, 0.f}};
+
+          for(std::size_t slot = 0; slot < Influences; ++slot)
+          {
+            const auto& transform = palette[weights.bones(slot)[vertex]];
+            const auto weight = weights.weights(slot)[vertex];
+            const auto signed_weight = pivot.dot(transform.real) < 0.f ? -weight : weight;
+
+            blended.real += transform.real * signed_weight;
+            blended.dual += transform.dual * signed_weight;
+          }
+#endif
+
+          const auto length = blended.real.length();
+
+          if(length > 0.f)
+          {
+            blended.real = blended.real * (1.f / length);
+            blended.dual = blended.dual * (1.f / length);
+          }
+
+          result_positions[vertex] = transform_point(blended, positions[vertex]);
+
+          if(normals != nullptr)
+            result_normals[vertex] = transform_vector(blended, normals[vertex]);
+        }
+      }
+    }
+
+
+    // Linear blend skinning: every vertex is transformed by the weighted sum of its bone matrices.
+    // The palette is transposed once per call; each vertex then blends the columns of its influences
+    // in SSE registers and applies the blended matrix. Vertices are processed in chunks across threads.
+    // Weights are expected to sum up to 1. Normals are transformed by the blended matrix without
+    // inverse transpose, which is exact for rotations and uniform scale, and renormalized.
+    template<std::size_t Influences>
+    void skin_linear(const skin_weights<Influences>& weights, const std::vector<bone_matrix>& palette, const std::vector<vector3f>& positions,
+      std::vector<vector3f>& result, std::size_t threads = parallel::thread_count())
+    {
+      assert(weights.vertex_count() == positions.size());
+
+      const auto columns = detail::transpose_palette(palette);
+      result.resize(positions.size());
+
+      NUTS_INSTRUMENT(skin_linear, positions.size(), positions.size() * detail::skinned_vertex_bytes<Influences>(2));
+
+      parallel::parallel_for(0, positions.size(), [&](std::size_t first, std::size_t last)
+      {
+        NUTS_UNCOUNTED_SCOPE();
+
+        detail::skin_linear(weights, columns, positions.data(), nullptr, result.data(), nullptr, first, last);
+      }, threads);
+    }
+
+    template<std::size_t Influences>
+    void skin_linear(const skin_weights<Influences>& weights, const std::vector<bone_matrix>& palette, const std::vector<vector3f>& positions,
+      const std::vector<vector3f>& normals, std::vector<vector3f>& result_positions, std::vector<vector3f>& result_normals,
+      std::size_t threads = parallel::thread_count())
+    {
+      assert(weights.vertex_count() == positions.size() && normals.size() == positions.size());
+
+      const auto columns = detail::transpose_palette(palette);
+      result_positions.resize(positions.size());
+      result_normals.resize(positions.size());
+
+      NUTS_INSTRUMENT(skin_linear, positions.size(), positions.size() * detail::skinned_vertex_bytes<Influences>(4));
+
+      parallel::parallel_for(0, positions.size(), [&](std::size_t first, std::size_t last)
+      {
+        NUTS_UNCOUNTED_SCOPE();
+
+        detail::skin_linear(weights, columns, positions.data(), normals.data(), result_positions.data(), result_normals.data(), first, last);
+      }, threads);
+    }
+
+    // Dual quaternion skinning (Kavan et al.): the influences are blended as dual quaternions and
+    // renormalized, which keeps volume at twisting joints where linear blending collapses. The palette
+    // must be rigid; use to_dual_quaternion to convert bone matrices.
+    template<std::size_t Influences>
+    void skin_dual_quaternion(const skin_weights<Influences>& weights, const std::vector<dual_quaternion>& palette, const std::vector<vector3f>& positions,
+      std::vector<vector3f>& result, std::size_t threads = parallel::thread_count())
+    {
+      assert(weights.vertex_count() == positions.size());
+
+      result.resize(positions.size());
+
+      NUTS_INSTRUMENT(skin_dual_quaternion, positions.size(), positions.size() * detail::skinned_vertex_bytes<Influences>(2));
+
+      parallel::parallel_for(0, positions.size(), [&](std::size_t first, std::size_t last)
+      {
+        NUTS_UNCOUNTED_SCOPE();
+
+        detail::skin_dual_quaternion(weights, palette, positions.data(), nullptr, result.data(), nullptr, first, last);
+      }, threads);
+    }
+
+    template<std::size_t Influences>
+    void skin_dual_quaternion(const skin_weights<Influences>& weights, const std::vector<dual_quaternion>& palette, const std::vector<vector3f>& positions,
+      const std::vector<vector3f>& normals, std::vector<vector3f>& result_positions, std::vector<vector3f>& result_normals,
+      std::size_t threads = parallel::thread_count())
+    {
+      assert(weights.vertex_count() == positions.size() && normals.size() == positions.size());
+
+      result_positions.resize(positions.size());
+      result_normals.resize(positions.size());
+
+      NUTS_INSTRUMENT(skin_dual_quaternion, positions.size(), positions.size() * detail::skinned_vertex_bytes<Influences>(4));
+
+      parallel::parallel_for(0, positions.size(), [&](std::size_t first, std::size_t last)
+      {
+        NUTS_UNCOUNTED_SCOPE();
+
+        detail::skin_dual_quaternion(weights, palette, positions.data(), normals.data(), result_positions.data(), result_normals.data(), first, last);
+      }, threads);
+    }
+  }
+}
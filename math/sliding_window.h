@@ -0,0 +1,263 @@
+//
+// Copyright © 2017 Constanze Pfennig. All rights reserved.
+//
+
+#pragma once
+
+#include "vector.h"
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+#include <vector>
+
+
+namespace nuts
+{
+  namespace math
+  {
+    // The last capacity samples of a vector stream, stored per component, with aggregates over them
+    // that are updated in amortized constant time per sample instead of being recomputed:
+    // - mean and population variance with the sliding form of Welford's update in double precision,
+    // - minimum and maximum through one monotonic deque per component and direction (Lemire), whose
+    //   front is the extreme of the window,
+    // - an exponential moving average over all samples ever pushed, independent of the window.
+    template<typename T, std::size_t Dimension>
+    class sliding_window
+    {
+    public:
+      using size_type = std::size_t;
+      using value_type = T;
+      using vector_type = vector<T, Dimension>;
+      using real_type = std::conditional_t<std::is_floating_point<T>::value, T, double>;
+      using real_vector_type = vector<real_type, Dimension>;
+
+      // smoothing is the weight of a new sample in the moving average.
+      explicit sliding_window(size_type capacity, double smoothing = 0.1)
+        : capacity_(capacity),
+          smoothing_(smoothing)
+      {
+        assert(capacity > 0 && smoothing > 0.0 && smoothing <= 1.0);
+
+        for(size_type axis = 0; axis < Dimension; ++axis)
+        {
+          samples_[axis].resize(capacity);
+          minimum_[axis].indices.resize(capacity);
+          maximum_[axis].indices.resize(capacity);
+        }
+      }
+
+      size_type capacity() const noexcept
+      {
+        return capacity_;
+      }
+
+      size_type size() const noexcept
+      {
+        return static_cast<size_type>(std::min<std::uint64_t>(pushed_, capacity_));
+      }
+
+      bool empty() const noexcept
+      {
+        return pushed_ == 0;
+      }
+
+      bool full() const noexcept
+      {
+        return pushed_ >= capacity_;
+      }
+
+      // Number of samples pushed since construction or clear.
+      std::uint64_t count() const noexcept
+      {
+        return pushed_;
+      }
+
+      void clear() noexcept
+      {
+        pushed_ = 0;
+
+        for(size_type axis = 0; axis < Dimension; ++axis)
+        {
+          mean_[axis] = 0.0;
+          deviation2_[axis] = 0.0;
+          minimum_[axis].first = minimum_[axis].last = 0;
+          maximum_[axis].first = maximum_[axis].last = 0;
+        }
+      }
+
+      void push(const vector_type& sample)
+      {
+        const auto slot = static_cast<size_type>(pushed_ % capacity_);
+        const auto replace = full();
+        const auto window = static_cast<double>(replace ? capacity_ : pushed_ + 1);
+
+        for(size_type axis = 0; axis < Dimension; ++axis)
+        {
+          const auto value = static_cast<double>(sample[axis]);
+          auto& mean = mean_[axis];
+
+          if(replace)
+          {
+            // The oldest sample leaves as the new one enters.
+            const auto old = static_cast<double>(samples_[axis][slot]);
+            const auto old_mean = mean;
+            mean += (value - old) / window;
+            deviation2_[axis] = std::max(deviation2_[axis] + (value - old) * (value - mean + old - old_mean), 0.0);
+          }
+          else
+          {
+            const auto difference = value - mean;
+            mean += difference / window;
+            deviation2_[axis] += difference * (value - mean);
+          }
+
+          ema_[axis] = pushed_ == 0 ? value : ema_[axis] + smoothing_ * (value - ema_[axis]);
+          samples_[axis][slot] = sample[axis];
+
+          push_extreme(minimum_[axis], axis, sample[axis], [](T kept, T incoming) { return kept < incoming; });
+          push_extreme(maximum_[axis], axis, sample[axis], [](T kept, T incoming) { return kept > incoming; });
+        }
+
+        ++pushed_;
+      }
+
+      // Sample of the given age, 0 being the latest.
+      vector_type sample(size_type age) const
+      {
+        assert(age < size());
+
+        const auto slot = static_cast<size_type>((pushed_ - 1 - age) % capacity_);
+        vector_type result;
+
+        for(size_type axis = 0; axis < Dimension; ++axis)
+        {
+          result[axis] = samples_[axis][slot];
+        }
+
+        return result;
+      }
+
+      vector_type latest() const
+      {
+        return sample(0);
+      }
+
+      // The samples of one component in storage order; slot (count() - 1) % capacity() is the latest.
+      const std::vector<T>& component(size_type axis) const noexcept
+      {
+        return samples_[axis];
+      }
+
+      real_vector_type mean() const
+      {
+        assert(!empty());
+        return convert(mean_);
+      }
+
+      // Population variance of the window.
+      real_vector_type variance() const
+      {
+        assert(!empty());
+
+        std::array<double, Dimension> result;
+
+        for(size_type axis = 0; axis < Dimension; ++axis)
+        {
+          result[axis] = deviation2_[axis] / static_cast<double>(size());
+        }
+
+        return convert(result);
+      }
+
+      vector_type min() const
+      {
+        return extreme(minimum_);
+      }
+
+      vector_type max() const
+      {
+        return extreme(maximum_);
+      }
+
+      real_vector_type ema() const
+      {
+        assert(!empty());
+        return convert(ema_);
+      }
+
+    private:
+      // Ring of sample numbers whose values are monotonic from front to back; first and last count
+      // pushes and pops, so last - first is the length.
+      struct monotonic_deque
+      {
+        std::vector<std::uint64_t> indices;
+        std::uint64_t first = 0;
+        std::uint64_t last = 0;
+      };
+
+      T value_of(size_type axis, std::uint64_t index) const noexcept
+      {
+        return samples_[axis][static_cast<size_type>(index % capacity_)];
+      }
+
+      // Drops samples that left the window from the front and samples that can no longer be the extreme
+      // from the back, then appends the new sample. Called before pushed_ is incremented.
+      template<typename Keep>
+      void push_extreme(monotonic_deque& deque, size_type axis, T value, Keep keep)
+      {
+        if(deque.first != deque.last && deque.indices[static_cast<size_type>(deque.first % capacity_)] + capacity_ <= pushed_)
+          ++deque.first;
+
+        // The new sample already overwrote its slot, but no kept index shares it: without the expired
+        // front every kept sample is at most capacity - 1 pushes old.
+        while(deque.first != deque.last && !keep(value_of(axis, deque.indices[static_cast<size_type>((deque.last - 1) % capacity_)]), value))
+        {
+          --deque.last;
+        }
+
+        deque.indices[static_cast<size_type>(deque.last % capacity_)] = pushed_;
+        ++deque.last;
+      }
+
+      vector_type extreme(const std::array<monotonic_deque, Dimension>& deques) const
+      {
+        assert(!empty());
+
+        vector_type result;
+
+        for(size_type axis = 0; axis < Dimension; ++axis)
+        {
+          result[axis] = value_of(axis, deques[axis].indices[static_cast<size_type>(deques[axis].first % capacity_)]);
+        }
+
+        return result;
+      }
+
+      static real_vector_type convert(const std::array<double, Dimension>& values)
+      {
+        real_vector_type result;
+
+        for(size_type axis = 0; axis < Dimension; ++axis)
+        {
+          result[axis] = static_cast<real_type>(values[axis]);
+        }
+
+        return result;
+      }
+
+      size_type capacity_;
+      double smoothing_;
+      std::uint64_t pushed_ = 0;
+      std::array<std::vector<T>, Dimension> samples_;
+      std::array<double, Dimension> mean_{};
+      std::array<double, Dimension> deviation2_{};
+      std::array<double, Dimension> ema_{};
+      std::array<monotonic_deque, Dimension> minimum_;
+      std::array<monotonic_deque, Dimension> maximum_;
+    };
+  }
+}
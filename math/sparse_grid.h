@@ -0,0 +1,665 @@
+//
+// Copyright © 2017 Constanze Pfennig. All rights reserved.
+//
+
+#pragma once
+
+#include "vector.h"
+#include "instrumentation.h"
+#include "../parallel/parallel_for.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <unordered_map>
+
+
+// A sparse 3-D grid in three levels: a hash map of nodes, each node holding a dense block of
+// (2^NodeLog2)^3 optional leaves, each leaf holding (2^LeafLog2)^3 values with an activity mask.
+// Voxels without a leaf and inactive voxels read as the background value.
+
+namespace nuts
+{
+  namespace math
+  {
+    namespace detail
+    {
+      struct index_hash
+      {
+        std::size_t operator()(const vector3i& index) const noexcept
+        {
+          const auto x = static_cast<std::uint64_t>(static_cast<std::uint32_t>(index[0]));
+          const auto y = static_cast<std::uint64_t>(static_cast<std::uint32_t>(index[1]));
+          const auto z = static_cast<std::uint64_t>(static_cast<std::uint32_t>(index[2]));
+          return static_cast<std::size_t>((x * 73856093u) ^ (y * 19349663u) ^ (z * 83492791u));
+        }
+      };
+
+      // Component by component, so lookups do not count as vector comparisons of the caller.
+      struct index_equal
+      {
+        bool operator()(const vector3i& index1, const vector3i& index2) const noexcept
+        {
+          return index1[0] == index2[0] && index1[1] == index2[1] && index1[2] == index2[2];
+        }
+      };
+
+      inline int popcount(std::uint64_t val) noexcept
+      {
+#if defined(__GNUC__)
+        return __builtin_popcountll(val);
+#else
+        int result = 0;
+
+        for(; val != 0; val &= val - 1)
+        {
+          ++result;
+        }
+
+        return result;
+#endif
+      }
+
+      inline int count_trailing_zeros(std::uint64_t val) noexcept
+      {
+        assert(val != 0);
+
+#if defined(__GNUC__)
+        return __builtin_ctzll(val);
+#else
+        int result = 0;
+
+        for(; (val & 1) == 0; val >>= 1)
+        {
+          ++result;
+        }
+
+        return result;
+#endif
+      }
+    }
+
+
+    template<typename T, std::size_t LeafLog2 = 3, std::size_t NodeLog2 = 4>
+    class sparse_grid
+    {
+    public:
+      static_assert(LeafLog2 >= 1 && NodeLog2 >= 1 && LeafLog2 + NodeLog2 < 31, "Invalid level sizes for sparse_grid.");
+
+      using value_type = T;
+      using index_type = vector3i;
+      using size_type = std::size_t;
+
+      static constexpr int leaf_log2 = static_cast<int>(LeafLog2);
+      static constexpr int leaf_extent = 1 << leaf_log2;
+      static constexpr size_type leaf_size = size_type{1} << (3 * LeafLog2);
+      static constexpr int node_log2 = static_cast<int>(NodeLog2);
+      static constexpr int node_extent = 1 << (leaf_log2 + node_log2);
+      static constexpr size_type node_size = size_type{1} << (3 * NodeLog2);
+
+      class leaf
+      {
+      public:
+        static constexpr size_type mask_words = (leaf_size + 63) / 64;
+
+        leaf(const index_type& origin, const T& background)
+          : origin_{origin}
+        {
+          std::fill(std::begin(values_), std::end(values_), background);
+          mask_.fill(0);
+        }
+
+        static size_type offset(const index_type& index) noexcept
+        {
+          constexpr int mask = leaf_extent - 1;
+          return static_cast<size_type>((index[2] & mask) << (2 * leaf_log2) | (index[1] & mask) << leaf_log2 | (index[0] & mask));
+        }
+
+        index_type index(size_type offset) const
+        {
+          constexpr auto mask = static_cast<size_type>(leaf_extent - 1);
+          return index_type{origin_[0] + static_cast<int>(offset & mask), origin_[1] + static_cast<int>(offset >> LeafLog2 & mask), origin_[2] + static_cast<int>(offset >> (2 * LeafLog2))};
+        }
+
+        const index_type& origin() const noexcept
+        {
+          return origin_;
+        }
+
+        bool is_active(size_type offset) const noexcept
+        {
+          return (mask_[offset >> 6] >> (offset & 63) & 1) != 0;
+        }
+
+        void set_active(size_type offset, bool active) noexcept
+        {
+          const auto bit = std::uint64_t{1} << (offset & 63);
+          mask_[offset >> 6] = active ? mask_[offset >> 6] | bit : mask_[offset >> 6] & ~bit;
+        }
+
+        T& value(size_type offset) noexcept
+        {
+          return values_[offset];
+        }
+
+        const T& value(size_type offset) const noexcept
+        {
+          return values_[offset];
+        }
+
+        void set_value(size_type offset, const T& val) noexcept
+        {
+          values_[offset] = val;
+          set_active(offset, true);
+        }
+
+        const std::array<std::uint64_t, mask_words>& mask() const noexcept
+        {
+          return mask_;
+        }
+
+        size_type active_count() const noexcept
+        {
+          size_type result = 0;
+
+          for(auto word : mask_)
+          {
+            result += static_cast<size_type>(detail::popcount(word));
+          }
+
+          return result;
+        }
+
+        // Calls function(offset) for every active voxel in ascending order.
+        template<typename Function>
+        void for_each_active(Function&& function) const
+        {
+          for(size_type word = 0; word < mask_words; ++word)
+          {
+            for(auto bits = mask_[word]; bits != 0; bits &= bits - 1)
+            {
+              function(word * 64 + static_cast<size_type>(detail::count_trailing_zeros(bits)));
+            }
+          }
+        }
+
+      private:
+        index_type origin_;
+        std::array<std::uint64_t, mask_words> mask_;
+        T values_[leaf_size];
+      };
+
+      // Remembers the last visited leaf, so that coherent lookups skip the hash map and the node.
+      template<typename Grid>
+      class basic_accessor
+      {
+      public:
+        explicit basic_accessor(Grid& grid)
+          : grid_{grid}
+        {
+        }
+
+        auto find_leaf(const index_type& index) const
+        {
+          const auto origin = leaf_origin(index);
+
+          if(leaf_ == nullptr || !detail::index_equal{}(origin, origin_))
+          {
+            leaf_ = grid_.find_leaf(index);
+            origin_ = origin;
+          }
+
+          return leaf_;
+        }
+
+        T value(const index_type& index) const
+        {
+          const auto found = find_leaf(index);
+
+          if(found == nullptr)
+            return grid_.background();
+
+          const auto offset = leaf::offset(index);
+          return found->is_active(offset) ? found->value(offset) : grid_.background();
+        }
+
+        bool is_active(const index_type& index) const
+        {
+          const auto found = find_leaf(index);
+          return found != nullptr && found->is_active(leaf::offset(index));
+        }
+
+        template<typename MyGrid = Grid, typename = std::enable_if_t<!std::is_const<MyGrid>::value>>
+        void set_value(const index_type& index, const T& val)
+        {
+          const auto origin = leaf_origin(index);
+
+          if(leaf_ == nullptr || !detail::index_equal{}(origin, origin_))
+          {
+            leaf_ = &grid_.touch_leaf(index);
+            origin_ = origin;
+          }
+
+          leaf_->set_value(leaf::offset(index), val);
+        }
+
+      private:
+        using leaf_pointer = std::conditional_t<std::is_const<Grid>::value, const leaf*, leaf*>;
+
+        Grid& grid_;
+        mutable leaf_pointer leaf_ = nullptr;
+        mutable index_type origin_{};
+      };
+
+      using accessor = basic_accessor<sparse_grid>;
+      using const_accessor = basic_accessor<const sparse_grid>;
+
+      explicit sparse_grid(const T& background = T{})
+        : background_{background}
+      {
+      }
+
+      sparse_grid(const sparse_grid&) = delete;
+      sparse_grid(sparse_grid&&) noexcept = default;
+
+      sparse_grid& operator=(const sparse_grid&) = delete;
+      sparse_grid& operator=(sparse_grid&&) noexcept = default;
+
+      const T& background() const noexcept
+      {
+        return background_;
+      }
+
+      static index_type leaf_origin(const index_type& index) noexcept
+      {
+        constexpr int mask = ~(leaf_extent - 1);
+        return index_type{index[0] & mask, index[1] & mask, index[2] & mask};
+      }
+
+      size_type leaf_count() const noexcept
+      {
+        return leaves_.size();
+      }
+
+      // Leaves in the order they were created.
+      leaf& leaf_at(size_type index) noexcept
+      {
+        return *leaves_[index];
+      }
+
+      const leaf& leaf_at(size_type index) const noexcept
+      {
+        return *leaves_[index];
+      }
+
+      size_type active_count() const noexcept
+      {
+        size_type result = 0;
+
+        for(auto current : leaves_)
+        {
+          result += current->active_count();
+        }
+
+        return result;
+      }
+
+      leaf* find_leaf(const index_type& index)
+      {
+        return const_cast<leaf*>(static_cast<const sparse_grid&>(*this).find_leaf(index));
+      }
+
+      const leaf* find_leaf(const index_type& index) const
+      {
+        const auto found = root_.find(node_key(index));
+
+        if(found == root_.end())
+          return nullptr;
+
+        return found->second->children[child_offset(index)].get();
+      }
+
+      // Returns the leaf containing index and creates it if necessary.
+      leaf& touch_leaf(const index_type& index)
+      {
+        auto& current = root_[node_key(index)];
+
+        if(!current)
+          current = std::make_unique<node>();
+
+        auto& child = current->children[child_offset(index)];
+
+        if(!child)
+        {
+          child = std::make_unique<leaf>(leaf_origin(index), background_);
+          leaves_.push_back(child.get());
+        }
+
+        return *child;
+      }
+
+      T value(const index_type& index) const
+      {
+        return const_accessor{*this}.value(index);
+      }
+
+      bool is_active(const index_type& index) const
+      {
+        return const_accessor{*this}.is_active(index);
+      }
+
+      void set_value(const index_type& index, const T& val)
+      {
+        touch_leaf(index).set_value(leaf::offset(index), val);
+      }
+
+      void set_inactive(const index_type& index)
+      {
+        if(auto found = find_leaf(index))
+        {
+          const auto offset = leaf::offset(index);
+          found->set_active(offset, false);
+          found->value(offset) = background_;
+        }
+      }
+
+      void clear()
+      {
+        root_.clear();
+        leaves_.clear();
+      }
+
+      // Calls function(index, value) for every active voxel, with the leaves split across threads.
+      template<typename Function>
+      void for_each_active(Function function, size_type threads = parallel::thread_count())
+      {
+        parallel::parallel_for(0, leaves_.size(), [&](size_type first, size_type last)
+        {
+          for(auto index = first; index < last; ++index)
+          {
+            auto& current = *leaves_[index];
+
+            current.for_each_active([&](size_type offset)
+            {
+              function(current.index(offset), current.value(offset));
+            });
+          }
+        }, threads);
+      }
+
+      template<typename Function>
+      void for_each_active(Function function, size_type threads = parallel::thread_count()) const
+      {
+        parallel::parallel_for(0, leaves_.size(), [&](size_type first, size_type last)
+        {
+          for(auto index = first; index < last; ++index)
+          {
+            const auto& current = *leaves_[index];
+
+            current.for_each_active([&](size_type offset)
+            {
+              function(current.index(offset), current.value(offset));
+            });
+          }
+        }, threads);
+      }
+
+    private:
+      struct node
+      {
+        std::array<std::unique_ptr<leaf>, node_size> children;
+      };
+
+      static index_type node_key(const index_type& index) noexcept
+      {
+        constexpr int shift = leaf_log2 + node_log2;
+        return index_type{index[0] >> shift, index[1] >> shift, index[2] >> shift};
+      }
+
+      static size_type child_offset(const index_type& index) noexcept
+      {
+        constexpr int mask = (1 << node_log2) - 1;
+        return static_cast<size_type>((index[2] >> leaf_log2 & mask) << (2 * node_log2) | (index[1] >> leaf_log2 & mask) << node_log2 | (index[0] >> leaf_log2 & mask));
+      }
+
+      T background_;
+      std::unordered_map<index_type, std::unique_ptr<node>, detail::index_hash, detail::index_equal> root_;
+      std::vector<leaf*> leaves_;
+    };
+
+
+    // Trilinear interpolation with voxel centers at integer coordinates; inactive voxels contribute the background.
+    template<typename T, std::size_t LeafLog2, std::size_t NodeLog2>
+    T sample(const typename sparse_grid<T, LeafLog2, NodeLog2>::const_accessor& accessor, const vector3f& position)
+    {
+      const vector3f base{std::floor(position[0]), std::floor(position[1]), std::floor(position[2])};
+      const vector3i index{static_cast<int>(base[0]), static_cast<int>(base[1]), static_cast<int>(base[2])};
+      const vector3f weight{position[0] - base[0], position[1] - base[1], position[2] - base[2]};
+
+      const auto lerp = [](const T& val1, const T& val2, float t)
+      {
+        return static_cast<T>(val1 + (val2 - val1) * t);
+      };
+
+      const auto row = [&](int dy, int dz)
+      {
+        return lerp(accessor.value(vector3i{index[0], index[1] + dy, index[2] + dz}), accessor.value(vector3i{index[0] + 1, index[1] + dy, index[2] + dz}), weight[0]);
+      };
+
+      return lerp(lerp(row(0, 0), row(1, 0), weight[1]), lerp(row(0, 1), row(1, 1), weight[1]), weight[2]);
+    }
+
+    template<typename T, std::size_t LeafLog2, std::size_t NodeLog2>
+    T sample(const sparse_grid<T, LeafLog2, NodeLog2>& grid, const vector3f& position)
+    {
+      return sample<T, LeafLog2, NodeLog2>(typename sparse_grid<T, LeafLog2, NodeLog2>::const_accessor{grid}, position);
+    }
+
+    // Samples every position; each thread keeps its own accessor, so sorted positions hit the cached leaf.
+    template<typename T, std::size_t LeafLog2, std::size_t NodeLog2>
+    void sample(const sparse_grid<T, LeafLog2, NodeLog2>& grid, const vector3f* positions, T* result, std::size_t count, std::size_t threads = parallel::thread_count())
+    {
+      NUTS_INSTRUMENT(sample, count, count * (sizeof(vector3f) + sizeof(T)));
+
+      parallel::parallel_for(0, count, [&](std::size_t first, std::size_t last)
+      {
+        NUTS_UNCOUNTED_SCOPE();
+
+        typename sparse_grid<T, LeafLog2, NodeLog2>::const_accessor accessor{grid};
+
+        for(auto index = first; index < last; ++index)
+        {
+          result[index] = sample<T, LeafLog2, NodeLog2>(accessor, positions[index]);
+        }
+      }, threads);
+    }
+
+
+    namespace detail
+    {
+      // Godunov upwind solution of |grad u| = 1 for the smallest neighbour magnitude along each axis.
+      inline float solve_eikonal(float a, float b, float c, float spacing)
+      {
+        if(a > b)
+          std::swap(a, b);
+        if(b > c)
+          std::swap(b, c);
+        if(a > b)
+          std::swap(a, b);
+
+        auto result = a + spacing;
+
+        if(result > b)
+        {
+          result = 0.5f * (a + b + std::sqrt(std::max(2.f * spacing * spacing - (a - b) * (a - b), 0.f)));
+
+          if(result > c)
+          {
+            const auto sum = a + b + c;
+            const auto discriminant = sum * sum - 3.f * (a * a + b * b + c * c - spacing * spacing);
+            result = (sum + std::sqrt(std::max(discriminant, 0.f))) / 3.f;
+          }
+        }
+
+        return result;
+      }
+
+      // False if an inactive voxel has active neighbours of both signs, that is lies on an edge the
+      // field changes sign on.
+      template<std::size_t LeafLog2, std::size_t NodeLog2>
+      bool sign_changes_active(const sparse_grid<float, LeafLog2, NodeLog2>& grid)
+      {
+        const std::array<vector3i, 6> neighbours{vector3i{-1, 0, 0}, vector3i{1, 0, 0}, vector3i{0, -1, 0}, vector3i{0, 1, 0}, vector3i{0, 0, -1}, vector3i{0, 0, 1}};
+
+        typename sparse_grid<float, LeafLog2, NodeLog2>::const_accessor accessor{grid};
+        auto result = true;
+
+        grid.for_each_active([&](const vector3i& index, float val)
+        {
+          for(const auto& offset : neighbours)
+          {
+            const vector3i outside{index[0] + offset[0], index[1] + offset[1], index[2] + offset[2]};
+
+            if(accessor.is_active(outside))
+              continue;
+
+            for(const auto& next : neighbours)
+            {
+              const vector3i other{outside[0] + next[0], outside[1] + next[1], outside[2] + next[2]};
+
+              if(accessor.is_active(other) && (accessor.value(other) < 0.f) != (val < 0.f))
+                result = false;
+            }
+          }
+        }, 1);
+
+        return result;
+      }
+    }
+
+
+    // Extends the active voxels of a signed distance field by band voxels in every direction and fills
+    // the new voxels by fast sweeping: eight Gauss-Seidel passes, one per diagonal direction, over the
+    // leaves and the voxels within each leaf, solving the Eikonal equation. The voxels active on entry
+    // are kept as they are, new voxels take the sign of the neighbour they were grown from and are
+    // limited to the magnitude of the background.
+    //
+    // The signs are only right if both ends of every edge the field changes sign on are active on
+    // entry, e.g. for an input band of at least one voxel on either side of the surface. A band that
+    // holds only one side of a crossing grows wrongly signed voxels with errors of several voxels.
+    // Debug builds assert that no inactive voxel has active neighbours of both signs.
+    template<std::size_t LeafLog2, std::size_t NodeLog2>
+    void fast_sweep(sparse_grid<float, LeafLog2, NodeLog2>& grid, int band, float spacing = 1.f)
+    {
+      using grid_type = sparse_grid<float, LeafLog2, NodeLog2>;
+      using leaf_type = typename grid_type::leaf;
+      using mask_type = std::array<std::uint64_t, leaf_type::mask_words>;
+
+      assert(detail::sign_changes_active(grid));
+
+      const auto limit = std::abs(grid.background());
+      const std::array<vector3i, 6> neighbours{vector3i{-1, 0, 0}, vector3i{1, 0, 0}, vector3i{0, -1, 0}, vector3i{0, 1, 0}, vector3i{0, 0, -1}, vector3i{0, 0, 1}};
+
+      std::vector<mask_type> frozen;
+      frozen.reserve(grid.leaf_count());
+
+      for(std::size_t index = 0; index < grid.leaf_count(); ++index)
+      {
+        frozen.push_back(grid.leaf_at(index).mask());
+      }
+
+      std::vector<std::pair<vector3i, float>> front;
+      std::vector<std::pair<vector3i, float>> grown;
+
+      grid.for_each_active([&](const vector3i& index, float val)
+      {
+        front.emplace_back(index, val);
+      }, 1);
+
+      typename grid_type::accessor accessor{grid};
+
+      for(int step = 0; step < band; ++step)
+      {
+        grown.clear();
+
+        for(const auto& current : front)
+        {
+          for(const auto& offset : neighbours)
+          {
+            const vector3i index{current.first[0] + offset[0], current.first[1] + offset[1], current.first[2] + offset[2]};
+
+            if(accessor.is_active(index))
+              continue;
+
+            const auto val = current.second < 0.f ? -limit : limit;
+            accessor.set_value(index, val);
+            grown.emplace_back(index, val);
+          }
+        }
+
+        front.swap(grown);
+      }
+
+      frozen.resize(grid.leaf_count(), mask_type{});
+
+      typename grid_type::const_accessor reader{grid};
+      std::vector<std::size_t> order(grid.leaf_count());
+
+      for(int direction = 0; direction < 8; ++direction)
+      {
+        const vector3i sign{direction & 1 ? -1 : 1, direction & 2 ? -1 : 1, direction & 4 ? -1 : 1};
+
+        std::iota(order.begin(), order.end(), std::size_t{0});
+        std::sort(order.begin(), order.end(), [&](std::size_t lhs, std::size_t rhs)
+        {
+          const auto& origin1 = grid.leaf_at(lhs).origin();
+          const auto& origin2 = grid.leaf_at(rhs).origin();
+          const std::array<int, 3> key1{origin1[2] * sign[2], origin1[1] * sign[1], origin1[0] * sign[0]};
+          const std::array<int, 3> key2{origin2[2] * sign[2], origin2[1] * sign[1], origin2[0] * sign[0]};
+          return key1 < key2;
+        });
+
+        for(auto leaf_index : order)
+        {
+          auto& current = grid.leaf_at(leaf_index);
+          const auto& fixed = frozen[leaf_index];
+
+          for(int z = 0; z < grid_type::leaf_extent; ++z)
+          {
+            for(int y = 0; y < grid_type::leaf_extent; ++y)
+            {
+              for(int x = 0; x < grid_type::leaf_extent; ++x)
+              {
+                const vector3i local{sign[0] > 0 ? x : grid_type::leaf_extent - 1 - x, sign[1] > 0 ? y : grid_type::leaf_extent - 1 - y, sign[2] > 0 ? z : grid_type::leaf_extent - 1 - z};
+                const auto offset = leaf_type::offset(local);
+
+                if(!current.is_active(offset) || (fixed[offset >> 6] >> (offset & 63) & 1) != 0)
+                  continue;
+
+                const auto& origin = current.origin();
+                const vector3i index{origin[0] + local[0], origin[1] + local[1], origin[2] + local[2]};
+                std::array<float, 3> nearest;
+
+                for(std::size_t axis = 0; axis < 3; ++axis)
+                {
+                  auto lower = index;
+                  auto upper = index;
+                  --lower[axis];
+                  ++upper[axis];
+                  nearest[axis] = std::min(std::min(std::abs(reader.value(lower)), std::abs(reader.value(upper))), limit);
+                }
+
+                auto& val = current.value(offset);
+                const auto solution = std::min(detail::solve_eikonal(nearest[0], nearest[1], nearest[2], spacing), limit);
+
+                if(solution < std::abs(val))
+                  val = val < 0.f ? -solution : solution;
+              }
+            }
+          }
+        }
+      }
+    }
+  }
+}
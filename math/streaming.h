@@ -0,0 +1,103 @@
+//
+// Copyright © 2017 Constanze Pfennig. All rights reserved.
+//
+
+#pragma once
+
+#include "simd.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+
+// Store modes of the batch kernels. Ordinary stores bring every line of the output into the cache,
+// where on arrays far larger than the last level cache they evict input that is still to be read.
+// Streaming (non-temporal) stores write combined lines straight to memory instead, and the input is
+// prefetched a fixed distance ahead since the hardware prefetcher tends to lose track of streams
+// interleaved with non-temporal writes.
+
+namespace nuts
+{
+  namespace math
+  {
+    enum class store_mode
+    {
+      // Streaming once a call touches more than streaming_threshold bytes.
+      automatic,
+      cached,
+      streaming
+    };
+
+    // Bytes read and written by one call from which automatic streams, about one last level cache.
+    constexpr std::size_t streaming_threshold = std::size_t{8} << 20;
+
+    // How far ahead of the current input the streaming loops prefetch: far enough to hide memory latency
+    // at the bandwidth of one core, near enough not to be evicted again before use.
+    constexpr std::size_t prefetch_distance = 512;
+
+    namespace detail
+    {
+      using cached_stores = std::false_type;
+      using streaming_stores = std::true_type;
+
+      // Non-temporal stores need 16 byte aligned addresses; results that are not stay cached.
+      inline bool use_streaming(store_mode mode, const void* result, std::size_t bytes) noexcept
+      {
+        if(mode == store_mode::cached || reinterpret_cast<std::uintptr_t>(result) % 16 != 0)
+          return false;
+
+        return mode == store_mode::streaming || bytes > streaming_threshold;
+      }
+
+#if defined(NUTS_MATH_SSE2)
+      inline void store(float* result, __m128 val, cached_stores) noexcept
+      {
+        _mm_storeu_ps(result, val);
+      }
+
+      inline void store(float* result, __m128 val, streaming_stores) noexcept
+      {
+        _mm_stream_ps(result, val);
+      }
+
+      inline void store(__m128i* result, __m128i val, cached_stores) noexcept
+      {
+        _mm_storeu_si128(result, val);
+      }
+
+      inline void store(__m128i* result, __m128i val, streaming_stores) noexcept
+      {
+        _mm_stream_si128(result, val);
+      }
+
+      inline void prefetch(const void*, cached_stores) noexcept
+      {
+      }
+
+      // Prefetches never fault, so reading past the end of the input is harmless.
+      inline void prefetch(const void* input, streaming_stores) noexcept
+      {
+        _mm_prefetch(static_cast<const char*>(input) + prefetch_distance, _MM_HINT_T0);
+      }
+
+      // Calls loop with cached_stores or streaming_stores, so the choice is made once per call rather
+      // than per store. The fence orders the streaming stores before anything the caller writes next,
+      // like a flag that hands the result to another thread.
+      template<typename Loop>
+      void with_store_mode(store_mode mode, const void* result, std::size_t bytes, Loop loop)
+      {
+        if(use_streaming(mode, result, bytes))
+        {
+          loop(streaming_stores{});
+          _mm_sfence();
+        }
+        else
+        {
+          loop(cached_stores{});
+        }
+      }
+#endif
+    }
+  }
+}
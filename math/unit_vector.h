@@ -0,0 +1,315 @@
+//
+// Copyright © 2017 Constanze Pfennig. All rights reserved.
+//
+
+#pragma once
+
+#include "vector.h"
+#include "quantization.h"
+#include "simd.h"
+#include "instrumentation.h"
+#include "../parallel/parallel_for.h"
+
+#include <array>
+#include <cassert>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+#include <vector>
+
+
+namespace nuts
+{
+  namespace math
+  {
+    // A vector of length one. Construction from an arbitrary direction normalizes it once, so users
+    // never need to check or recompute the length; from_normalized skips that for vectors known to be
+    // normalized. Converts implicitly to the underlying vector for use with the rest of the library.
+    template<typename T, std::size_t Dimension>
+    class unit_vector
+    {
+    public:
+      static_assert(std::is_floating_point<T>::value, "Unit vectors need floating point components.");
+
+      using value_type = T;
+      using size_type = std::size_t;
+      using vector_type = vector<T, Dimension>;
+
+      // The first axis.
+      unit_vector() noexcept
+      {
+        for(size_type index = 0; index < Dimension; ++index)
+        {
+          vector_[index] = index == 0 ? T{1} : T{0};
+        }
+      }
+
+      explicit unit_vector(const vector_type& direction)
+        : vector_(direction * (T{1} / direction.length()))
+      {
+        assert(direction.dot(direction) > T{0});
+      }
+
+      static unit_vector from_normalized(const vector_type& normalized) noexcept
+      {
+        assert(std::abs(normalized.dot(normalized) - T{1}) < T{1e-4});
+
+        unit_vector result;
+        result.vector_ = normalized;
+        return result;
+      }
+
+      const vector_type& get() const noexcept
+      {
+        return vector_;
+      }
+
+      operator const vector_type&() const noexcept
+      {
+        return vector_;
+      }
+
+      value_type operator[](size_type index) const noexcept
+      {
+        return vector_[index];
+      }
+
+      bool operator==(const unit_vector& other) const
+      {
+        return vector_ == other.vector_;
+      }
+
+      bool operator!=(const unit_vector& other) const
+      {
+        return !(*this == other);
+      }
+
+      unit_vector operator-() const noexcept
+      {
+        return from_normalized(vector_ * T{-1});
+      }
+
+      constexpr value_type length() const noexcept
+      {
+        return T{1};
+      }
+
+      value_type dot(const vector_type& other) const
+      {
+        return vector_.dot(other);
+      }
+
+    private:
+      vector_type vector_;
+    };
+
+    using unit_vector2f = unit_vector<float, 2>;
+    using unit_vector3f = unit_vector<float, 3>;
+    using unit_vector2d = unit_vector<double, 2>;
+    using unit_vector3d = unit_vector<double, 3>;
+
+
+    // Octahedral codes of unit_vector3f (see octahedral_encode) in 16, 24 and 32 bits, that is 8, 12
+    // and 16 bits per axis. The 24 bit code is three little endian bytes.
+    using octahedral16 = std::uint16_t;
+    using octahedral32 = std::uint32_t;
+
+    struct octahedral24
+    {
+      std::array<std::uint8_t, 3> bytes;
+    };
+
+    namespace detail
+    {
+      template<typename Code>
+      struct octahedral_traits;
+
+      template<>
+      struct octahedral_traits<octahedral16>
+      {
+        static constexpr int bits = 8;
+
+        static octahedral16 pack(std::uint64_t code) noexcept
+        {
+          return static_cast<octahedral16>(code);
+        }
+
+        static std::uint64_t unpack(octahedral16 code) noexcept
+        {
+          return code;
+        }
+      };
+
+      template<>
+      struct octahedral_traits<octahedral24>
+      {
+        static constexpr int bits = 12;
+
+        static octahedral24 pack(std::uint64_t code) noexcept
+        {
+          return octahedral24{{static_cast<std::uint8_t>(code), static_cast<std::uint8_t>(code >> 8), static_cast<std::uint8_t>(code >> 16)}};
+        }
+
+        static std::uint64_t unpack(const octahedral24& code) noexcept
+        {
+          return code.bytes[0] | static_cast<std::uint64_t>(code.bytes[1]) << 8 | static_cast<std::uint64_t>(code.bytes[2]) << 16;
+        }
+      };
+
+      template<>
+      struct octahedral_traits<octahedral32>
+      {
+        static constexpr int bits = 16;
+
+        static octahedral32 pack(std::uint64_t code) noexcept
+        {
+          return static_cast<octahedral32>(code);
+        }
+
+        static std::uint64_t unpack(octahedral32 code) noexcept
+        {
+          return code;
+        }
+      };
+    }
+
+    namespace detail
+    {
+      // Cosine of the angle between direction and the decoded code in double precision. At 16 bits per
+      // axis neighbouring codes differ by less than the rounding error of a float dot product.
+      inline double octahedral_cosine(const unit_vector3f& direction, std::uint64_t code, int bits) noexcept
+      {
+        const auto decoded = math::octahedral_decode(code, bits);
+        double dot = 0.0;
+        double length2 = 0.0;
+
+        for(std::size_t axis = 0; axis < 3; ++axis)
+        {
+          dot += static_cast<double>(direction[axis]) * decoded[axis];
+          length2 += static_cast<double>(decoded[axis]) * decoded[axis];
+        }
+
+        return dot / std::sqrt(length2);
+      }
+    }
+
+    // Picks the best of the grid points around the projected vector by the decoded direction rather
+    // than the nearest one in the square, which lowers the angular error of the small codes
+    // (Cigolle et al. 2014). The nearest code is kept unless a neighbour is strictly closer.
+    template<typename Code>
+    Code encode_octahedral(const unit_vector3f& direction) noexcept
+    {
+      using traits = detail::octahedral_traits<Code>;
+
+      constexpr int bits = traits::bits;
+      constexpr std::uint64_t mask = (std::uint64_t{1} << bits) - 1;
+
+      const auto nearest = octahedral_encode(direction, bits);
+      auto best = nearest;
+      auto best_cosine = detail::octahedral_cosine(direction, nearest, bits);
+
+      for(int neighbour = 0; neighbour < 9; ++neighbour)
+      {
+        const auto u = static_cast<std::int64_t>(nearest & mask) + neighbour % 3 - 1;
+        const auto v = static_cast<std::int64_t>(nearest >> bits) + neighbour / 3 - 1;
+
+        if(u < 0 || v < 0 || u > static_cast<std::int64_t>(mask) || v > static_cast<std::int64_t>(mask))
+          continue;
+
+        const auto candidate = static_cast<std::uint64_t>(u) | static_cast<std::uint64_t>(v) << bits;
+        const auto candidate_cosine = detail::octahedral_cosine(direction, candidate, bits);
+
+        if(candidate_cosine > best_cosine)
+        {
+          best = candidate;
+          best_cosine = candidate_cosine;
+        }
+      }
+
+      return traits::pack(best);
+    }
+
+    template<typename Code>
+    unit_vector3f decode_octahedral(const Code& code) noexcept
+    {
+      using traits = detail::octahedral_traits<Code>;
+      return unit_vector3f::from_normalized(octahedral_decode(traits::unpack(code), traits::bits));
+    }
+
+    template<typename Code>
+    void encode_octahedral(const std::vector<unit_vector3f>& directions, std::vector<Code>& result, std::size_t threads = parallel::thread_count())
+    {
+      result.resize(directions.size());
+
+      NUTS_INSTRUMENT(encode_octahedral, directions.size(), directions.size() * (sizeof(unit_vector3f) + sizeof(Code)));
+
+      parallel::parallel_for(0, directions.size(), [&](std::size_t first, std::size_t last)
+      {
+        NUTS_UNCOUNTED_SCOPE();
+
+        for(auto index = first; index < last; ++index)
+        {
+          result[index] = encode_octahedral<Code>(directions[index]);
+        }
+      }, threads);
+    }
+
+    // Batch decode, four codes per step in SSE2. The results need no further normalization.
+    template<typename Code>
+    void decode_octahedral(const std::vector<Code>& codes, std::vector<unit_vector3f>& result, std::size_t threads = parallel::thread_count())
+    {
+      result.resize(codes.size());
+
+      NUTS_INSTRUMENT(decode_octahedral, codes.size(), codes.size() * (sizeof(Code) + sizeof(unit_vector3f)));
+
+      parallel::parallel_for(0, codes.size(), [&](std::size_t first, std::size_t last)
+      {
+        NUTS_UNCOUNTED_SCOPE();
+
+        auto index = first;
+
+#if defined(NUTS_MATH_SSE2)
+        using traits = detail::octahedral_traits<Code>;
+
+        constexpr int bits = traits::bits;
+        constexpr std::uint64_t mask = (std::uint64_t{1} << bits) - 1;
+
+        for(; index + 4 <= last; index += 4)
+        {
+          alignas(16) std::array<std::int32_t, 4> u;
+          alignas(16) std::array<std::int32_t, 4> v;
+
+          for(std::size_t lane = 0; lane < 4; ++lane)
+          {
+            const auto code = traits::unpack(codes[index + lane]);
+            u[lane] = static_cast<std::int32_t>(code & mask);
+            v[lane] = static_cast<std::int32_t>(code >> bits);
+          }
+
+          __m128 x;
+          __m128 y;
+          __m128 z;
+          detail::octahedral_decode(_mm_load_si128(reinterpret_cast<const __m128i*>(u.data())), _mm_load_si128(reinterpret_cast<const __m128i*>(v.data())),
+            bits, x, y, z);
+
+          alignas(16) std::array<std::array<float, 4>, 3> out;
+          _mm_store_ps(out[0].data(), x);
+          _mm_store_ps(out[1].data(), y);
+          _mm_store_ps(out[2].data(), z);
+
+          for(std::size_t lane = 0; lane < 4; ++lane)
+          {
+            result[index + lane] = unit_vector3f::from_normalized(vector3f{out[0][lane], out[1][lane], out[2][lane]});
+          }
+        }
+#endif
+
+        for(; index < last; ++index)
+        {
+          result[index] = decode_octahedral(codes[index]);
+        }
+      }, threads);
+    }
+  }
+}
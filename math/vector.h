@@ -4,8 +4,12 @@
 
 #pragma once
 
+#include "instrumentation.h"
+
 #include <type_traits>
 #include <cassert>
+#include <algorithm>
+#include <cmath>
 #include <vector>
 #include <numeric>
 #include <array>
@@ -46,7 +50,7 @@ namespace nuts
         *this = other;
       }
 
-      template<typename... Args, typename = std::enable_if_t<sizeof...(Args) == Dimension && std::conjunction_v<std::is_convertible<T, Args>...>>>
+      template<typename... Args, typename = std::enable_if_t<sizeof...(Args) == Dimension && std::conjunction_v<std::is_convertible<Args, T>...>>>
       vector(Args&&... args)
         : data_{static_cast<T>(std::forward<Args>(args))...}
       {
@@ -72,31 +76,37 @@ namespace nuts
 
       bool operator<(const vector& other) const
       {
+        NUTS_INSTRUMENT_VECTOR(vector_compare, Dimension, 2 * sizeof(vector));
         return data_ < other.data_;
       }
 
       bool operator==(const vector& other) const
       {
+        NUTS_INSTRUMENT_VECTOR(vector_compare, Dimension, 2 * sizeof(vector));
         return data_ == other.data_;
       }
 
       bool operator!=(const vector& other) const
       {
+        NUTS_INSTRUMENT_VECTOR(vector_compare, Dimension, 2 * sizeof(vector));
         return data_ != other.data_;
       }
 
       bool operator>(const vector& other) const
       {
+        NUTS_INSTRUMENT_VECTOR(vector_compare, Dimension, 2 * sizeof(vector));
         return data_ > other.data_;
       }
 
       bool operator>=(const vector& other) const
       {
+        NUTS_INSTRUMENT_VECTOR(vector_compare, Dimension, 2 * sizeof(vector));
         return data_ >= other.data_;
       }
 
       bool operator<=(const vector& other) const
       {
+        NUTS_INSTRUMENT_VECTOR(vector_compare, Dimension, 2 * sizeof(vector));
         return data_ <= other.data_;
       }
 
@@ -106,6 +116,8 @@ namespace nuts
         using result_value_type = decltype(std::declval<T>() + std::declval<T2>());
         using usage_type = vector<result_value_type, Dimension>;
 
+        NUTS_INSTRUMENT_VECTOR(vector_add, Dimension, sizeof(vector) + sizeof(other) + sizeof(usage_type));
+
         usage_type result;
 
         std::transform(data_.begin(), data_.end(), other.begin(), result.begin(), [](const T& val1, const T2& val2)
@@ -122,6 +134,8 @@ namespace nuts
         using result_value_type = decltype(std::declval<T>() * std::declval<T2>());
         using usage_type = vector<result_value_type, Dimension>;
 
+        NUTS_INSTRUMENT_VECTOR(vector_scale, Dimension, sizeof(vector) + sizeof(T2) + sizeof(usage_type));
+
         usage_type result;
 
         std::transform(data_.begin(), data_.end(), result.begin(), [&val](const T& val1)
@@ -144,6 +158,8 @@ namespace nuts
         using result_value_type = decltype(std::declval<T>() - std::declval<T2>());
         using usage_type = vector<result_value_type, Dimension>;
 
+        NUTS_INSTRUMENT_VECTOR(vector_subtract, Dimension, sizeof(vector) + sizeof(other) + sizeof(usage_type));
+
         usage_type result;
 
         std::transform(data_.begin(), data_.end(), other.begin(), result.begin(), [](const T& val1, const T2& val2)
@@ -305,6 +321,7 @@ namespace nuts
 
       value_type dot(const vector& other) const
       {
+        NUTS_INSTRUMENT_VECTOR(vector_dot, Dimension, 2 * sizeof(vector) + sizeof(T));
         return std::inner_product(begin(), end(), other.begin(), T{0});
       }
 
@@ -331,6 +348,8 @@ namespace nuts
       using result_value_type = decltype(std::declval<T>() * std::declval<T2>());
       using usage_type = vector<result_value_type, Dimension>;
 
+      NUTS_INSTRUMENT_VECTOR(vector_multiply, Dimension, sizeof(vec) + sizeof(other) + sizeof(usage_type));
+
       usage_type result;
 
       std::transform(vec.begin(), vec.end(), other.begin(), result.begin(), [](const T& val1, const T2& val2)
@@ -342,12 +361,29 @@ namespace nuts
     }
 
 
+    template<typename T, typename T2, typename = std::enable_if_t<std::is_convertible<T2, T>::value>>
+    auto cross(const vector<T, 3>& vec, const vector<T2, 3>& other)
+    {
+      using result_value_type = decltype(std::declval<T>() * std::declval<T2>());
+
+      NUTS_INSTRUMENT_VECTOR(vector_cross, 3, sizeof(vec) + sizeof(other) + sizeof(vector<result_value_type, 3>));
+
+      return vector<result_value_type, 3>{
+        vec[1] * other[2] - vec[2] * other[1],
+        vec[2] * other[0] - vec[0] * other[2],
+        vec[0] * other[1] - vec[1] * other[0]};
+    }
+
+
     using vector2d = vector<double, 2>;
     using vector3d = vector<double, 3>;
     using vector2i = vector<int, 2>;
     using vector3i = vector<int, 3>;
     using vector2f = vector<float, 2>;
     using vector3f = vector<float, 3>;
+    using vector4d = vector<double, 4>;
+    using vector4i = vector<int, 4>;
+    using vector4f = vector<float, 4>;
 
 
     namespace detail
@@ -410,4 +446,4 @@ namespace nuts
       return detail::comma_initializer<T, Dimension>(vec, std::forward<vector<T2, Dimension2>>(other));
     }
   }
-}
\ No newline at end of file
+}
\ No newline at end of file
@@ -0,0 +1,115 @@
+//
+// Copyright © 2017 Constanze Pfennig. All rights reserved.
+//
+
+#pragma once
+
+#include "parallel_for.h"
+#include "../math/vector.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include <vector>
+
+
+namespace nuts
+{
+  namespace parallel
+  {
+    // Atomically adds value to target, which other threads may update concurrently with atomic_add only.
+    // Uses std::atomic_ref where the library has it, otherwise a compare-and-swap loop over the bits of
+    // target through the GCC builtins, which accept plain objects.
+    template<typename T, typename = std::enable_if_t<std::is_arithmetic<T>::value>>
+    void atomic_add(T& target, T value) noexcept
+    {
+#if defined(__cpp_lib_atomic_ref)
+      std::atomic_ref<T>{target}.fetch_add(value, std::memory_order_relaxed);
+#elif defined(__GNUC__)
+      if constexpr(std::is_integral<T>::value)
+      {
+        __atomic_fetch_add(&target, value, __ATOMIC_RELAXED);
+      }
+      else
+      {
+        using bits_type = std::conditional_t<sizeof(T) == 4, std::uint32_t, std::uint64_t>;
+        static_assert(sizeof(T) == sizeof(bits_type), "Floating point type without a matching integer.");
+
+        auto* const bits = reinterpret_cast<bits_type*>(&target);
+        auto expected = __atomic_load_n(bits, __ATOMIC_RELAXED);
+        bits_type desired;
+
+        do
+        {
+          T current;
+          std::memcpy(&current, &expected, sizeof(T));
+          current += value;
+          std::memcpy(&desired, &current, sizeof(T));
+        }
+        while(!__atomic_compare_exchange_n(bits, &expected, desired, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+      }
+#else
+      static_assert(sizeof(std::atomic<T>) == sizeof(T) && std::atomic<T>::is_always_lock_free, "No lock-free atomic for this type.");
+
+      auto& atomic = reinterpret_cast<std::atomic<T>&>(target);
+      auto expected = atomic.load(std::memory_order_relaxed);
+
+      while(!atomic.compare_exchange_weak(expected, expected + value, std::memory_order_relaxed))
+      {
+      }
+#endif
+    }
+
+    // Component-wise atomic add. Each component is updated atomically on its own, so a concurrent reader
+    // may see some components of an addition before others.
+    template<typename T, std::size_t Dimension, typename T2>
+    void atomic_add(math::vector<T, Dimension>& target, const math::vector<T2, Dimension>& value) noexcept
+    {
+      for(std::size_t index = 0; index < Dimension; ++index)
+      {
+        atomic_add(target[index], static_cast<T>(value[index]));
+      }
+    }
+
+
+    // Scatter-add with private copies: the items [first, last) are split into one part per thread as by
+    // parallel_for, and function(begin, end, local) adds the contributions of its items into local, a
+    // zeroed private array of target's size. The copies are then summed into target in parallel over
+    // the elements, always in part order, so the result only depends on the thread count and not on the
+    // timing. Costs one copy of target per part; for sparse updates of huge targets atomic_add is cheaper.
+    template<typename Value, typename Function>
+    void scatter_add(std::size_t first, std::size_t last, std::vector<Value>& target, Function&& function, std::size_t threads = thread_count())
+    {
+      if(first >= last)
+        return;
+
+      const auto parts = std::max<std::size_t>(std::min(threads, last - first), 1);
+      std::vector<std::vector<Value>> locals(parts);
+
+      parallel_for(0, parts, [&](std::size_t part_first, std::size_t part_last)
+      {
+        for(auto part = part_first; part < part_last; ++part)
+        {
+          // Every thread allocates and zeroes its own copy, so its pages are first touched there.
+          locals[part].assign(target.size(), Value{});
+
+          const auto range = partition(first, last, parts, part);
+          function(range.first, range.second, locals[part]);
+        }
+      }, threads);
+
+      parallel_for(0, target.size(), [&](std::size_t element_first, std::size_t element_last)
+      {
+        for(const auto& local : locals)
+        {
+          for(auto element = element_first; element < element_last; ++element)
+          {
+            target[element] += local[element];
+          }
+        }
+      }, threads);
+    }
+  }
+}
@@ -0,0 +1,274 @@
+//
+// Copyright © 2017 Constanze Pfennig. All rights reserved.
+//
+
+#pragma once
+
+#include "parallel_for.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <limits>
+#include <new>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+
+// Placement of large arrays on NUMA machines. The kernel puts a page on the node of the thread that
+// first writes it, so an array that is initialized by one thread ends up on one node, and all other
+// threads of a batch kernel read it across the interconnect. Huge pages additionally cut the TLB misses
+// of streaming over large arrays. NUMA policies and huge pages are requests to the kernel: where they
+// are unsupported or denied the memory is used as it comes.
+
+namespace nuts
+{
+  namespace parallel
+  {
+    enum class numa_policy
+    {
+      // Pages go to the node of the thread touching them first; see first_touch.
+      first_touch,
+      // Pages are spread round robin over the nodes of the mask.
+      interleave,
+      // Pages are only taken from the nodes of the mask.
+      bind
+    };
+
+    constexpr std::size_t huge_page_size = std::size_t{2} << 20;
+
+    // Bit mask of the online NUMA nodes, 1 where the system does not tell.
+    inline std::uint64_t numa_nodes()
+    {
+      std::uint64_t result = 0;
+
+#if defined(__linux__)
+      // A list like "0-1,4" of nodes and node ranges.
+      std::ifstream file{"/sys/devices/system/node/online"};
+      std::string list;
+
+      if(std::getline(file, list))
+      {
+        std::size_t position = 0;
+
+        while(position < list.size())
+        {
+          std::size_t end = 0;
+          const auto first = std::stoul(list.substr(position), &end);
+          auto last = first;
+          position += end;
+
+          if(position < list.size() && list[position] == '-')
+          {
+            last = std::stoul(list.substr(position + 1), &end);
+            position += end + 1;
+          }
+
+          for(auto node = first; node <= last && node < 64; ++node)
+          {
+            result |= std::uint64_t{1} << node;
+          }
+
+          ++position;
+        }
+      }
+#endif
+
+      return result != 0 ? result : 1;
+    }
+
+    // Allocator for large arrays: allocations of at least min_mapping bytes are mapped directly,
+    // rounded up to whole huge pages, advised to use transparent huge pages and given the NUMA policy.
+    // Smaller ones come from operator new. Construction without arguments default-initializes, so
+    // resizing a std::vector of trivial elements (like math::vector) does not touch its pages and
+    // first_touch can place them.
+    template<typename T>
+    class numa_allocator
+    {
+    public:
+      using value_type = T;
+
+      static constexpr std::size_t min_mapping = std::size_t{1} << 20;
+
+      numa_allocator() = default;
+
+      explicit numa_allocator(numa_policy policy, std::uint64_t nodes = numa_nodes(), bool huge_pages = true) noexcept
+        : policy_(policy),
+          nodes_(nodes),
+          huge_pages_(huge_pages)
+      {
+      }
+
+      template<typename U>
+      numa_allocator(const numa_allocator<U>& other) noexcept
+        : policy_(other.policy()),
+          nodes_(other.nodes()),
+          huge_pages_(other.huge_pages())
+      {
+      }
+
+      numa_policy policy() const noexcept
+      {
+        return policy_;
+      }
+
+      std::uint64_t nodes() const noexcept
+      {
+        return nodes_;
+      }
+
+      bool huge_pages() const noexcept
+      {
+        return huge_pages_;
+      }
+
+      T* allocate(std::size_t count)
+      {
+        if(count > std::numeric_limits<std::size_t>::max() / sizeof(T))
+          throw std::bad_array_new_length{};
+
+        const auto bytes = count * sizeof(T);
+
+#if defined(__linux__)
+        if(bytes >= min_mapping)
+        {
+          const auto size = mapping_size(bytes);
+          auto* const address = map_aligned(size);
+
+#if defined(MADV_HUGEPAGE)
+          if(huge_pages_)
+            madvise(address, size, MADV_HUGEPAGE);
+#endif
+
+#if defined(SYS_mbind)
+          if(policy_ != numa_policy::first_touch)
+          {
+            // MPOL_BIND and MPOL_INTERLEAVE; the kernel reads maxnode - 1 bits of the mask.
+            const int mode = policy_ == numa_policy::bind ? 2 : 3;
+            const auto mask = static_cast<unsigned long>(nodes_);
+            syscall(SYS_mbind, address, size, mode, &mask, 8 * sizeof(mask) + 1, 0);
+          }
+#endif
+
+          return static_cast<T*>(address);
+        }
+#endif
+
+        return static_cast<T*>(::operator new(bytes, std::align_val_t{alignof(T)}));
+      }
+
+      void deallocate(T* pointer, std::size_t count) noexcept
+      {
+        const auto bytes = count * sizeof(T);
+
+#if defined(__linux__)
+        if(bytes >= min_mapping)
+        {
+          munmap(pointer, mapping_size(bytes));
+          return;
+        }
+#endif
+
+        ::operator delete(pointer, std::align_val_t{alignof(T)});
+      }
+
+      template<typename U>
+      void construct(U* pointer) noexcept(std::is_nothrow_default_constructible<U>::value)
+      {
+        ::new(static_cast<void*>(pointer)) U;
+      }
+
+      template<typename U, typename... Args>
+      void construct(U* pointer, Args&&... args)
+      {
+        ::new(static_cast<void*>(pointer)) U(std::forward<Args>(args)...);
+      }
+
+      template<typename U>
+      bool operator==(const numa_allocator<U>& other) const noexcept
+      {
+        return policy_ == other.policy() && nodes_ == other.nodes() && huge_pages_ == other.huge_pages();
+      }
+
+      template<typename U>
+      bool operator!=(const numa_allocator<U>& other) const noexcept
+      {
+        return !(*this == other);
+      }
+
+    private:
+      std::size_t mapping_size(std::size_t bytes) const noexcept
+      {
+        const auto unit = huge_pages_ ? huge_page_size : std::size_t{4096};
+        return (bytes + unit - 1) / unit * unit;
+      }
+
+#if defined(__linux__)
+      // With huge pages the mapping starts on a huge page boundary, which only recent kernels do by
+      // themselves; elsewhere madvise would only cover the aligned interior. One huge page more is
+      // mapped and the unaligned head and the rest of the tail are unmapped again, so exactly
+      // [result, result + size) stays mapped.
+      void* map_aligned(std::size_t size) const
+      {
+        const auto extra = huge_pages_ ? huge_page_size : std::size_t{0};
+        auto* const address = mmap(nullptr, size + extra, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+        if(address == MAP_FAILED)
+          throw std::bad_alloc{};
+
+        if(extra == 0)
+          return address;
+
+        const auto start = reinterpret_cast<std::uintptr_t>(address);
+        const auto aligned = (start + huge_page_size - 1) / huge_page_size * huge_page_size;
+        const auto head = aligned - start;
+
+        if(head > 0)
+          munmap(address, head);
+
+        if(extra - head > 0)
+          munmap(reinterpret_cast<void*>(aligned + size), extra - head);
+
+        return reinterpret_cast<void*>(aligned);
+      }
+#endif
+
+      numa_policy policy_ = numa_policy::first_touch;
+      std::uint64_t nodes_ = 1;
+      bool huge_pages_ = true;
+    };
+
+    template<typename T>
+    using numa_vector = std::vector<T, numa_allocator<T>>;
+
+    // Writes value to [data, data + count) in parallel, split exactly as parallel_for splits the range
+    // for the same thread count, so under numa_policy::first_touch every part's pages land on the node
+    // of the thread that later processes that part. Threads are not pinned, so this relies on the
+    // scheduler keeping them on their nodes; bind or interleave do not.
+    template<typename T>
+    void first_touch(T* data, std::size_t count, const T& value = T{}, std::size_t threads = thread_count())
+    {
+      parallel_for(0, count, [&](std::size_t first, std::size_t last)
+      {
+        for(auto index = first; index < last; ++index)
+        {
+          data[index] = value;
+        }
+      }, threads);
+    }
+
+    template<typename T>
+    void first_touch(numa_vector<T>& values, const T& value = T{}, std::size_t threads = thread_count())
+    {
+      first_touch(values.data(), values.size(), value, threads);
+    }
+  }
+}
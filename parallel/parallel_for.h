@@ -0,0 +1,97 @@
+//
+// Copyright © 2017 Constanze Pfennig. All rights reserved.
+//
+
+#pragma once
+
+#include <cstddef>
+#include <algorithm>
+#include <exception>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <vector>
+
+
+namespace nuts
+{
+  namespace parallel
+  {
+    inline std::size_t thread_count() noexcept
+    {
+      const auto count = std::thread::hardware_concurrency();
+      return count != 0 ? count : 1;
+    }
+
+    // Range of the part with the given index when [first, last) is split into parts of nearly equal size.
+    // The split only depends on the arguments, so repeated calls hand the same range to the same part.
+    inline std::pair<std::size_t, std::size_t> partition(std::size_t first, std::size_t last, std::size_t parts, std::size_t index) noexcept
+    {
+      const auto count = last - first;
+      const auto base = count / parts;
+      const auto remainder = count % parts;
+
+      const auto begin = first + index * base + std::min(index, remainder);
+      return {begin, begin + base + (index < remainder ? 1 : 0)};
+    }
+
+    // Calls function(begin, end) for consecutive parts of [first, last), one part per thread.
+    // The calling thread processes the first part. The first exception thrown by any part is rethrown.
+    template<typename Function>
+    void parallel_for(std::size_t first, std::size_t last, Function&& function, std::size_t threads = thread_count())
+    {
+      if(first >= last)
+        return;
+
+      const auto parts = std::max<std::size_t>(std::min(threads, last - first), 1);
+
+      if(parts == 1)
+      {
+        function(first, last);
+        return;
+      }
+
+      std::vector<std::exception_ptr> exceptions(parts);
+      std::vector<std::thread> workers;
+      workers.reserve(parts - 1);
+
+      const auto run = [&](std::size_t index)
+      {
+        try
+        {
+          const auto range = partition(first, last, parts, index);
+          function(range.first, range.second);
+        }
+        catch(...)
+        {
+          exceptions[index] = std::current_exception();
+        }
+      };
+
+      for(std::size_t index = 1; index < parts; ++index)
+      {
+        try
+        {
+          workers.emplace_back(run, index);
+        }
+        catch(const std::system_error&)
+        {
+          run(index);
+        }
+      }
+
+      run(0);
+
+      for(auto& worker : workers)
+      {
+        worker.join();
+      }
+
+      for(auto& exception : exceptions)
+      {
+        if(exception)
+          std::rethrow_exception(exception);
+      }
+    }
+  }
+}
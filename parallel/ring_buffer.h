@@ -0,0 +1,327 @@
+//
+// Copyright © 2017 Constanze Pfennig. All rights reserved.
+//
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+
+
+namespace nuts
+{
+  namespace parallel
+  {
+    // Assumed size of a cache line; indices written by different threads are kept this far apart.
+    constexpr std::size_t cache_line_size = 64;
+
+    namespace detail
+    {
+      inline std::size_t ring_capacity(std::size_t capacity) noexcept
+      {
+        assert(capacity > 0);
+
+        std::size_t result = 1;
+
+        while(result < capacity)
+        {
+          result <<= 1;
+        }
+
+        return result;
+      }
+    }
+
+
+    // Bounded lock-free queue for exactly one producer and one consumer thread. The capacity is rounded
+    // up to a power of two. Each side owns one index on its own cache line and keeps a cached copy of the
+    // other side's index, so it only reads the shared one when the cached copy says full or empty.
+    // Bulk operations move as many values as fit in one index update.
+    template<typename T>
+    class spsc_ring_buffer
+    {
+    public:
+      using size_type = std::size_t;
+      using value_type = T;
+
+      explicit spsc_ring_buffer(size_type capacity)
+        : capacity_(detail::ring_capacity(capacity)),
+          values_(new T[capacity_])
+      {
+      }
+
+      spsc_ring_buffer(const spsc_ring_buffer&) = delete;
+      spsc_ring_buffer& operator=(const spsc_ring_buffer&) = delete;
+
+      size_type capacity() const noexcept
+      {
+        return capacity_;
+      }
+
+      // Number of queued values; exact only when neither side is active. The consumer index is loaded
+      // first: the producer index, loaded after it, can only be ahead of it, so the difference never wraps.
+      size_type size() const noexcept
+      {
+        const auto consumer = consumer_.index.load(std::memory_order_acquire);
+        return producer_.index.load(std::memory_order_acquire) - consumer;
+      }
+
+      bool empty() const noexcept
+      {
+        return size() == 0;
+      }
+
+      // Producer side.
+      template<typename Value>
+      bool try_push(Value&& value)
+      {
+        const auto tail = producer_.index.load(std::memory_order_relaxed);
+
+        if(tail - producer_.other == capacity_)
+        {
+          producer_.other = consumer_.index.load(std::memory_order_acquire);
+
+          if(tail - producer_.other == capacity_)
+            return false;
+        }
+
+        values_[tail & (capacity_ - 1)] = std::forward<Value>(value);
+        producer_.index.store(tail + 1, std::memory_order_release);
+        return true;
+      }
+
+      // Copies up to count values and returns how many were queued.
+      size_type try_push(const T* values, size_type count)
+      {
+        const auto tail = producer_.index.load(std::memory_order_relaxed);
+
+        if(capacity_ - (tail - producer_.other) < count)
+          producer_.other = consumer_.index.load(std::memory_order_acquire);
+
+        const auto pushed = std::min(count, capacity_ - (tail - producer_.other));
+
+        for(size_type index = 0; index < pushed; ++index)
+        {
+          values_[(tail + index) & (capacity_ - 1)] = values[index];
+        }
+
+        if(pushed > 0)
+          producer_.index.store(tail + pushed, std::memory_order_release);
+
+        return pushed;
+      }
+
+      // Consumer side.
+      bool try_pop(T& value)
+      {
+        const auto head = consumer_.index.load(std::memory_order_relaxed);
+
+        if(head == consumer_.other)
+        {
+          consumer_.other = producer_.index.load(std::memory_order_acquire);
+
+          if(head == consumer_.other)
+            return false;
+        }
+
+        value = std::move(values_[head & (capacity_ - 1)]);
+        consumer_.index.store(head + 1, std::memory_order_release);
+        return true;
+      }
+
+      // Moves up to count values out and returns how many were dequeued.
+      size_type try_pop(T* values, size_type count)
+      {
+        const auto head = consumer_.index.load(std::memory_order_relaxed);
+
+        if(consumer_.other - head < count)
+          consumer_.other = producer_.index.load(std::memory_order_acquire);
+
+        const auto popped = std::min(count, consumer_.other - head);
+
+        for(size_type index = 0; index < popped; ++index)
+        {
+          values[index] = std::move(values_[(head + index) & (capacity_ - 1)]);
+        }
+
+        if(popped > 0)
+          consumer_.index.store(head + popped, std::memory_order_release);
+
+        return popped;
+      }
+
+    private:
+      // The index a side advances and its cached copy of the opposite index.
+      struct alignas(cache_line_size) side
+      {
+        std::atomic<size_type> index{0};
+        size_type other = 0;
+      };
+
+      size_type capacity_;
+      std::unique_ptr<T[]> values_;
+      side producer_;
+      side consumer_;
+    };
+
+
+    // Bounded lock-free queue for any number of producers and consumers (Vyukov). Every cell carries a
+    // sequence number telling whether it is free for the producer or filled for the consumer of a
+    // given lap, so a thread claims cells with one compare-and-swap on the shared index and publishes
+    // them through their sequence numbers. Bulk operations claim a run of consecutive ready cells at once.
+    template<typename T>
+    class mpmc_ring_buffer
+    {
+    public:
+      using size_type = std::size_t;
+      using value_type = T;
+
+      explicit mpmc_ring_buffer(size_type capacity)
+        : capacity_(detail::ring_capacity(capacity)),
+          cells_(new cell[capacity_])
+      {
+        for(size_type index = 0; index < capacity_; ++index)
+        {
+          cells_[index].sequence.store(index, std::memory_order_relaxed);
+        }
+      }
+
+      mpmc_ring_buffer(const mpmc_ring_buffer&) = delete;
+      mpmc_ring_buffer& operator=(const mpmc_ring_buffer&) = delete;
+
+      size_type capacity() const noexcept
+      {
+        return capacity_;
+      }
+
+      // Number of claimed but not yet dequeued cells; exact only when no thread is active.
+      size_type size() const noexcept
+      {
+        const auto head = head_.load(std::memory_order_acquire);
+        const auto tail = tail_.load(std::memory_order_acquire);
+        return tail > head ? tail - head : 0;
+      }
+
+      bool empty() const noexcept
+      {
+        return size() == 0;
+      }
+
+      template<typename Value>
+      bool try_push(Value&& value)
+      {
+        const auto claimed = claim(tail_, 0, 1);
+
+        if(claimed.second == 0)
+          return false;
+
+        auto& target = cells_[claimed.first & (capacity_ - 1)];
+        target.value = std::forward<Value>(value);
+        target.sequence.store(claimed.first + 1, std::memory_order_release);
+        return true;
+      }
+
+      // Copies up to count values into consecutive cells and returns how many were queued.
+      size_type try_push(const T* values, size_type count)
+      {
+        const auto claimed = claim(tail_, 0, count);
+
+        for(size_type index = 0; index < claimed.second; ++index)
+        {
+          auto& target = cells_[(claimed.first + index) & (capacity_ - 1)];
+          target.value = values[index];
+          target.sequence.store(claimed.first + index + 1, std::memory_order_release);
+        }
+
+        return claimed.second;
+      }
+
+      bool try_pop(T& value)
+      {
+        const auto claimed = claim(head_, 1, 1);
+
+        if(claimed.second == 0)
+          return false;
+
+        auto& source = cells_[claimed.first & (capacity_ - 1)];
+        value = std::move(source.value);
+        source.sequence.store(claimed.first + capacity_, std::memory_order_release);
+        return true;
+      }
+
+      // Moves up to count values out of consecutive cells and returns how many were dequeued.
+      size_type try_pop(T* values, size_type count)
+      {
+        const auto claimed = claim(head_, 1, count);
+
+        for(size_type index = 0; index < claimed.second; ++index)
+        {
+          auto& source = cells_[(claimed.first + index) & (capacity_ - 1)];
+          values[index] = std::move(source.value);
+          source.sequence.store(claimed.first + index + capacity_, std::memory_order_release);
+        }
+
+        return claimed.second;
+      }
+
+    private:
+      struct cell
+      {
+        std::atomic<size_type> sequence;
+        T value;
+      };
+
+      // Advances position over up to count cells whose sequence equals position + lag, that is free cells
+      // for producers (lag 0) or filled ones for consumers (lag 1). A ready cell stays ready until its
+      // position is claimed, so the cells counted before the compare-and-swap are still ready after it.
+      // Returns the first claimed position and the number of cells claimed.
+      std::pair<size_type, size_type> claim(std::atomic<size_type>& position, size_type lag, size_type count)
+      {
+        auto first = position.load(std::memory_order_relaxed);
+
+        while(count > 0)
+        {
+          size_type ready = 0;
+
+          for(; ready < count; ++ready)
+          {
+            const auto sequence = cells_[(first + ready) & (capacity_ - 1)].sequence.load(std::memory_order_acquire);
+
+            if(sequence != first + ready + lag)
+              break;
+          }
+
+          if(ready > 0)
+          {
+            if(position.compare_exchange_weak(first, first + ready, std::memory_order_relaxed))
+              return {first, ready};
+
+            continue;
+          }
+
+          // The first cell is behind: full for producers or empty for consumers. Ahead means another
+          // thread claimed it meanwhile.
+          const auto sequence = cells_[first & (capacity_ - 1)].sequence.load(std::memory_order_acquire);
+          const auto difference = static_cast<std::ptrdiff_t>(sequence - (first + lag));
+
+          if(difference < 0)
+            return {first, 0};
+
+          first = position.load(std::memory_order_relaxed);
+        }
+
+        return {first, 0};
+      }
+
+      size_type capacity_;
+      std::unique_ptr<cell[]> cells_;
+      alignas(cache_line_size) std::atomic<size_type> tail_{0};
+      alignas(cache_line_size) std::atomic<size_type> head_{0};
+    };
+  }
+}
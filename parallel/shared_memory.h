@@ -0,0 +1,339 @@
+//
+// Copyright © 2017 Constanze Pfennig. All rights reserved.
+//
+
+#pragma once
+
+#include "../math/vector.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+// Shared memory between processes on POSIX systems. Failing system calls throw std::system_error
+// with the errno of the call.
+
+namespace nuts
+{
+  namespace parallel
+  {
+    // A mapping of a named POSIX shared memory object or an anonymous memfd. The creator of a named
+    // object unlinks its name again when destroyed; mappings in other processes stay valid until unmapped.
+    class shared_memory
+    {
+    public:
+      using size_type = std::size_t;
+
+      shared_memory() = default;
+
+      shared_memory(shared_memory&& other) noexcept
+      {
+        swap(other);
+      }
+
+      shared_memory& operator=(shared_memory&& other) noexcept
+      {
+        shared_memory{std::move(other)}.swap(*this);
+        return *this;
+      }
+
+      ~shared_memory()
+      {
+        if(data_ != nullptr)
+          munmap(data_, size_);
+
+        if(descriptor_ >= 0)
+          close(descriptor_);
+
+        if(!unlink_name_.empty())
+          shm_unlink(unlink_name_.c_str());
+      }
+
+      // Creates the named object ("/name") with size zeroed bytes; fails if it exists.
+      static shared_memory create(const std::string& name, size_type size)
+      {
+        shared_memory result;
+        result.descriptor_ = check(shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600), "shm_open");
+        result.unlink_name_ = name;
+        result.map(size, true);
+        return result;
+      }
+
+      // Maps an object another process created, at its full size.
+      static shared_memory open(const std::string& name)
+      {
+        shared_memory result;
+        result.descriptor_ = check(shm_open(name.c_str(), O_RDWR, 0), "shm_open");
+        result.map(result.file_size(), false);
+        return result;
+      }
+
+#if defined(__linux__)
+      // Creates an anonymous object, shared with child processes or by passing file_descriptor() over
+      // a Unix socket. The name only shows up in /proc for debugging.
+      static shared_memory create_anonymous(const std::string& name, size_type size)
+      {
+        shared_memory result;
+        result.descriptor_ = check(memfd_create(name.c_str(), MFD_CLOEXEC), "memfd_create");
+        result.map(size, true);
+        return result;
+      }
+#endif
+
+      // Maps the object behind a received descriptor, which is duplicated.
+      static shared_memory from_file_descriptor(int descriptor)
+      {
+        shared_memory result;
+        result.descriptor_ = check(dup(descriptor), "dup");
+        result.map(result.file_size(), false);
+        return result;
+      }
+
+      void* data() const noexcept
+      {
+        return data_;
+      }
+
+      size_type size() const noexcept
+      {
+        return size_;
+      }
+
+      int file_descriptor() const noexcept
+      {
+        return descriptor_;
+      }
+
+      void swap(shared_memory& other) noexcept
+      {
+        std::swap(data_, other.data_);
+        std::swap(size_, other.size_);
+        std::swap(descriptor_, other.descriptor_);
+        std::swap(unlink_name_, other.unlink_name_);
+      }
+
+    private:
+      static int check(int result, const char* call)
+      {
+        if(result < 0)
+          throw std::system_error{errno, std::generic_category(), call};
+
+        return result;
+      }
+
+      size_type file_size() const
+      {
+        struct stat status;
+        check(fstat(descriptor_, &status), "fstat");
+        return static_cast<size_type>(status.st_size);
+      }
+
+      void map(size_type size, bool resize)
+      {
+        assert(size > 0);
+
+        if(resize)
+          check(ftruncate(descriptor_, static_cast<off_t>(size)), "ftruncate");
+
+        const auto address = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, descriptor_, 0);
+
+        if(address == MAP_FAILED)
+          throw std::system_error{errno, std::generic_category(), "mmap"};
+
+        data_ = address;
+        size_ = size;
+      }
+
+      void* data_ = nullptr;
+      size_type size_ = 0;
+      int descriptor_ = -1;
+      std::string unlink_name_;
+    };
+
+
+    // An array of vectors in shared memory behind a header with a sequence lock, for one writing and any
+    // number of reading processes. The writer makes the sequence odd, writes the vectors in place and
+    // makes it even again; a reader works on the vectors directly and afterwards checks that the sequence
+    // was even and unchanged, retrying otherwise. Neither side copies through a pipe or serializes.
+    template<typename T, std::size_t Dimension>
+    class shared_vector_array
+    {
+    public:
+      using size_type = std::size_t;
+      using value_type = math::vector<T, Dimension>;
+
+      static_assert(std::is_trivially_copyable<value_type>::value, "Shared vectors must be trivially copyable.");
+      static_assert(std::atomic<std::uint64_t>::is_always_lock_free, "The sequence lock needs a lock-free 64 bit atomic.");
+
+      // Bytes needed for capacity vectors including the header.
+      static constexpr size_type required_size(size_type capacity) noexcept
+      {
+        return sizeof(header) + capacity * sizeof(value_type);
+      }
+
+      // Lays out a new array in memory, which must hold required_size(capacity) bytes.
+      static shared_vector_array create(shared_memory&& memory, size_type capacity)
+      {
+        assert(memory.size() >= required_size(capacity));
+
+        auto* const target = new(memory.data()) header;
+        target->magic = magic;
+        target->element_size = sizeof(value_type);
+        target->dimension = Dimension;
+        target->capacity = capacity;
+        target->count = 0;
+        target->sequence.store(0, std::memory_order_release);
+
+        return shared_vector_array{std::move(memory), capacity};
+      }
+
+      // Attaches to an array laid out by create in another process. The region comes from outside, so
+      // it is validated: a foreign layout or one that does not fit into the mapping throws
+      // std::system_error with std::errc::invalid_argument. The capacity is read once here, so a later
+      // change to the header cannot make accesses leave the mapping.
+      static shared_vector_array attach(shared_memory&& memory)
+      {
+        if(memory.size() < sizeof(header))
+          throw std::system_error{std::make_error_code(std::errc::invalid_argument), "shared_vector_array: region smaller than the header"};
+
+        const auto* const source = static_cast<const header*>(memory.data());
+
+        if(source->magic != magic || source->element_size != sizeof(value_type) || source->dimension != Dimension)
+          throw std::system_error{std::make_error_code(std::errc::invalid_argument), "shared_vector_array: foreign or mismatched layout"};
+
+        // Compared by division, since a foreign capacity could overflow required_size.
+        if(source->capacity > (memory.size() - sizeof(header)) / sizeof(value_type))
+          throw std::system_error{std::make_error_code(std::errc::invalid_argument), "shared_vector_array: region truncated"};
+
+        const auto capacity = static_cast<size_type>(source->capacity);
+        return shared_vector_array{std::move(memory), capacity};
+      }
+
+      const shared_memory& memory() const noexcept
+      {
+        return memory_;
+      }
+
+      size_type capacity() const noexcept
+      {
+        return capacity_;
+      }
+
+      // Number of completed publications, which readers can compare to skip unchanged data.
+      std::uint64_t version() const noexcept
+      {
+        return get_header().sequence.load(std::memory_order_acquire) / 2;
+      }
+
+      // Writer: fill(data, capacity) writes the new vectors in place and returns their count.
+      template<typename Fill>
+      void write(Fill&& fill)
+      {
+        auto& target = get_header();
+        const auto sequence = target.sequence.load(std::memory_order_relaxed);
+
+        target.sequence.store(sequence + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        const size_type count = fill(values(), capacity());
+        assert(count <= capacity());
+        target.count = count;
+
+        target.sequence.store(sequence + 2, std::memory_order_release);
+      }
+
+      // Throws std::length_error, before anything is written, for more than capacity() vectors.
+      void publish(const value_type* vectors, size_type count)
+      {
+        if(count > capacity())
+          throw std::length_error{"shared_vector_array: more vectors than capacity"};
+
+        write([&](value_type* data, size_type)
+        {
+          std::memcpy(static_cast<void*>(data), vectors, count * sizeof(value_type));
+          return count;
+        });
+      }
+
+      // Reader: calls use(data, count) on the vectors in shared memory and returns whether they were
+      // consistent; use must be prepared to see torn data when false is returned.
+      template<typename Use>
+      bool try_read(Use&& use) const
+      {
+        const auto& source = get_header();
+        const auto sequence = source.sequence.load(std::memory_order_acquire);
+
+        if(sequence % 2 != 0)
+          return false;
+
+        const auto count = std::min(static_cast<size_type>(source.count), capacity());
+        use(static_cast<const value_type*>(values()), count);
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return source.sequence.load(std::memory_order_relaxed) == sequence;
+      }
+
+      // Copies out a consistent snapshot, retrying while the writer is active.
+      void read(std::vector<value_type>& result) const
+      {
+        while(!try_read([&](const value_type* data, size_type count)
+        {
+          result.resize(count);
+          std::memcpy(static_cast<void*>(result.data()), data, count * sizeof(value_type));
+        }))
+        {
+        }
+      }
+
+    private:
+      static constexpr std::uint64_t magic = 0x7374756e76656373; // "scevnuts"
+
+      // Padded to a cache line, so the vectors start aligned and apart from the sequence.
+      struct alignas(64) header
+      {
+        std::uint64_t magic;
+        std::uint64_t element_size;
+        std::uint64_t dimension;
+        std::uint64_t capacity;
+        std::uint64_t count;
+        std::atomic<std::uint64_t> sequence;
+      };
+
+      shared_vector_array(shared_memory&& memory, size_type capacity)
+        : memory_(std::move(memory)),
+          capacity_(capacity)
+      {
+      }
+
+      header& get_header() const noexcept
+      {
+        return *static_cast<header*>(memory_.data());
+      }
+
+      value_type* values() const noexcept
+      {
+        return reinterpret_cast<value_type*>(static_cast<char*>(memory_.data()) + sizeof(header));
+      }
+
+      shared_memory memory_;
+      size_type capacity_;
+    };
+  }
+}
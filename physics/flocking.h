@@ -0,0 +1,403 @@
+//
+// Copyright © 2017 Constanze Pfennig. All rights reserved.
+//
+
+#pragma once
+
+#include "../math/vector.h"
+#include "../parallel/parallel_for.h"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <random>
+#include <vector>
+
+
+namespace nuts
+{
+  namespace physics
+  {
+    struct flocking_settings
+    {
+      // Agents within radius are neighbours; it is also the minimum cell size of the grid.
+      float radius = 1.f;
+      float separation_radius = 0.35f;
+      float separation = 1.5f;
+      float alignment = 1.f;
+      float cohesion = 1.f;
+      float max_speed = 2.f;
+      // Edge of the periodic box the agents live in, at least three times the radius.
+      float world_size = 32.f;
+    };
+
+
+    // Reynolds boids in 2 or 3 dimensions inside a periodic box. Positions and velocities are stored per
+    // axis. Every step hashes the agents' cells into a table of about twice as many buckets as agents and
+    // counting sorts them by bucket, so the agents of a cell are contiguous in the sorted copies and the
+    // neighbour search only scans the 3^Dimension buckets around an agent. Velocities are double
+    // buffered, so a step gives the same result for any thread count.
+    template<std::size_t Dimension>
+    class flock
+    {
+      static_assert(Dimension == 2 || Dimension == 3, "Flocks are 2- or 3-dimensional.");
+
+    public:
+      using size_type = std::size_t;
+      using vector_type = math::vector<float, Dimension>;
+
+      explicit flock(const flocking_settings& settings = flocking_settings{})
+        : settings_(settings)
+      {
+        assert(settings.radius > 0.f && settings.world_size >= 3.f * settings.radius);
+      }
+
+      const flocking_settings& settings() const noexcept
+      {
+        return settings_;
+      }
+
+      size_type size() const noexcept
+      {
+        return positions_[0].size();
+      }
+
+      void add(const vector_type& position, const vector_type& velocity)
+      {
+        for(size_type axis = 0; axis < Dimension; ++axis)
+        {
+          positions_[axis].push_back(position[axis]);
+          velocities_[axis].push_back(velocity[axis]);
+        }
+      }
+
+      vector_type position(size_type agent) const
+      {
+        vector_type result;
+
+        for(size_type axis = 0; axis < Dimension; ++axis)
+        {
+          result[axis] = positions_[axis][agent];
+        }
+
+        return result;
+      }
+
+      vector_type velocity(size_type agent) const
+      {
+        vector_type result;
+
+        for(size_type axis = 0; axis < Dimension; ++axis)
+        {
+          result[axis] = velocities_[axis][agent];
+        }
+
+        return result;
+      }
+
+      void step(float dt, size_type threads = parallel::thread_count())
+      {
+        if(size() == 0)
+          return;
+
+        build_grid(threads);
+
+        const auto radius2 = settings_.radius * settings_.radius;
+        const auto separation_radius2 = settings_.separation_radius * settings_.separation_radius;
+        const auto world = settings_.world_size;
+
+        parallel::parallel_for(0, size(), [&](size_type first, size_type last)
+        {
+          std::array<std::uint32_t, neighbour_cells> buckets;
+
+          for(auto sorted = first; sorted < last; ++sorted)
+          {
+            std::array<float, Dimension> position;
+            std::array<float, Dimension> velocity;
+            std::array<int, Dimension> cell;
+
+            for(size_type axis = 0; axis < Dimension; ++axis)
+            {
+              position[axis] = sorted_positions_[axis][sorted];
+              velocity[axis] = sorted_velocities_[axis][sorted];
+              cell[axis] = cell_coordinate(position[axis]);
+            }
+
+            // Neighbouring cells may share a bucket; every bucket is scanned once.
+            size_type bucket_count = 0;
+
+            for(size_type offset = 0; offset < neighbour_cells; ++offset)
+            {
+              auto neighbour = cell;
+              auto rest = offset;
+
+              for(size_type axis = 0; axis < Dimension; ++axis, rest /= 3)
+              {
+                neighbour[axis] = wrap_cell(neighbour[axis] + static_cast<int>(rest % 3) - 1);
+              }
+
+              const auto bucket = hash(neighbour);
+              bool seen = false;
+
+              for(size_type index = 0; index < bucket_count; ++index)
+              {
+                seen = seen || buckets[index] == bucket;
+              }
+
+              if(!seen)
+                buckets[bucket_count++] = bucket;
+            }
+
+            std::array<float, Dimension> center{};
+            std::array<float, Dimension> heading{};
+            std::array<float, Dimension> separation{};
+            size_type neighbours = 0;
+
+            for(size_type index = 0; index < bucket_count; ++index)
+            {
+              for(auto other = bucket_start_[buckets[index]]; other < bucket_start_[buckets[index] + 1]; ++other)
+              {
+                if(other == sorted)
+                  continue;
+
+                std::array<float, Dimension> offset;
+                float distance2 = 0.f;
+
+                for(size_type axis = 0; axis < Dimension; ++axis)
+                {
+                  auto difference = sorted_positions_[axis][other] - position[axis];
+                  difference -= difference > 0.5f * world ? world : (difference < -0.5f * world ? -world : 0.f);
+                  offset[axis] = difference;
+                  distance2 += difference * difference;
+                }
+
+                if(distance2 >= radius2)
+                  continue;
+
+                ++neighbours;
+
+                for(size_type axis = 0; axis < Dimension; ++axis)
+                {
+                  center[axis] += offset[axis];
+                  heading[axis] += sorted_velocities_[axis][other];
+
+                  if(distance2 < separation_radius2 && distance2 > 0.f)
+                    separation[axis] -= offset[axis] / distance2;
+                }
+              }
+            }
+
+            float speed2 = 0.f;
+
+            for(size_type axis = 0; axis < Dimension; ++axis)
+            {
+              if(neighbours > 0)
+              {
+                const auto scale = 1.f / static_cast<float>(neighbours);
+                const auto steering = settings_.separation * separation[axis] + settings_.alignment * (heading[axis] * scale - velocity[axis])
+                  + settings_.cohesion * center[axis] * scale;
+
+                velocity[axis] += steering * dt;
+              }
+
+              speed2 += velocity[axis] * velocity[axis];
+            }
+
+            const auto speed_scale = speed2 > settings_.max_speed * settings_.max_speed ? settings_.max_speed / std::sqrt(speed2) : 1.f;
+            const auto agent = order_[sorted];
+
+            for(size_type axis = 0; axis < Dimension; ++axis)
+            {
+              velocities_[axis][agent] = velocity[axis] * speed_scale;
+
+              auto moved = position[axis] + velocities_[axis][agent] * dt;
+              moved -= world * std::floor(moved / world);
+              positions_[axis][agent] = moved < world ? moved : 0.f;
+            }
+          }
+        }, threads);
+      }
+
+    private:
+      static constexpr size_type neighbour_cells = Dimension == 2 ? 9 : 27;
+
+      int cell_coordinate(float coordinate) const noexcept
+      {
+        return std::min(static_cast<int>(coordinate * cell_scale_), cells_ - 1);
+      }
+
+      int wrap_cell(int cell) const noexcept
+      {
+        return cell < 0 ? cell + cells_ : (cell >= cells_ ? cell - cells_ : cell);
+      }
+
+      std::uint32_t hash(const std::array<int, Dimension>& cell) const noexcept
+      {
+        constexpr std::uint32_t primes[3] = {73856093u, 19349663u, 83492791u};
+        std::uint32_t result = 0;
+
+        for(size_type axis = 0; axis < Dimension; ++axis)
+        {
+          result ^= static_cast<std::uint32_t>(cell[axis]) * primes[axis];
+        }
+
+        return result & bucket_mask_;
+      }
+
+      // Counting sort of the agents by bucket into the sorted copies.
+      void build_grid(size_type threads)
+      {
+        const auto count = size();
+
+        cells_ = std::max(static_cast<int>(settings_.world_size / settings_.radius), 3);
+        cell_scale_ = static_cast<float>(cells_) / settings_.world_size;
+
+        std::uint32_t buckets = 1;
+
+        while(buckets < 2 * count)
+        {
+          buckets <<= 1;
+        }
+
+        bucket_mask_ = buckets - 1;
+        bucket_of_.resize(count);
+
+        parallel::parallel_for(0, count, [&](size_type first, size_type last)
+        {
+          for(auto agent = first; agent < last; ++agent)
+          {
+            std::array<int, Dimension> cell;
+
+            for(size_type axis = 0; axis < Dimension; ++axis)
+            {
+              cell[axis] = cell_coordinate(positions_[axis][agent]);
+            }
+
+            bucket_of_[agent] = hash(cell);
+          }
+        }, threads);
+
+        bucket_start_.assign(buckets + 1, 0);
+
+        for(auto bucket : bucket_of_)
+        {
+          ++bucket_start_[bucket + 1];
+        }
+
+        for(std::uint32_t bucket = 0; bucket < buckets; ++bucket)
+        {
+          bucket_start_[bucket + 1] += bucket_start_[bucket];
+        }
+
+        // Scatter in agent order through a running cursor per bucket, which keeps the sort stable.
+        std::vector<std::uint32_t> cursor(bucket_start_.begin(), bucket_start_.end() - 1);
+        order_.resize(count);
+
+        for(size_type agent = 0; agent < count; ++agent)
+        {
+          order_[cursor[bucket_of_[agent]]++] = static_cast<std::uint32_t>(agent);
+        }
+
+        for(size_type axis = 0; axis < Dimension; ++axis)
+        {
+          sorted_positions_[axis].resize(count);
+          sorted_velocities_[axis].resize(count);
+        }
+
+        parallel::parallel_for(0, count, [&](size_type first, size_type last)
+        {
+          for(size_type axis = 0; axis < Dimension; ++axis)
+          {
+            for(auto sorted = first; sorted < last; ++sorted)
+            {
+              sorted_positions_[axis][sorted] = positions_[axis][order_[sorted]];
+              sorted_velocities_[axis][sorted] = velocities_[axis][order_[sorted]];
+            }
+          }
+        }, threads);
+      }
+
+      flocking_settings settings_;
+      std::array<std::vector<float>, Dimension> positions_;
+      std::array<std::vector<float>, Dimension> velocities_;
+
+      int cells_ = 0;
+      float cell_scale_ = 0.f;
+      std::uint32_t bucket_mask_ = 0;
+      std::vector<std::uint32_t> bucket_of_;
+      std::vector<std::uint32_t> bucket_start_;
+      std::vector<std::uint32_t> order_;
+      std::array<std::vector<float>, Dimension> sorted_positions_;
+      std::array<std::vector<float>, Dimension> sorted_velocities_;
+    };
+
+    using flock2f = flock<2>;
+    using flock3f = flock<3>;
+
+
+    struct flocking_benchmark_result
+    {
+      std::size_t agents;
+      std::size_t threads;
+      double steps_per_second;
+    };
+
+    // Times steps of flocks of every agent count with every thread count. The box grows with the
+    // agent count to keep density agents per unit area or volume, so the neighbour work per agent
+    // stays the same and the results show how a step scales. Agents start at seeded random positions
+    // and velocities, and one untimed step warms up the buffers.
+    template<std::size_t Dimension>
+    std::vector<flocking_benchmark_result> benchmark_flocking(const std::vector<std::size_t>& agent_counts, const std::vector<std::size_t>& thread_counts,
+      std::size_t steps = 100, float density = 2.f, flocking_settings settings = flocking_settings{})
+    {
+      assert(density > 0.f && steps > 0);
+
+      std::vector<flocking_benchmark_result> results;
+
+      for(auto agents : agent_counts)
+      {
+        settings.world_size = std::max(std::pow(static_cast<float>(agents) / density, 1.f / static_cast<float>(Dimension)), 3.f * settings.radius);
+
+        for(auto threads : thread_counts)
+        {
+          flock<Dimension> boids{settings};
+          std::mt19937 random{1};
+          std::uniform_real_distribution<float> position{0.f, settings.world_size};
+          std::uniform_real_distribution<float> velocity{-settings.max_speed, settings.max_speed};
+
+          for(std::size_t agent = 0; agent < agents; ++agent)
+          {
+            typename flock<Dimension>::vector_type start;
+            typename flock<Dimension>::vector_type speed;
+
+            for(std::size_t axis = 0; axis < Dimension; ++axis)
+            {
+              start[axis] = position(random);
+              speed[axis] = velocity(random);
+            }
+
+            boids.add(start, speed);
+          }
+
+          const auto dt = 1.f / 60.f;
+          boids.step(dt, threads);
+
+          const auto begin = std::chrono::steady_clock::now();
+
+          for(std::size_t step = 0; step < steps; ++step)
+          {
+            boids.step(dt, threads);
+          }
+
+          const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - begin;
+          results.push_back({agents, threads, static_cast<double>(steps) / std::max(elapsed.count(), 1e-9)});
+        }
+      }
+
+      return results;
+    }
+  }
+}
@@ -0,0 +1,538 @@
+//
+// Copyright © 2017 Constanze Pfennig. All rights reserved.
+//
+
+#pragma once
+
+#include "../math/vector.h"
+#include "../math/simd.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+
+namespace nuts
+{
+  namespace physics
+  {
+    namespace detail
+    {
+      // Rotates vec by the unit quaternion (x, y, z, w).
+      inline math::vector3f rotate(const math::vector4f& rotation, const math::vector3f& vec)
+      {
+        const math::vector3f axis{rotation[0], rotation[1], rotation[2]};
+        return vec + math::cross(axis, math::cross(axis, vec) + vec * rotation[3]) * 2.f;
+      }
+
+      inline math::vector4f conjugate(const math::vector4f& rotation)
+      {
+        return math::vector4f{-rotation[0], -rotation[1], -rotation[2], rotation[3]};
+      }
+
+      // One velocity constraint row J v + bias = 0 with its impulse clamped to [lower, upper], or for
+      // friction rows to [-friction, friction] times the impulse of normal_row.
+      struct constraint_row
+      {
+        std::uint32_t body1;
+        std::uint32_t body2;
+        math::vector3f normal;
+        math::vector3f arm1;
+        math::vector3f arm2;
+        float bias;
+        float lower;
+        float upper;
+        float friction;
+        std::size_t normal_row;
+      };
+    }
+
+
+    // Rigid bodies stored per quantity (structure of arrays) and solved with sequential impulses
+    // (Catto, "Iterative Dynamics with Temporal Coherence"). Every constraint row is packed into a
+    // batch of four rows that share no dynamic body, so a batch is solved in the lanes of SSE registers
+    // at once: its body velocities are gathered, all four impulses computed and clamped together, and
+    // the velocities scattered back. Batches are solved one after the other, which keeps the
+    // Gauss-Seidel character of the scalar loop. Static bodies (mass 0) may appear in any number of lanes.
+    class rigid_body_world
+    {
+    public:
+      using size_type = std::size_t;
+      using body_index = std::uint32_t;
+
+      static constexpr size_type batch_width = 4;
+      static constexpr body_index invalid_body = std::numeric_limits<body_index>::max();
+
+      // Baumgarte factor: the fraction of the position error fed back into the velocities per step.
+      float baumgarte = 0.2f;
+      // Penetration tolerated without correction, against jitter of resting contacts.
+      float slop = 0.005f;
+
+      size_type body_count() const noexcept
+      {
+        return positions_.size();
+      }
+
+      // Adds a body with the given mass (0 for static) and principal moments of inertia along its local
+      // axes (0 for an axis it can not turn about).
+      body_index add_body(const math::vector3f& position, float mass, const math::vector3f& inertia,
+        const math::vector4f& orientation = math::vector4f{0.f, 0.f, 0.f, 1.f})
+      {
+        positions_.push_back(position);
+        orientations_.push_back(orientation);
+        linear_velocities_.push_back(math::vector3f{0.f, 0.f, 0.f});
+        angular_velocities_.push_back(math::vector3f{0.f, 0.f, 0.f});
+        inverse_masses_.push_back(mass > 0.f ? 1.f / mass : 0.f);
+
+        math::vector3f inverse_inertia{0.f, 0.f, 0.f};
+
+        for(size_type axis = 0; axis < 3; ++axis)
+        {
+          inverse_inertia[axis] = mass > 0.f && inertia[axis] > 0.f ? 1.f / inertia[axis] : 0.f;
+        }
+
+        inverse_inertias_.push_back(inverse_inertia);
+        return static_cast<body_index>(positions_.size() - 1);
+      }
+
+      std::vector<math::vector3f>& positions() noexcept
+      {
+        return positions_;
+      }
+
+      const std::vector<math::vector3f>& positions() const noexcept
+      {
+        return positions_;
+      }
+
+      // Orientations as unit quaternions (x, y, z, w).
+      std::vector<math::vector4f>& orientations() noexcept
+      {
+        return orientations_;
+      }
+
+      const std::vector<math::vector4f>& orientations() const noexcept
+      {
+        return orientations_;
+      }
+
+      std::vector<math::vector3f>& linear_velocities() noexcept
+      {
+        return linear_velocities_;
+      }
+
+      const std::vector<math::vector3f>& linear_velocities() const noexcept
+      {
+        return linear_velocities_;
+      }
+
+      std::vector<math::vector3f>& angular_velocities() noexcept
+      {
+        return angular_velocities_;
+      }
+
+      const std::vector<math::vector3f>& angular_velocities() const noexcept
+      {
+        return angular_velocities_;
+      }
+
+      void set_gravity(const math::vector3f& gravity) noexcept
+      {
+        gravity_ = gravity;
+      }
+
+      // Contact at point, with normal pointing from body2 to body1 and the penetration depth along it.
+      // Contacts only last for the next step, so collision detection adds them anew before every step.
+      void add_contact(body_index body1, body_index body2, const math::vector3f& point, const math::vector3f& normal, float penetration, float friction = 0.5f)
+      {
+        contacts_.push_back({body1, body2, point, normal, penetration, friction});
+      }
+
+      // Joins body1 and body2 at the world space anchor, letting them turn freely about it.
+      void add_ball_joint(body_index body1, body_index body2, const math::vector3f& anchor)
+      {
+        const auto local1 = detail::rotate(detail::conjugate(orientations_[body1]), anchor - positions_[body1]);
+        const auto local2 = detail::rotate(detail::conjugate(orientations_[body2]), anchor - positions_[body2]);
+        joints_.push_back({body1, body2, local1, local2});
+      }
+
+      size_type batch_count() const noexcept
+      {
+        return body1_.size() / batch_width;
+      }
+
+      void step(float dt, size_type iterations = 10)
+      {
+        for(size_type body = 0; body < body_count(); ++body)
+        {
+          if(inverse_masses_[body] > 0.f)
+            linear_velocities_[body] += gravity_ * dt;
+        }
+
+        build_rows(dt);
+        pack_batches();
+
+        for(size_type iteration = 0; iteration < iterations; ++iteration)
+        {
+          for(size_type batch = 0; batch < batch_count(); ++batch)
+          {
+            solve_batch(batch * batch_width);
+          }
+        }
+
+        // Semi-implicit Euler, with the orientation advanced by dq = 0.5 (w, 0) q dt.
+        for(size_type body = 0; body < body_count(); ++body)
+        {
+          positions_[body] += linear_velocities_[body] * dt;
+
+          const auto& w = angular_velocities_[body];
+          const auto& q = orientations_[body];
+          const math::vector3f axis{q[0], q[1], q[2]};
+          const auto spin = (axis * -1.f).dot(w);
+          const auto change = (w * q[3] + math::cross(w, axis)) * (0.5f * dt);
+
+          math::vector4f result{q[0] + change[0], q[1] + change[1], q[2] + change[2], q[3] + 0.5f * dt * spin};
+          orientations_[body] = result * (1.f / result.length());
+        }
+
+        contacts_.clear();
+      }
+
+    private:
+      struct contact
+      {
+        body_index body1;
+        body_index body2;
+        math::vector3f point;
+        math::vector3f normal;
+        float penetration;
+        float friction;
+      };
+
+      struct ball_joint
+      {
+        body_index body1;
+        body_index body2;
+        math::vector3f anchor1;
+        math::vector3f anchor2;
+      };
+
+      void build_rows(float dt)
+      {
+        rows_.clear();
+
+        const auto feedback = baumgarte / dt;
+        const auto infinity = std::numeric_limits<float>::max();
+
+        for(const auto& current : contacts_)
+        {
+          const auto arm1 = current.point - positions_[current.body1];
+          const auto arm2 = current.point - positions_[current.body2];
+          const auto normal_row = rows_.size();
+          const auto bias = -feedback * std::max(current.penetration - slop, 0.f);
+
+          rows_.push_back({current.body1, current.body2, current.normal, arm1, arm2, bias, 0.f, infinity, 0.f, normal_row});
+
+          // Two friction directions orthogonal to the normal.
+          const auto& n = current.normal;
+          const auto helper = std::abs(n[0]) < 0.57f ? math::vector3f{1.f, 0.f, 0.f} : math::vector3f{0.f, 1.f, 0.f};
+          auto tangent1 = math::cross(n, helper);
+          tangent1 = tangent1 * (1.f / tangent1.length());
+          const auto tangent2 = math::cross(n, tangent1);
+
+          rows_.push_back({current.body1, current.body2, tangent1, arm1, arm2, 0.f, 0.f, 0.f, current.friction, normal_row});
+          rows_.push_back({current.body1, current.body2, tangent2, arm1, arm2, 0.f, 0.f, 0.f, current.friction, normal_row});
+        }
+
+        for(const auto& joint : joints_)
+        {
+          const auto arm1 = detail::rotate(orientations_[joint.body1], joint.anchor1);
+          const auto arm2 = detail::rotate(orientations_[joint.body2], joint.anchor2);
+          const auto error = (positions_[joint.body1] + arm1) - (positions_[joint.body2] + arm2);
+
+          for(size_type axis = 0; axis < 3; ++axis)
+          {
+            math::vector3f direction{0.f, 0.f, 0.f};
+            direction[axis] = 1.f;
+            rows_.push_back({joint.body1, joint.body2, direction, arm1, arm2, feedback * error[axis], -infinity, infinity, 0.f, rows_.size()});
+          }
+        }
+      }
+
+      // Packs the rows greedily into the first of the recently opened batches that has a free lane and
+      // shares no dynamic body with them; leftover lanes stay empty.
+      void pack_batches()
+      {
+        constexpr size_type window = 16;
+
+        std::vector<std::array<std::uint32_t, batch_width>> lanes;
+        std::vector<size_type> used;
+        std::vector<size_type> lane_of(rows_.size());
+
+        const auto dynamic = [&](body_index body) { return inverse_masses_[body] > 0.f; };
+
+        for(size_type row = 0; row < rows_.size(); ++row)
+        {
+          const auto& current = rows_[row];
+          auto batch = lanes.size() > window ? lanes.size() - window : 0;
+
+          for(; batch < lanes.size(); ++batch)
+          {
+            if(used[batch] == batch_width)
+              continue;
+
+            bool conflict = false;
+
+            for(size_type lane = 0; lane < used[batch] && !conflict; ++lane)
+            {
+              const auto& other = rows_[lanes[batch][lane]];
+
+              for(auto body : {current.body1, current.body2})
+              {
+                conflict = conflict || (dynamic(body) && (body == other.body1 || body == other.body2));
+              }
+            }
+
+            if(!conflict)
+              break;
+          }
+
+          if(batch == lanes.size())
+          {
+            lanes.emplace_back();
+            used.push_back(0);
+          }
+
+          lane_of[row] = batch * batch_width + used[batch];
+          lanes[batch][used[batch]++] = static_cast<std::uint32_t>(row);
+        }
+
+        const auto size = lanes.size() * batch_width;
+
+        body1_.assign(size, invalid_body);
+        body2_.assign(size, invalid_body);
+        normal_row_.assign(size, 0);
+        impulse_.assign(size, 0.f);
+
+        for(auto field : {&normal_x_, &normal_y_, &normal_z_, &angular1_x_, &angular1_y_, &angular1_z_, &angular2_x_, &angular2_y_, &angular2_z_,
+          &inertia1_x_, &inertia1_y_, &inertia1_z_, &inertia2_x_, &inertia2_y_, &inertia2_z_, &inverse_mass1_, &inverse_mass2_, &effective_mass_,
+          &bias_, &lower_, &upper_, &friction_})
+        {
+          field->assign(size, 0.f);
+        }
+
+        // Angular Jacobians arm x normal and the angular velocity change per unit impulse, I^-1 (arm x normal).
+        const auto inverse_inertia = [&](body_index body, const math::vector3f& vec)
+        {
+          const auto& rotation = orientations_[body];
+          return detail::rotate(rotation, math::comp_mult(inverse_inertias_[body], detail::rotate(detail::conjugate(rotation), vec)));
+        };
+
+        for(size_type row = 0; row < rows_.size(); ++row)
+        {
+          const auto& current = rows_[row];
+          const auto slot = lane_of[row];
+
+          const auto angular1 = math::cross(current.arm1, current.normal);
+          const auto angular2 = math::cross(current.arm2, current.normal);
+          const auto inertia1 = inverse_inertia(current.body1, angular1);
+          const auto inertia2 = inverse_inertia(current.body2, angular2);
+          const auto inverse_mass1 = inverse_masses_[current.body1];
+          const auto inverse_mass2 = inverse_masses_[current.body2];
+          const auto mass = inverse_mass1 + inverse_mass2 + angular1.dot(inertia1) + angular2.dot(inertia2);
+
+          body1_[slot] = current.body1;
+          body2_[slot] = current.body2;
+          normal_x_[slot] = current.normal[0];
+          normal_y_[slot] = current.normal[1];
+          normal_z_[slot] = current.normal[2];
+          angular1_x_[slot] = angular1[0];
+          angular1_y_[slot] = angular1[1];
+          angular1_z_[slot] = angular1[2];
+          angular2_x_[slot] = angular2[0];
+          angular2_y_[slot] = angular2[1];
+          angular2_z_[slot] = angular2[2];
+          inertia1_x_[slot] = inertia1[0];
+          inertia1_y_[slot] = inertia1[1];
+          inertia1_z_[slot] = inertia1[2];
+          inertia2_x_[slot] = inertia2[0];
+          inertia2_y_[slot] = inertia2[1];
+          inertia2_z_[slot] = inertia2[2];
+          inverse_mass1_[slot] = inverse_mass1;
+          inverse_mass2_[slot] = inverse_mass2;
+          effective_mass_[slot] = mass > 0.f ? 1.f / mass : 0.f;
+          bias_[slot] = current.bias;
+          lower_[slot] = current.lower;
+          upper_[slot] = current.upper;
+          friction_[slot] = current.friction;
+          normal_row_[slot] = static_cast<std::uint32_t>(lane_of[current.normal_row]);
+        }
+      }
+
+      void solve_batch(size_type first)
+      {
+        // Empty lanes read body 0 and have a zero Jacobian and mass, so their impulse stays 0; they are not scattered.
+        std::array<std::uint32_t, batch_width> body1;
+        std::array<std::uint32_t, batch_width> body2;
+
+        for(size_type lane = 0; lane < batch_width; ++lane)
+        {
+          body1[lane] = body1_[first + lane] != invalid_body ? body1_[first + lane] : 0;
+          body2[lane] = body2_[first + lane] != invalid_body ? body2_[first + lane] : 0;
+        }
+
+        // Friction bounds follow the current normal impulse.
+        std::array<float, batch_width> normal_impulse;
+
+        for(size_type lane = 0; lane < batch_width; ++lane)
+        {
+          normal_impulse[lane] = impulse_[normal_row_[first + lane]];
+        }
+
+#if defined(NUTS_MATH_SSE2)
+        const auto gather = [](const std::vector<math::vector3f>& values, const std::array<std::uint32_t, batch_width>& bodies, size_type axis)
+        {
+          return _mm_setr_ps(values[bodies[0]][axis], values[bodies[1]][axis], values[bodies[2]][axis], values[bodies[3]][axis]);
+        };
+
+        const auto load = [first](const std::vector<float>& values)
+        {
+          return _mm_loadu_ps(&values[first]);
+        };
+
+        const auto dot = [](__m128 x1, __m128 y1, __m128 z1, __m128 x2, __m128 y2, __m128 z2)
+        {
+          return _mm_add_ps(_mm_add_ps(_mm_mul_ps(x1, x2), _mm_mul_ps(y1, y2)), _mm_mul_ps(z1, z2));
+        };
+
+        auto velocity1_x = gather(linear_velocities_, body1, 0), velocity1_y = gather(linear_velocities_, body1, 1), velocity1_z = gather(linear_velocities_, body1, 2);
+        auto velocity2_x = gather(linear_velocities_, body2, 0), velocity2_y = gather(linear_velocities_, body2, 1), velocity2_z = gather(linear_velocities_, body2, 2);
+        auto spin1_x = gather(angular_velocities_, body1, 0), spin1_y = gather(angular_velocities_, body1, 1), spin1_z = gather(angular_velocities_, body1, 2);
+        auto spin2_x = gather(angular_velocities_, body2, 0), spin2_y = gather(angular_velocities_, body2, 1), spin2_z = gather(angular_velocities_, body2, 2);
+
+        const auto normal_x = load(normal_x_), normal_y = load(normal_y_), normal_z = load(normal_z_);
+
+        // J v = n . (v1 - v2) + (r1 x n) . w1 - (r2 x n) . w2
+        const auto relative = _mm_add_ps(
+          dot(normal_x, normal_y, normal_z, _mm_sub_ps(velocity1_x, velocity2_x), _mm_sub_ps(velocity1_y, velocity2_y), _mm_sub_ps(velocity1_z, velocity2_z)),
+          _mm_sub_ps(dot(load(angular1_x_), load(angular1_y_), load(angular1_z_), spin1_x, spin1_y, spin1_z),
+            dot(load(angular2_x_), load(angular2_y_), load(angular2_z_), spin2_x, spin2_y, spin2_z)));
+
+        const auto friction = load(friction_);
+        const auto bound = _mm_mul_ps(friction, _mm_loadu_ps(normal_impulse.data()));
+        const auto is_friction = _mm_cmpgt_ps(friction, _mm_setzero_ps());
+        const auto lower = _mm_or_ps(_mm_and_ps(is_friction, _mm_sub_ps(_mm_setzero_ps(), bound)), _mm_andnot_ps(is_friction, load(lower_)));
+        const auto upper = _mm_or_ps(_mm_and_ps(is_friction, bound), _mm_andnot_ps(is_friction, load(upper_)));
+
+        const auto old_impulse = load(impulse_);
+        const auto wanted = _mm_sub_ps(old_impulse, _mm_mul_ps(load(effective_mass_), _mm_add_ps(relative, load(bias_))));
+        const auto new_impulse = _mm_min_ps(_mm_max_ps(wanted, lower), upper);
+        const auto delta = _mm_sub_ps(new_impulse, old_impulse);
+
+        _mm_storeu_ps(&impulse_[first], new_impulse);
+
+        const auto linear1 = _mm_mul_ps(delta, load(inverse_mass1_));
+        const auto linear2 = _mm_mul_ps(delta, load(inverse_mass2_));
+
+        velocity1_x = _mm_add_ps(velocity1_x, _mm_mul_ps(normal_x, linear1));
+        velocity1_y = _mm_add_ps(velocity1_y, _mm_mul_ps(normal_y, linear1));
+        velocity1_z = _mm_add_ps(velocity1_z, _mm_mul_ps(normal_z, linear1));
+        velocity2_x = _mm_sub_ps(velocity2_x, _mm_mul_ps(normal_x, linear2));
+        velocity2_y = _mm_sub_ps(velocity2_y, _mm_mul_ps(normal_y, linear2));
+        velocity2_z = _mm_sub_ps(velocity2_z, _mm_mul_ps(normal_z, linear2));
+        spin1_x = _mm_add_ps(spin1_x, _mm_mul_ps(load(inertia1_x_), delta));
+        spin1_y = _mm_add_ps(spin1_y, _mm_mul_ps(load(inertia1_y_), delta));
+        spin1_z = _mm_add_ps(spin1_z, _mm_mul_ps(load(inertia1_z_), delta));
+        spin2_x = _mm_sub_ps(spin2_x, _mm_mul_ps(load(inertia2_x_), delta));
+        spin2_y = _mm_sub_ps(spin2_y, _mm_mul_ps(load(inertia2_y_), delta));
+        spin2_z = _mm_sub_ps(spin2_z, _mm_mul_ps(load(inertia2_z_), delta));
+
+        alignas(16) std::array<std::array<float, batch_width>, 12> out;
+        const __m128 results[12]{
+          velocity1_x, velocity1_y, velocity1_z, velocity2_x, velocity2_y, velocity2_z, spin1_x, spin1_y, spin1_z, spin2_x, spin2_y, spin2_z};
+
+        for(size_type component = 0; component < 12; ++component)
+        {
+          _mm_store_ps(out[component].data(), results[component]);
+        }
+
+        // Static bodies never change, so lanes sharing one may all write it back.
+        for(size_type lane = 0; lane < batch_width; ++lane)
+        {
+          if(body1_[first + lane] == invalid_body)
+            continue;
+
+          linear_velocities_[body1[lane]] = math::vector3f{out[0][lane], out[1][lane], out[2][lane]};
+          linear_velocities_[body2[lane]] = math::vector3f{out[3][lane], out[4][lane], out[5][lane]};
+          angular_velocities_[body1[lane]] = math::vector3f{out[6][lane], out[7][lane], out[8][lane]};
+          angular_velocities_[body2[lane]] = math::vector3f{out[9][lane], out[10][lane], out[11][lane]};
+        }
+#else
+        for(size_type lane = 0; lane < batch_width; ++lane)
+        {
+          const auto slot = first + lane;
+
+          if(body1_[slot] == invalid_body)
+            continue;
+
+          auto& velocity1 = linear_velocities_[body1[lane]];
+          auto& velocity2 = linear_velocities_[body2[lane]];
+          auto& spin1 = angular_velocities_[body1[lane]];
+          auto& spin2 = angular_velocities_[body2[lane]];
+
+          const math::vector3f normal{normal_x_[slot], normal_y_[slot], normal_z_[slot]};
+          const math::vector3f angular1{angular1_x_[slot], angular1_y_[slot], angular1_z_[slot]};
+          const math::vector3f angular2{angular2_x_[slot], angular2_y_[slot], angular2_z_[slot]};
+
+          const auto relative = normal.dot(velocity1 - velocity2) + angular1.dot(spin1) - angular2.dot(spin2);
+          const auto bound = friction_[slot] * normal_impulse[lane];
+          const auto lower = friction_[slot] > 0.f ? -bound : lower_[slot];
+          const auto upper = friction_[slot] > 0.f ? bound : upper_[slot];
+
+          const auto old_impulse = impulse_[slot];
+          impulse_[slot] = std::min(std::max(old_impulse - effective_mass_[slot] * (relative + bias_[slot]), lower), upper);
+          const auto delta = impulse_[slot] - old_impulse;
+
+          velocity1 += normal * (delta * inverse_mass1_[slot]);
+          velocity2 -= normal * (delta * inverse_mass2_[slot]);
+          spin1 += math::vector3f{inertia1_x_[slot], inertia1_y_[slot], inertia1_z_[slot]} * delta;
+          spin2 -= math::vector3f{inertia2_x_[slot], inertia2_y_[slot], inertia2_z_[slot]} * delta;
+        }
+#endif
+      }
+
+      std::vector<math::vector3f> positions_;
+      std::vector<math::vector4f> orientations_;
+      std::vector<math::vector3f> linear_velocities_;
+      std::vector<math::vector3f> angular_velocities_;
+      std::vector<float> inverse_masses_;
+      std::vector<math::vector3f> inverse_inertias_;
+      math::vector3f gravity_{0.f, -9.81f, 0.f};
+
+      std::vector<contact> contacts_;
+      std::vector<ball_joint> joints_;
+      std::vector<detail::constraint_row> rows_;
+
+      // Packed rows, batch_width consecutive lanes per batch.
+      std::vector<body_index> body1_;
+      std::vector<body_index> body2_;
+      std::vector<std::uint32_t> normal_row_;
+      std::vector<float> normal_x_, normal_y_, normal_z_;
+      std::vector<float> angular1_x_, angular1_y_, angular1_z_;
+      std::vector<float> angular2_x_, angular2_y_, angular2_z_;
+      std::vector<float> inertia1_x_, inertia1_y_, inertia1_z_;
+      std::vector<float> inertia2_x_, inertia2_y_, inertia2_z_;
+      std::vector<float> inverse_mass1_, inverse_mass2_;
+      std::vector<float> effective_mass_;
+      std::vector<float> bias_;
+      std::vector<float> lower_;
+      std::vector<float> upper_;
+      std::vector<float> friction_;
+      std::vector<float> impulse_;
+    };
+  }
+}
@@ -0,0 +1,529 @@
+//
+// Copyright © 2017 Constanze Pfennig. All rights reserved.
+//
+
+#pragma once
+
+#include "../math/vector.h"
+#include "../math/mesh.h"
+#include "../math/simd.h"
+#include "../parallel/parallel_for.h"
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+
+
+namespace nuts
+{
+  namespace physics
+  {
+    namespace detail
+    {
+      // Greedy graph coloring: every constraint gets the lowest color none of its particles is used
+      // with yet, so the constraints of one color share no particle and can be projected in parallel.
+      template<std::size_t Particles>
+      std::vector<std::uint32_t> color_constraints(const std::vector<std::array<std::uint32_t, Particles>>& constraints, std::size_t particle_count,
+        std::size_t& color_count)
+      {
+        std::vector<std::vector<std::uint64_t>> used(1, std::vector<std::uint64_t>(particle_count, 0));
+        std::vector<std::uint32_t> colors(constraints.size());
+        color_count = 0;
+
+        for(std::size_t constraint = 0; constraint < constraints.size(); ++constraint)
+        {
+          for(std::size_t word = 0;; ++word)
+          {
+            if(word == used.size())
+              used.emplace_back(particle_count, 0);
+
+            std::uint64_t taken = 0;
+
+            for(auto particle : constraints[constraint])
+            {
+              taken |= used[word][particle];
+            }
+
+            if(taken == ~std::uint64_t{0})
+              continue;
+
+            std::size_t bit = 0;
+
+            while(taken >> bit & 1)
+            {
+              ++bit;
+            }
+
+            for(auto particle : constraints[constraint])
+            {
+              used[word][particle] |= std::uint64_t{1} << bit;
+            }
+
+            colors[constraint] = static_cast<std::uint32_t>(64 * word + bit);
+            color_count = std::max<std::size_t>(color_count, colors[constraint] + 1);
+            break;
+          }
+        }
+
+        return colors;
+      }
+
+      // Constraints of one kind sorted by color, with their data per field (structure of arrays).
+      template<std::size_t Particles>
+      struct constraint_batches
+      {
+        std::array<std::vector<std::uint32_t>, Particles> particles;
+        std::vector<float> rest;
+        std::vector<float> compliance;
+        std::vector<float> lambda;
+        // Constraints of color c are [offsets[c], offsets[c + 1]).
+        std::vector<std::size_t> offsets;
+
+        std::size_t size() const noexcept
+        {
+          return rest.size();
+        }
+
+        std::size_t color_count() const noexcept
+        {
+          return offsets.empty() ? 0 : offsets.size() - 1;
+        }
+      };
+
+      template<std::size_t Particles>
+      constraint_batches<Particles> make_batches(const std::vector<std::array<std::uint32_t, Particles>>& constraints, const std::vector<float>& rest,
+        const std::vector<float>& compliance, std::size_t particle_count)
+      {
+        std::size_t color_count = 0;
+        const auto colors = color_constraints(constraints, particle_count, color_count);
+
+        constraint_batches<Particles> batches;
+        batches.offsets.assign(color_count + 1, 0);
+
+        for(auto color : colors)
+        {
+          ++batches.offsets[color + 1];
+        }
+
+        for(std::size_t color = 0; color < color_count; ++color)
+        {
+          batches.offsets[color + 1] += batches.offsets[color];
+        }
+
+        for(auto& particles : batches.particles)
+        {
+          particles.resize(constraints.size());
+        }
+
+        batches.rest.resize(constraints.size());
+        batches.compliance.resize(constraints.size());
+        batches.lambda.assign(constraints.size(), 0.f);
+
+        auto fill = batches.offsets;
+
+        for(std::size_t constraint = 0; constraint < constraints.size(); ++constraint)
+        {
+          const auto target = fill[colors[constraint]]++;
+
+          for(std::size_t particle = 0; particle < Particles; ++particle)
+          {
+            batches.particles[particle][target] = constraints[constraint][particle];
+          }
+
+          batches.rest[target] = rest[constraint];
+          batches.compliance[target] = compliance[constraint];
+        }
+
+        return batches;
+      }
+
+      // Signed angle between the triangles (wing1, edge1, edge2) and (wing2, edge2, edge1) about their
+      // shared edge, 0 where they are flat. Its gradient with respect to the four particles is well defined
+      // in the flat state too (Bridson et al., "Simulation of Clothing with Folds and Wrinkles").
+      inline float dihedral_angle(const math::vector3f& edge1, const math::vector3f& edge2, const math::vector3f& wing1, const math::vector3f& wing2)
+      {
+        const auto edge = edge2 - edge1;
+        const auto normal1 = math::cross(wing1 - edge1, wing1 - edge2);
+        const auto normal2 = math::cross(wing2 - edge2, wing2 - edge1);
+        const auto length = edge.length();
+
+        return length > 0.f ? std::atan2(math::cross(normal2, normal1).dot(edge) / length, normal1.dot(normal2)) : 0.f;
+      }
+    }
+
+
+    // Extended position based dynamics (Macklin et al., "XPBD: Position-Based Simulation of Compliant
+    // Constrained Dynamics") for particles with distance and dihedral bending constraints. Compliance is
+    // the inverse stiffness (0 is rigid). The constraints are graph colored once; a Gauss-Seidel
+    // iteration then walks the colors in order and projects all constraints of a color in parallel,
+    // distance constraints four at a time in SSE registers. Particles with inverse mass 0 are fixed.
+    class xpbd_solver
+    {
+    public:
+      using size_type = std::size_t;
+      using particle_index = std::uint32_t;
+
+      xpbd_solver() = default;
+
+      xpbd_solver(std::vector<math::vector3f> positions, std::vector<float> inverse_masses)
+        : positions_{std::move(positions)},
+          previous_(positions_.size()),
+          velocities_(positions_.size(), math::vector3f{0.f, 0.f, 0.f}),
+          inverse_masses_{std::move(inverse_masses)}
+      {
+        assert(positions_.size() == inverse_masses_.size());
+      }
+
+      size_type particle_count() const noexcept
+      {
+        return positions_.size();
+      }
+
+      const std::vector<math::vector3f>& positions() const noexcept
+      {
+        return positions_;
+      }
+
+      std::vector<math::vector3f>& positions() noexcept
+      {
+        return positions_;
+      }
+
+      std::vector<math::vector3f>& velocities() noexcept
+      {
+        return velocities_;
+      }
+
+      const std::vector<math::vector3f>& velocities() const noexcept
+      {
+        return velocities_;
+      }
+
+      std::vector<float>& inverse_masses() noexcept
+      {
+        return inverse_masses_;
+      }
+
+      const math::vector3f& gravity() const noexcept
+      {
+        return gravity_;
+      }
+
+      void set_gravity(const math::vector3f& gravity) noexcept
+      {
+        gravity_ = gravity;
+      }
+
+      // Keeps the distance of two particles at its current value.
+      void add_distance_constraint(particle_index particle1, particle_index particle2, float compliance = 0.f)
+      {
+        add_distance_constraint(particle1, particle2, (positions_[particle1] - positions_[particle2]).length(), compliance);
+      }
+
+      void add_distance_constraint(particle_index particle1, particle_index particle2, float rest_length, float compliance)
+      {
+        assert(particle1 < particle_count() && particle2 < particle_count() && particle1 != particle2);
+
+        distance_constraints_.push_back({{particle1, particle2}});
+        distance_rest_.push_back(rest_length);
+        distance_compliance_.push_back(compliance);
+        dirty_ = true;
+      }
+
+      // Keeps the dihedral angle between the triangles (wing1, edge1, edge2) and (wing2, edge2, edge1) at its current value.
+      void add_bending_constraint(particle_index edge1, particle_index edge2, particle_index wing1, particle_index wing2, float compliance = 0.f)
+      {
+        assert(edge1 < particle_count() && edge2 < particle_count() && wing1 < particle_count() && wing2 < particle_count());
+
+        bending_constraints_.push_back({{edge1, edge2, wing1, wing2}});
+        bending_rest_.push_back(detail::dihedral_angle(positions_[edge1], positions_[edge2], positions_[wing1], positions_[wing2]));
+        bending_compliance_.push_back(compliance);
+        dirty_ = true;
+      }
+
+      size_type distance_constraint_count() const noexcept
+      {
+        return distance_constraints_.size();
+      }
+
+      size_type bending_constraint_count() const noexcept
+      {
+        return bending_constraints_.size();
+      }
+
+      // Number of colors, i.e. sequential parallel batches per iteration.
+      size_type color_count()
+      {
+        update_batches();
+        return distance_batches_.color_count() + bending_batches_.color_count();
+      }
+
+      // Advances by time_step in substeps, each with the given number of constraint iterations.
+      void step(float time_step, size_type substeps = 1, size_type iterations = 1, size_type threads = parallel::thread_count())
+      {
+        assert(substeps > 0);
+
+        update_batches();
+
+        const auto dt = time_step / static_cast<float>(substeps);
+
+        for(size_type substep = 0; substep < substeps; ++substep)
+        {
+          parallel::parallel_for(0, particle_count(), [&](size_type first, size_type last)
+          {
+            for(auto particle = first; particle < last; ++particle)
+            {
+              previous_[particle] = positions_[particle];
+
+              if(inverse_masses_[particle] > 0.f)
+              {
+                velocities_[particle] += gravity_ * dt;
+                positions_[particle] += velocities_[particle] * dt;
+              }
+            }
+          }, threads);
+
+          std::fill(distance_batches_.lambda.begin(), distance_batches_.lambda.end(), 0.f);
+          std::fill(bending_batches_.lambda.begin(), bending_batches_.lambda.end(), 0.f);
+
+          const auto inverse_dt2 = 1.f / (dt * dt);
+
+          for(size_type iteration = 0; iteration < iterations; ++iteration)
+          {
+            for(size_type color = 0; color < distance_batches_.color_count(); ++color)
+            {
+              const auto begin = distance_batches_.offsets[color];
+
+              parallel::parallel_for(begin, distance_batches_.offsets[color + 1], [&](size_type first, size_type last)
+              {
+                project_distance(first, last, inverse_dt2);
+              }, threads);
+            }
+
+            for(size_type color = 0; color < bending_batches_.color_count(); ++color)
+            {
+              parallel::parallel_for(bending_batches_.offsets[color], bending_batches_.offsets[color + 1], [&](size_type first, size_type last)
+              {
+                project_bending(first, last, inverse_dt2);
+              }, threads);
+            }
+          }
+
+          const auto inverse_dt = 1.f / dt;
+
+          parallel::parallel_for(0, particle_count(), [&](size_type first, size_type last)
+          {
+            for(auto particle = first; particle < last; ++particle)
+            {
+              velocities_[particle] = (positions_[particle] - previous_[particle]) * inverse_dt;
+            }
+          }, threads);
+        }
+      }
+
+    private:
+      void update_batches()
+      {
+        if(!dirty_)
+          return;
+
+        distance_batches_ = detail::make_batches(distance_constraints_, distance_rest_, distance_compliance_, particle_count());
+        bending_batches_ = detail::make_batches(bending_constraints_, bending_rest_, bending_compliance_, particle_count());
+        dirty_ = false;
+      }
+
+      // Projects the distance constraints [first, last) of one color: with n = (p1 - p2) / |p1 - p2| and
+      // C = |p1 - p2| - rest, dlambda = (-C - alpha lambda) / (w1 + w2 + alpha) with alpha = compliance / dt^2.
+      void project_distance(size_type first, size_type last, float inverse_dt2)
+      {
+        auto& batches = distance_batches_;
+        auto constraint = first;
+
+#if defined(NUTS_MATH_SSE2)
+        for(; constraint + 4 <= last; constraint += 4)
+        {
+          const auto index1 = &batches.particles[0][constraint];
+          const auto index2 = &batches.particles[1][constraint];
+
+          std::array<math::vector3f*, 4> position1;
+          std::array<math::vector3f*, 4> position2;
+
+          for(size_type lane = 0; lane < 4; ++lane)
+          {
+            position1[lane] = &positions_[index1[lane]];
+            position2[lane] = &positions_[index2[lane]];
+          }
+
+          const auto gather = [](const std::array<math::vector3f*, 4>& positions, size_type axis)
+          {
+            return _mm_setr_ps((*positions[0])[axis], (*positions[1])[axis], (*positions[2])[axis], (*positions[3])[axis]);
+          };
+
+          const auto weight1 = _mm_setr_ps(inverse_masses_[index1[0]], inverse_masses_[index1[1]], inverse_masses_[index1[2]], inverse_masses_[index1[3]]);
+          const auto weight2 = _mm_setr_ps(inverse_masses_[index2[0]], inverse_masses_[index2[1]], inverse_masses_[index2[2]], inverse_masses_[index2[3]]);
+
+          const auto dx = _mm_sub_ps(gather(position1, 0), gather(position2, 0));
+          const auto dy = _mm_sub_ps(gather(position1, 1), gather(position2, 1));
+          const auto dz = _mm_sub_ps(gather(position1, 2), gather(position2, 2));
+          const auto length = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz)));
+
+          const auto alpha = _mm_mul_ps(_mm_loadu_ps(&batches.compliance[constraint]), _mm_set1_ps(inverse_dt2));
+          const auto lambda = _mm_loadu_ps(&batches.lambda[constraint]);
+          const auto violation = _mm_sub_ps(length, _mm_loadu_ps(&batches.rest[constraint]));
+          const auto denominator = _mm_add_ps(_mm_add_ps(weight1, weight2), alpha);
+
+          // Lanes with coincident particles or two fixed particles are left alone.
+          const auto valid = _mm_and_ps(_mm_cmpgt_ps(length, _mm_setzero_ps()), _mm_cmpgt_ps(denominator, _mm_setzero_ps()));
+          const auto delta = _mm_and_ps(valid, _mm_div_ps(_mm_sub_ps(_mm_setzero_ps(), _mm_add_ps(violation, _mm_mul_ps(alpha, lambda))), denominator));
+          const auto scale = _mm_and_ps(valid, _mm_div_ps(delta, length));
+
+          _mm_storeu_ps(&batches.lambda[constraint], _mm_add_ps(lambda, delta));
+
+          alignas(16) std::array<std::array<float, 4>, 3> correction;
+          _mm_store_ps(correction[0].data(), _mm_mul_ps(dx, scale));
+          _mm_store_ps(correction[1].data(), _mm_mul_ps(dy, scale));
+          _mm_store_ps(correction[2].data(), _mm_mul_ps(dz, scale));
+
+          for(size_type lane = 0; lane < 4; ++lane)
+          {
+            const math::vector3f step{correction[0][lane], correction[1][lane], correction[2][lane]};
+            *position1[lane] += step * inverse_masses_[index1[lane]];
+            *position2[lane] -= step * inverse_masses_[index2[lane]];
+          }
+        }
+#endif
+
+        for(; constraint < last; ++constraint)
+        {
+          const auto particle1 = batches.particles[0][constraint];
+          const auto particle2 = batches.particles[1][constraint];
+          const auto weight1 = inverse_masses_[particle1];
+          const auto weight2 = inverse_masses_[particle2];
+
+          const auto difference = positions_[particle1] - positions_[particle2];
+          const auto length = difference.length();
+          const auto alpha = batches.compliance[constraint] * inverse_dt2;
+          const auto denominator = weight1 + weight2 + alpha;
+
+          if(length <= 0.f || denominator <= 0.f)
+            continue;
+
+          const auto delta = (-(length - batches.rest[constraint]) - alpha * batches.lambda[constraint]) / denominator;
+          const auto step = difference * (delta / length);
+
+          batches.lambda[constraint] += delta;
+          positions_[particle1] += step * weight1;
+          positions_[particle2] -= step * weight2;
+        }
+      }
+
+      // Projects the bending constraints [first, last) of one color; C is the dihedral angle minus its rest value.
+      void project_bending(size_type first, size_type last, float inverse_dt2)
+      {
+        auto& batches = bending_batches_;
+
+        for(auto constraint = first; constraint < last; ++constraint)
+        {
+          const std::array<particle_index, 4> particles{
+            batches.particles[0][constraint], batches.particles[1][constraint], batches.particles[2][constraint], batches.particles[3][constraint]};
+
+          const auto& edge1 = positions_[particles[0]];
+          const auto& edge2 = positions_[particles[1]];
+          const auto& wing1 = positions_[particles[2]];
+          const auto& wing2 = positions_[particles[3]];
+
+          const auto edge = edge2 - edge1;
+          const auto normal1 = math::cross(wing1 - edge1, wing1 - edge2);
+          const auto normal2 = math::cross(wing2 - edge2, wing2 - edge1);
+          const auto length = edge.length();
+          const auto area1 = normal1.dot(normal1);
+          const auto area2 = normal2.dot(normal2);
+
+          if(length <= 0.f || area1 <= 0.f || area2 <= 0.f)
+            continue;
+
+          const auto scaled1 = normal1 * (1.f / area1);
+          const auto scaled2 = normal2 * (1.f / area2);
+          const auto inverse_length = 1.f / length;
+
+          std::array<math::vector3f, 4> gradient;
+          gradient[0] = scaled1 * ((wing1 - edge2).dot(edge) * inverse_length) + scaled2 * ((wing2 - edge2).dot(edge) * inverse_length);
+          gradient[1] = scaled1 * (-(wing1 - edge1).dot(edge) * inverse_length) - scaled2 * ((wing2 - edge1).dot(edge) * inverse_length);
+          gradient[2] = scaled1 * length;
+          gradient[3] = scaled2 * length;
+
+          float weighted = 0.f;
+
+          for(size_type corner = 0; corner < 4; ++corner)
+          {
+            weighted += inverse_masses_[particles[corner]] * gradient[corner].dot(gradient[corner]);
+          }
+
+          const auto alpha = batches.compliance[constraint] * inverse_dt2;
+
+          if(weighted + alpha <= 0.f)
+            continue;
+
+          const auto angle = std::atan2(math::cross(normal2, normal1).dot(edge) * inverse_length, normal1.dot(normal2));
+          const auto delta = (-(angle - batches.rest[constraint]) - alpha * batches.lambda[constraint]) / (weighted + alpha);
+
+          batches.lambda[constraint] += delta;
+
+          for(size_type corner = 0; corner < 4; ++corner)
+          {
+            positions_[particles[corner]] += gradient[corner] * (inverse_masses_[particles[corner]] * delta);
+          }
+        }
+      }
+
+      std::vector<math::vector3f> positions_;
+      std::vector<math::vector3f> previous_;
+      std::vector<math::vector3f> velocities_;
+      std::vector<float> inverse_masses_;
+      math::vector3f gravity_{0.f, -9.81f, 0.f};
+
+      std::vector<std::array<std::uint32_t, 2>> distance_constraints_;
+      std::vector<float> distance_rest_;
+      std::vector<float> distance_compliance_;
+      std::vector<std::array<std::uint32_t, 4>> bending_constraints_;
+      std::vector<float> bending_rest_;
+      std::vector<float> bending_compliance_;
+
+      bool dirty_ = false;
+      detail::constraint_batches<2> distance_batches_;
+      detail::constraint_batches<4> bending_batches_;
+    };
+
+
+    // Adds a distance constraint for every edge of the triangle mesh and a bending constraint for every
+    // edge shared by two consistently oriented triangles, with the rest state taken from the current positions.
+    inline void add_cloth_constraints(xpbd_solver& solver, const std::vector<math::mesh_index>& indices, float stretch_compliance, float bending_compliance)
+    {
+      math::triangle_mesh mesh{solver.positions(), indices};
+      mesh.build_adjacency();
+
+      const auto& opposite = mesh.opposite();
+
+      for(std::size_t half_edge = 0; half_edge < indices.size(); ++half_edge)
+      {
+        const auto from = indices[half_edge];
+        const auto to = indices[math::triangle_mesh::next_half_edge(half_edge)];
+        const auto other = opposite[half_edge];
+
+        // Every edge once: border edges always, inner edges from their lower numbered half-edge.
+        if(other != math::invalid_mesh_index && other < half_edge)
+          continue;
+
+        solver.add_distance_constraint(from, to, stretch_compliance);
+
+        if(other == math::invalid_mesh_index)
+          continue;
+
+        const auto wing1 = indices[math::triangle_mesh::next_half_edge(math::triangle_mesh::next_half_edge(half_edge))];
+        const auto wing2 = indices[math::triangle_mesh::next_half_edge(math::triangle_mesh::next_half_edge(other))];
+
+        solver.add_bending_constraint(from, to, wing1, wing2, bending_compliance);
+      }
+    }
+  }
+}